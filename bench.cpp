@@ -0,0 +1,575 @@
+//=====================================================================
+//
+// bench.cpp - micro benchmarks for the kcp add-on modules
+//
+// usage: kcp_bench table [count]
+//        kcp_bench sched [connections] [active]
+//        kcp_bench shard [workers] [connections] [seconds]
+//        kcp_bench scale [workers] [connections] [seconds]
+//        kcp_bench bottleneck [KB/s] [rtt] [queue KB] [loss %] [seconds]
+//
+//=====================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+
+#include "ikcp.h"
+#include "ikcp_table.h"
+#include "ikcp_sched.h"
+
+#ifdef KCP_BENCH_SHARD
+#include <thread>
+#include <atomic>
+#include <ctime>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ikcp_shard.h"
+#endif
+
+
+static double now_ns()
+{
+	using namespace std::chrono;
+	return (double)duration_cast<nanoseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+static IUINT32 xorshift(IUINT32 &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+
+//---------------------------------------------------------------------
+// session table: 'count' sessions, lookups in random order
+//---------------------------------------------------------------------
+static int bench_table(int count)
+{
+	std::vector<IUINT32> convs(count), order(count);
+	IUINT32 seed = 0x12345678;
+	ikcpcb *dummy = (ikcpcb*)&convs;   // any non-NULL value
+	double t0, t1, worst = 0;
+	long found = 0;
+	int i;
+
+	for (i = 0; i < count; i++) convs[i] = xorshift(seed);
+	for (i = 0; i < count; i++) order[i] = convs[xorshift(seed) % count];
+
+	ikcp_table *table = ikcp_table_create(16);
+	t0 = now_ns();
+	for (i = 0; i < count; i++) {
+		double s = now_ns();
+		ikcp_table_insert(table, convs[i], dummy);
+		double e = now_ns() - s;
+		if (e > worst) worst = e;
+	}
+	t1 = now_ns();
+	printf("ikcp_table  insert  %7.1f ns/op  (worst %.0f ns, size %u)\n",
+		(t1 - t0) / count, worst, ikcp_table_size(table));
+
+	t0 = now_ns();
+	for (i = 0; i < count; i++) {
+		found += ikcp_table_find(table, order[i]) != NULL;
+	}
+	t1 = now_ns();
+	printf("ikcp_table  find    %7.1f ns/op\n", (t1 - t0) / count);
+
+	// batches of 16 as from recvmmsg: prefetch, then look up
+	t0 = now_ns();
+	for (i = 0; i + 16 <= count; i += 16) {
+		int k;
+		for (k = 0; k < 16; k++) ikcp_table_prefetch(table, order[i + k]);
+		for (k = 0; k < 16; k++)
+			found += ikcp_table_find(table, order[i + k]) != NULL;
+	}
+	t1 = now_ns();
+	printf("ikcp_table  find/pf %7.1f ns/op\n", (t1 - t0) / count);
+
+	t0 = now_ns();
+	for (i = 0; i < count; i++) {
+		found += ikcp_table_find(table, xorshift(seed)) != NULL;
+	}
+	t1 = now_ns();
+	printf("ikcp_table  miss    %7.1f ns/op\n", (t1 - t0) / count);
+
+	t0 = now_ns();
+	for (i = 0; i < count; i += 2) ikcp_table_erase(table, convs[i]);
+	t1 = now_ns();
+	printf("ikcp_table  erase   %7.1f ns/op  (size %u)\n",
+		(t1 - t0) / ((count + 1) / 2), ikcp_table_size(table));
+	ikcp_table_release(table);
+
+	std::unordered_map<IUINT32, ikcpcb*> umap;
+	worst = 0;
+	t0 = now_ns();
+	for (i = 0; i < count; i++) {
+		double s = now_ns();
+		umap[convs[i]] = dummy;
+		double e = now_ns() - s;
+		if (e > worst) worst = e;
+	}
+	t1 = now_ns();
+	printf("unordered   insert  %7.1f ns/op  (worst %.0f ns)\n",
+		(t1 - t0) / count, worst);
+	t0 = now_ns();
+	for (i = 0; i < count; i++) found += umap.count(order[i]);
+	t1 = now_ns();
+	printf("unordered   find    %7.1f ns/op\n", (t1 - t0) / count);
+
+	std::map<IUINT32, ikcpcb*> tmap;
+	for (i = 0; i < count; i++) tmap[convs[i]] = dummy;
+	t0 = now_ns();
+	for (i = 0; i < count; i++) found += tmap.count(order[i]);
+	t1 = now_ns();
+	printf("std::map    find    %7.1f ns/op\n", (t1 - t0) / count);
+
+	return found > 0? 0 : 1;
+}
+
+
+//---------------------------------------------------------------------
+// scheduler: 'count' connections, 'active' of them sending, 10 virtual
+// seconds updated with the wheel vs. ikcp_update on everything / 10ms
+//---------------------------------------------------------------------
+static int bench_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	(void)buf; (void)len; (void)kcp; (void)user;
+	return 0;
+}
+
+static double bench_sched_run(int count, int active, int wheel)
+{
+	std::vector<ikcpcb*> kcps(count);
+	std::vector<ikcp_sched_entry> entries(count);
+	ikcp_sched *sched = ikcp_sched_create(0);
+	char data[512];
+	long updates = 0;
+	double t0, t1;
+	IUINT32 current;
+	int i;
+
+	memset(data, 0, sizeof(data));
+	for (i = 0; i < count; i++) {
+		kcps[i] = ikcp_create((IUINT32)i, NULL);
+		ikcp_setoutput(kcps[i], bench_output);
+		ikcp_update(kcps[i], 0);
+		ikcp_sched_add(sched, &entries[i], kcps[i]);
+	}
+
+	t0 = now_ns();
+	for (current = 1; current <= 10000; current++) {
+		// active connections send every 20ms (the peer never acks)
+		if (current % 20 == 0) {
+			for (i = 0; i < active; i++) {
+				if (ikcp_waitsnd(kcps[i]) < 64)
+					ikcp_send(kcps[i], data, sizeof(data));
+				if (wheel) ikcp_sched_touch(sched, &entries[i], current);
+			}
+		}
+		if (wheel) {
+			updates += ikcp_sched_run(sched, current);
+		}
+		else if (current % 10 == 0) {
+			for (i = 0; i < count; i++) ikcp_update(kcps[i], current);
+			updates += count;
+		}
+	}
+	t1 = now_ns();
+
+	printf("%-6s %d connections, %d active: %8.1f us per ms, "
+		"%ld updates\n", wheel? "wheel" : "all", count, active,
+		(t1 - t0) / 1000.0 / 10000, updates);
+
+	for (i = 0; i < count; i++) ikcp_release(kcps[i]);
+	ikcp_sched_release(sched);
+	return t1 - t0;
+}
+
+static int bench_sched(int count, int active)
+{
+	bench_sched_run(count, active, 0);
+	bench_sched_run(count, active, 1);
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// bottleneck: one connection sends for 'seconds' virtual seconds
+// through a drop-tail queue of 'queue' KB drained at 'rate' KB/s, then
+// rtt/2 of delay each way (acks aren't queued). 'loss' percent of the
+// data datagrams are lost at random before the queue. goodput, drops
+// (random and by the queue), timeouts and the most datagrams one
+// ikcp_update sent, of reno and bbr with pacing off and on and nocwnd
+//---------------------------------------------------------------------
+struct BottleneckPacket
+{
+	IUINT32 due;
+	std::vector<char> data;
+};
+
+struct BottleneckLink
+{
+	std::deque<BottleneckPacket> queue;   // waiting at the bottleneck
+	std::deque<BottleneckPacket> wire;    // propagating, in due order
+	long queued, limit, drops, burst;
+	IUINT32 current, delay, loss, seed;
+};
+
+static void bottleneck_push(std::deque<BottleneckPacket> &q, IUINT32 due,
+	const char *buf, int len)
+{
+	q.push_back(BottleneckPacket());
+	q.back().due = due;
+	q.back().data.assign(buf, buf + len);
+}
+
+static int bottleneck_output(const char *buf, int len, ikcpcb *kcp,
+	void *user)
+{
+	BottleneckLink *link = (BottleneckLink*)user;
+	(void)kcp;
+	link->burst++;
+	if (link->limit == 0) {
+		// the return path: delay only
+		bottleneck_push(link->wire, link->current + link->delay, buf, len);
+	}
+	else if (xorshift(link->seed) % 100 < link->loss ||
+		link->queued + len > link->limit) {
+		link->drops++;
+	}
+	else {
+		bottleneck_push(link->queue, 0, buf, len);
+		link->queued += len;
+	}
+	return 0;
+}
+
+// input the datagrams due by now
+static void bottleneck_arrive(BottleneckLink *link, ikcpcb *kcp)
+{
+	while (!link->wire.empty() &&
+		(IINT32)(link->current - link->wire.front().due) >= 0) {
+		std::vector<char> &data = link->wire.front().data;
+		ikcp_input(kcp, &data[0], (long)data.size());
+		link->wire.pop_front();
+	}
+}
+
+static void bottleneck_run(const char *name, const struct IKCPCC *cc,
+	int pacing, int nc, int rate, int rtt, int queue, int loss,
+	int seconds)
+{
+	BottleneckLink fwd, rev;
+	ikcpcb *kcp1 = ikcp_create(0x11223344, &fwd);
+	ikcpcb *kcp2 = ikcp_create(0x11223344, &rev);
+	char data[1024], buffer[2048];
+	long long received = 0;
+	long credit = 0, burst = 0, len;
+	IUINT32 current;
+
+	fwd.queued = rev.queued = rev.limit = 0;
+	fwd.drops = rev.drops = 0;
+	fwd.limit = (long)queue * 1000;
+	fwd.delay = rev.delay = (IUINT32)rtt / 2;
+	fwd.loss = (IUINT32)loss;
+	fwd.seed = 0x12345678;
+
+	memset(data, 0, sizeof(data));
+	ikcp_setoutput(kcp1, bottleneck_output);
+	ikcp_setoutput(kcp2, bottleneck_output);
+	ikcp_nodelay(kcp1, 0, 10, 2, nc);
+	ikcp_nodelay(kcp2, 0, 10, 2, nc);
+	ikcp_wndsize(kcp1, 1024, 1024);
+	ikcp_wndsize(kcp2, 1024, 1024);
+	ikcp_setcc(kcp1, cc);
+	ikcp_pacing(kcp1, pacing);
+
+	for (current = 0; current < (IUINT32)seconds * 1000; current++) {
+		fwd.current = rev.current = current;
+		bottleneck_arrive(&fwd, kcp2);
+		bottleneck_arrive(&rev, kcp1);
+
+		// the bottleneck forwards 'rate' bytes per millisec
+		credit += rate;
+		while (!fwd.queue.empty() &&
+			credit >= (long)fwd.queue.front().data.size()) {
+			BottleneckPacket &packet = fwd.queue.front();
+			len = (long)packet.data.size();
+			credit -= len;
+			fwd.queued -= len;
+			packet.due = current + fwd.delay;
+			fwd.wire.push_back(BottleneckPacket());
+			fwd.wire.back().due = packet.due;
+			fwd.wire.back().data.swap(packet.data);
+			fwd.queue.pop_front();
+		}
+		if (fwd.queue.empty()) credit = 0;
+
+		while (ikcp_waitsnd(kcp1) < 2048) {
+			ikcp_send(kcp1, data, sizeof(data));
+		}
+		fwd.burst = 0;
+		ikcp_update(kcp1, current);
+		burst = std::max(burst, fwd.burst);
+		ikcp_update(kcp2, current);
+		while ((len = ikcp_recv(kcp2, buffer, sizeof(buffer))) > 0) {
+			received += len;
+		}
+	}
+
+	printf("%-12s %7.1f KB/s, %6ld dropped, %5u timeouts, "
+		"largest burst %3ld\n", name, received / 1000.0 / seconds,
+		fwd.drops, kcp1->xmit, burst);
+
+	ikcp_release(kcp1);
+	ikcp_release(kcp2);
+}
+
+static int bench_bottleneck(int rate, int rtt, int queue, int loss,
+	int seconds)
+{
+	printf("%d KB/s bottleneck, %d ms rtt, %d KB queue, %d%% loss, "
+		"%d seconds\n", rate, rtt, queue, loss, seconds);
+	bottleneck_run("reno", &ikcp_cc_reno, 0, 0, rate, rtt, queue, loss,
+		seconds);
+	bottleneck_run("reno+pacing", &ikcp_cc_reno, 1, 0, rate, rtt, queue,
+		loss, seconds);
+	bottleneck_run("bbr", &ikcp_cc_bbr, 0, 0, rate, rtt, queue, loss,
+		seconds);
+	bottleneck_run("bbr+pacing", &ikcp_cc_bbr, 1, 0, rate, rtt, queue,
+		loss, seconds);
+	bottleneck_run("nocwnd", NULL, 0, 1, rate, rtt, queue, loss,
+		seconds);
+	return 0;
+}
+
+
+#ifdef KCP_BENCH_SHARD
+//---------------------------------------------------------------------
+// sharded runtime: a client runtime streams to a server runtime over
+// loopback with 1, 2, 4 .. 'workers' workers on each side. MB per cpu
+// second (all threads) shows the cost of sharding apart from the cores
+// the host has. 'scale' compares 1 and 'workers' workers only
+//---------------------------------------------------------------------
+struct ShardBench
+{
+	int connections;
+	struct sockaddr_in server;
+	std::vector<std::vector<ikcpcb*> > clients;   // per client worker
+	std::atomic<long long> received;
+};
+
+static void shard_setup(ikcpcb *kcp)
+{
+	ikcp_wndsize(kcp, 256, 256);
+	ikcp_nodelay(kcp, 1, 10, 2, 1);
+}
+
+static ikcpcb* shard_accept(ikcp_worker *worker, IUINT32 conv,
+	const struct sockaddr *addr, socklen_t addrlen, void *user)
+{
+	ikcpcb *kcp = ikcp_create(conv, NULL);
+	(void)worker; (void)addr; (void)addrlen; (void)user;
+	shard_setup(kcp);
+	return kcp;
+}
+
+static void shard_receive(ikcp_worker *worker, ikcpcb *kcp, void *user)
+{
+	ShardBench *bench = (ShardBench*)user;
+	char buffer[2048];
+	long long total = 0;
+	int hr;
+	(void)worker;
+	while ((hr = ikcp_recv(kcp, buffer, sizeof(buffer))) > 0) total += hr;
+	if (total > 0) bench->received += total;
+}
+
+// client connections of a worker: the convs it owns
+static void shard_start(ikcp_worker *worker, void *user)
+{
+	ShardBench *bench = (ShardBench*)user;
+	int index = ikcp_worker_index(worker);
+	int count = (int)bench->clients.size(), conv;
+	for (conv = index + 1; conv <= bench->connections; conv++) {
+		if ((IUINT32)conv % (IUINT32)count != (IUINT32)index) continue;
+		ikcpcb *kcp = ikcp_create((IUINT32)conv, NULL);
+		shard_setup(kcp);
+		if (ikcp_worker_attach(worker, kcp,
+			(const struct sockaddr*)&bench->server,
+			sizeof(bench->server)) != 0) {
+			ikcp_release(kcp);
+			continue;
+		}
+		bench->clients[index].push_back(kcp);
+	}
+}
+
+static void shard_poll(ikcp_worker *worker, void *user)
+{
+	ShardBench *bench = (ShardBench*)user;
+	std::vector<ikcpcb*> &kcps = bench->clients[ikcp_worker_index(worker)];
+	char data[1024];
+	memset(data, 0, sizeof(data));
+	for (size_t i = 0; i < kcps.size(); i++) {
+		int sent = 0;
+		while (ikcp_waitsnd(kcps[i]) < 512) {
+			ikcp_send(kcps[i], data, sizeof(data));
+			sent++;
+		}
+		if (sent) ikcp_worker_touch(worker, kcps[i]);
+	}
+}
+
+static void shard_client_receive(ikcp_worker *worker, ikcpcb *kcp,
+	void *user)
+{
+	char buffer[2048];
+	(void)worker; (void)user;
+	while (ikcp_recv(kcp, buffer, sizeof(buffer)) > 0);
+}
+
+static double bench_shard_run(int workers, int connections, int seconds)
+{
+	ShardBench bench;
+	ikcp_shard_ops sops, cops;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(bench.server);
+
+	bench.connections = connections;
+	bench.clients.resize(workers);
+	bench.received = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	memset(&sops, 0, sizeof(sops));
+	sops.accept = shard_accept;
+	sops.receive = shard_receive;
+	ikcp_shard *server = ikcp_shard_create((struct sockaddr*)&addr,
+		sizeof(addr), workers, &sops, &bench);
+	if (server == NULL) {
+		printf("shard: can't create the server\n");
+		return 0;
+	}
+	ikcp_shard_address(server, (struct sockaddr*)&bench.server, &addrlen);
+
+	memset(&cops, 0, sizeof(cops));
+	cops.start = shard_start;
+	cops.receive = shard_client_receive;
+	cops.poll = shard_poll;
+	ikcp_shard *client = ikcp_shard_create((struct sockaddr*)&addr,
+		sizeof(addr), workers, &cops, &bench);
+	if (client == NULL) {
+		printf("shard: can't create the client\n");
+		ikcp_shard_release(server);
+		return 0;
+	}
+
+	ikcp_shard_start(server);
+	ikcp_shard_start(client);
+	double t0 = now_ns();
+	std::clock_t c0 = std::clock();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	long long received = bench.received;
+	double t1 = now_ns();
+	std::clock_t c1 = std::clock();
+	ikcp_shard_stop(client);
+	ikcp_shard_stop(server);
+
+	double rate = received / ((t1 - t0) / 1e9) / 1e6;
+	double cpu = (double)(c1 - c0) / CLOCKS_PER_SEC;
+	printf("shard  %2d workers, %d connections: %8.1f MB/s, "
+		"%6.1f MB per cpu second%s\n", workers, connections, rate,
+		(cpu > 0)? received / cpu / 1e6 : 0.0,
+		ikcp_shard_steered(server)? "" : "  (not steered)");
+
+	ikcp_shard_release(client);
+	ikcp_shard_release(server);
+	return rate;
+}
+
+static int bench_shard(int workers, int connections, int seconds)
+{
+	int n;
+	printf("%u hardware threads\n", std::thread::hardware_concurrency());
+	for (n = 1; n < workers; n *= 2) {
+		bench_shard_run(n, connections, seconds);
+	}
+	bench_shard_run(workers, connections, seconds);
+	return 0;
+}
+
+// throughput of 'workers' workers against one, best of three runs each.
+// client and server each run that many workers: 2 x workers hardware
+// threads are needed for the ratio to show per core scaling
+static int bench_scale(int workers, int connections, int seconds)
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	double one = 0, many = 0;
+	int i;
+	printf("%u hardware threads\n", threads);
+	for (i = 0; i < 3; i++) {
+		one = std::max(one, bench_shard_run(1, connections, seconds));
+		many = std::max(many, bench_shard_run(workers, connections,
+			seconds));
+	}
+	if (one <= 0) return 1;
+	printf("scale  1 -> %d workers: %.2fx throughput, %.0f%% per worker%s\n",
+		workers, many / one, many / one / workers * 100,
+		((unsigned)workers * 2 > threads)?
+		"  (more workers than hardware threads)" : "");
+	return 0;
+}
+#endif
+
+
+int main(int argc, char *argv[])
+{
+	const char *name = (argc > 1)? argv[1] : "table";
+	if (strcmp(name, "table") == 0) {
+		return bench_table((argc > 2)? atoi(argv[2]) : 1000000);
+	}
+	if (strcmp(name, "sched") == 0) {
+		return bench_sched((argc > 2)? atoi(argv[2]) : 100000,
+			(argc > 3)? atoi(argv[3]) : 1000);
+	}
+	if (strcmp(name, "bottleneck") == 0) {
+		return bench_bottleneck((argc > 2)? atoi(argv[2]) : 1500,
+			(argc > 3)? atoi(argv[3]) : 40,
+			(argc > 4)? atoi(argv[4]) : 30,
+			(argc > 5)? atoi(argv[5]) : 0,
+			(argc > 6)? atoi(argv[6]) : 30);
+	}
+#ifdef KCP_BENCH_SHARD
+	if (strcmp(name, "shard") == 0) {
+		int workers = (int)std::thread::hardware_concurrency();
+		return bench_shard((argc > 2)? atoi(argv[2]) :
+			(workers > 0? workers : 4),
+			(argc > 3)? atoi(argv[3]) : 64,
+			(argc > 4)? atoi(argv[4]) : 3);
+	}
+	if (strcmp(name, "scale") == 0) {
+		int workers = (int)std::thread::hardware_concurrency() / 2;
+		return bench_scale((argc > 2)? atoi(argv[2]) :
+			(workers > 1? workers : 4),
+			(argc > 3)? atoi(argv[3]) : 64,
+			(argc > 4)? atoi(argv[4]) : 3);
+	}
+#endif
+	printf("usage: %s table [count] | sched [connections] [active] | "
+		"bottleneck [KB/s] [rtt] [queue KB] [loss %%] [seconds] | "
+		"shard|scale [workers] [connections] [seconds]\n", argv[0]);
+	return 1;
+}
+
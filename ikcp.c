@@ -30,6 +30,7 @@ const IUINT32 IKCP_CMD_PUSH = 81;        // cmd: push data
 const IUINT32 IKCP_CMD_ACK  = 82;        // cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83;        // cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84;        // cmd: window size (tell)
+const IUINT32 IKCP_CMD_SACK = 85;        // cmd: selective ack ranges
 const IUINT32 IKCP_ASK_SEND = 1;        // need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2;        // need to send IKCP_CMD_WINS
 const IUINT32 IKCP_WND_SND = 32;
@@ -44,6 +45,9 @@ const IUINT32 IKCP_THRESH_MIN = 2;
 const IUINT32 IKCP_PROBE_INIT = 7000;        // 7 secs to probe window size
 const IUINT32 IKCP_PROBE_LIMIT = 120000;    // up to 120 secs to probe window
 const IUINT32 IKCP_FASTACK_LIMIT = 5;        // max times to trigger fastack
+const IUINT32 IKCP_SACK_OFFER = 1;        // frg of a sack capability offer
+const IUINT32 IKCP_SACK_ANSWER = 2;        // frg of an answer to an offer
+const IUINT32 IKCP_SACK_OFFERS = 8;        // max offers before giving up
 
 
 //---------------------------------------------------------------------
@@ -147,15 +151,15 @@ typedef struct IKCPSEG IKCPSEG;
 static void* (*ikcp_malloc_hook)(size_t) = NULL;
 static void (*ikcp_free_hook)(void *) = NULL;
 
-// internal malloc
-static void* ikcp_malloc(size_t size) {
+// global malloc
+static void* ikcp_global_malloc(size_t size) {
     if (ikcp_malloc_hook)
         return ikcp_malloc_hook(size);
     return malloc(size);
 }
 
-// internal free
-static void ikcp_free(void *ptr) {
+// global free
+static void ikcp_global_free(void *ptr) {
     if (ikcp_free_hook) {
         ikcp_free_hook(ptr);
     }    else {
@@ -163,6 +167,25 @@ static void ikcp_free(void *ptr) {
     }
 }
 
+// internal malloc
+static void* ikcp_alloc(const struct IKCPALLOCATOR *allocator, size_t size) {
+    if (allocator->alloc)
+        return allocator->alloc(size, allocator->ctx);
+    return ikcp_global_malloc(size);
+}
+
+// internal free
+static void ikcp_dealloc(const struct IKCPALLOCATOR *allocator, void *ptr) {
+    if (allocator->dealloc) {
+        allocator->dealloc(ptr, allocator->ctx);
+    }    else {
+        ikcp_global_free(ptr);
+    }
+}
+
+#define ikcp_malloc(kcp, size) ikcp_alloc(&(kcp)->allocator, size)
+#define ikcp_free(kcp, ptr) ikcp_dealloc(&(kcp)->allocator, ptr)
+
 // redefine allocator
 void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
 {
@@ -170,16 +193,362 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
     ikcp_free_hook = new_free;
 }
 
+
+//---------------------------------------------------------------------
+// thread-local arena: size classes from 2^IKCP_ARENA_MIN up to
+// 2^(IKCP_ARENA_MIN + IKCP_ARENA_CLASSES - 1) bytes, larger blocks go
+// straight to the global allocator
+//---------------------------------------------------------------------
+#ifndef IKCP_THREAD_LOCAL
+#if defined(_MSC_VER)
+#define IKCP_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define IKCP_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define IKCP_THREAD_LOCAL _Thread_local
+#endif
+#endif
+
+#define IKCP_ARENA_MIN        5
+#define IKCP_ARENA_CLASSES    16
+#define IKCP_ARENA_LARGE      0xff
+#define IKCP_ARENA_HEADER     16            // keep blocks 16 bytes aligned
+#define IKCP_ARENA_CACHE      (256 * 1024)  // max cached bytes per class
+
+#ifdef IKCP_THREAD_LOCAL
+struct IKCPARENA
+{
+    void *head[IKCP_ARENA_CLASSES];
+    IUINT32 count[IKCP_ARENA_CLASSES];
+};
+
+static IKCP_THREAD_LOCAL struct IKCPARENA ikcp_arena_tls;
+#endif
+
+void* ikcp_arena_malloc(size_t size, void *ctx)
+{
+    unsigned char *block;
+    int index = IKCP_ARENA_LARGE;
+#ifdef IKCP_THREAD_LOCAL
+    struct IKCPARENA *arena = &ikcp_arena_tls;
+    size_t need = (size_t)1 << IKCP_ARENA_MIN;
+    for (index = 0; index < IKCP_ARENA_CLASSES; index++, need <<= 1) {
+        if (size + IKCP_ARENA_HEADER <= need) break;
+    }
+    if (index < IKCP_ARENA_CLASSES) {
+        if (arena->head[index] != NULL) {
+            block = (unsigned char*)arena->head[index];
+            arena->head[index] = *(void**)block;
+            arena->count[index]--;
+            block[0] = (unsigned char)index;
+            return block + IKCP_ARENA_HEADER;
+        }
+        size = need - IKCP_ARENA_HEADER;
+    }    else {
+        index = IKCP_ARENA_LARGE;
+    }
+#endif
+    (void)ctx;
+    block = (unsigned char*)ikcp_global_malloc(size + IKCP_ARENA_HEADER);
+    if (block == NULL) return NULL;
+    block[0] = (unsigned char)index;
+    return block + IKCP_ARENA_HEADER;
+}
+
+void ikcp_arena_free(void *ptr, void *ctx)
+{
+    unsigned char *block;
+    (void)ctx;
+    if (ptr == NULL) return;
+    block = (unsigned char*)ptr - IKCP_ARENA_HEADER;
+#ifdef IKCP_THREAD_LOCAL
+    if (block[0] != IKCP_ARENA_LARGE) {
+        struct IKCPARENA *arena = &ikcp_arena_tls;
+        int index = block[0];
+        // classes above IKCP_ARENA_CACHE aren't cached at all
+        IUINT32 limit = IKCP_ARENA_CACHE >> (IKCP_ARENA_MIN + index);
+        if (arena->count[index] < limit) {
+            *(void**)block = arena->head[index];
+            arena->head[index] = block;
+            arena->count[index]++;
+            return;
+        }
+    }
+#endif
+    ikcp_global_free(block);
+}
+
+void ikcp_arena_trim(void)
+{
+#ifdef IKCP_THREAD_LOCAL
+    struct IKCPARENA *arena = &ikcp_arena_tls;
+    int index;
+    for (index = 0; index < IKCP_ARENA_CLASSES; index++) {
+        while (arena->head[index] != NULL) {
+            void *block = arena->head[index];
+            arena->head[index] = *(void**)block;
+            ikcp_global_free(block);
+        }
+        arena->count[index] = 0;
+    }
+#endif
+}
+
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
-    return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+    IKCPSEG *seg;
+    // segments up to mss bytes come from the pool when enabled
+    if (kcp->pool_max > 0 && size <= (int)kcp->mss) {
+        if (!iqueue_is_empty(&kcp->pool)) {
+            seg = iqueue_entry(kcp->pool.next, IKCPSEG, node);
+            iqueue_del(&seg->node);
+            kcp->npool--;
+            kcp->pool_hit++;
+            return seg;
+        }
+        kcp->pool_miss++;
+        size = (int)kcp->mss;
+    }
+    seg = (IKCPSEG*)ikcp_malloc(kcp, sizeof(IKCPSEG) + size);
+    if (seg != NULL) {
+        seg->cap = (IUINT32)size;
+        seg->ref = NULL;
+    }
+    return seg;
+}
+
+// user buffer shared by the segments of ikcp_send_ref
+struct IKCPBUFREF
+{
+    const char *data;
+    IUINT32 refcnt;
+    void (*release)(const char *data, void *arg);
+    void *arg;
+};
+
+#define IKCP_SEG_DATA(seg) ((seg)->ref? (seg)->ext : (const char*)(seg)->data)
+
+static void ikcp_bufref_put(ikcpcb *kcp, struct IKCPBUFREF *ref)
+{
+    if (--ref->refcnt == 0) {
+        ref->release(ref->data, ref->arg);
+        ikcp_free(kcp, ref);
+    }
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
-    ikcp_free(seg);
+    if (seg->ref) {
+        ikcp_bufref_put(kcp, seg->ref);
+        seg->ref = NULL;
+    }
+    if (seg->cap == kcp->mss && kcp->npool < kcp->pool_max) {
+        iqueue_add(&seg->node, &kcp->pool);
+        kcp->npool++;
+        return;
+    }
+    ikcp_free(kcp, seg);
+}
+
+// release pooled segments above the high-water mark
+static void ikcp_pool_trim(ikcpcb *kcp, IUINT32 keep)
+{
+    while (kcp->npool > keep) {
+        IKCPSEG *seg = iqueue_entry(kcp->pool.next, IKCPSEG, node);
+        iqueue_del(&seg->node);
+        kcp->npool--;
+        ikcp_free(kcp, seg);
+    }
+}
+
+//---------------------------------------------------------------------
+// snd_buf index: segments in flight are addressed by sn & snd_mask,
+// at most (snd_mask + 1) segments can be in flight at the same time
+//---------------------------------------------------------------------
+static IUINT32 ikcp_ring_size(IUINT32 count)
+{
+    IUINT32 size = 1;
+    while (size < count) size <<= 1;
+    return size;
+}
+
+static int ikcp_snd_ring_resize(ikcpcb *kcp, IUINT32 sndwnd)
+{
+    IUINT32 size = ikcp_ring_size(sndwnd);
+    struct IQUEUEHEAD *p;
+    IKCPSEG **ring, **heap;
+
+    // never shrink, segments already in flight must keep their slots
+    if (kcp->snd_ring != NULL && size <= kcp->snd_mask + 1)
+        return 0;
+
+    ring = (IKCPSEG**)ikcp_malloc(kcp, sizeof(IKCPSEG*) * size);
+    heap = (IKCPSEG**)ikcp_malloc(kcp, sizeof(IKCPSEG*) * size);
+    if (ring == NULL || heap == NULL) {
+        if (ring) ikcp_free(kcp, ring);
+        if (heap) ikcp_free(kcp, heap);
+        return -1;
+    }
+    memset(ring, 0, sizeof(IKCPSEG*) * size);
+
+    // the rto heap never holds more than the ring
+    if (kcp->rto_heap) {
+        memcpy(heap, kcp->rto_heap, sizeof(IKCPSEG*) * kcp->nrto_heap);
+        ikcp_free(kcp, kcp->rto_heap);
+    }
+    kcp->rto_heap = heap;
+
+    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+        ring[seg->sn & (size - 1)] = seg;
+    }
+
+    if (kcp->snd_ring) {
+        ikcp_free(kcp, kcp->snd_ring);
+    }
+
+    kcp->snd_ring = ring;
+    kcp->snd_mask = size - 1;
+    return 0;
+}
+
+//---------------------------------------------------------------------
+// rcv_buf: out of order segments live in slot (sn & rcv_mask), with
+// one bit per slot in rcv_bitmap, (rcv_mask + 1) >= rcv_wnd
+//---------------------------------------------------------------------
+#define IKCP_BITMAP_TEST(bits, i) (((bits)[(i) >> 5] >> ((i) & 31)) & 1)
+#define IKCP_BITMAP_SET(bits, i)  ((bits)[(i) >> 5] |= ((IUINT32)1 << ((i) & 31)))
+#define IKCP_BITMAP_CLR(bits, i)  ((bits)[(i) >> 5] &= ~((IUINT32)1 << ((i) & 31)))
+
+static int ikcp_rcv_buf_resize(ikcpcb *kcp, IUINT32 rcvwnd)
+{
+    IUINT32 size = ikcp_ring_size(_imax_(rcvwnd, 32));
+    IUINT32 words = size >> 5;
+    IKCPSEG **slots;
+    IUINT32 *bitmap;
+    IUINT32 i;
+
+    if (kcp->rcv_buf != NULL && size <= kcp->rcv_mask + 1)
+        return 0;
+
+    slots = (IKCPSEG**)ikcp_malloc(kcp, sizeof(IKCPSEG*) * size);
+    bitmap = (IUINT32*)ikcp_malloc(kcp, sizeof(IUINT32) * words);
+    if (slots == NULL || bitmap == NULL) {
+        if (slots) ikcp_free(kcp, slots);
+        if (bitmap) ikcp_free(kcp, bitmap);
+        return -1;
+    }
+    memset(slots, 0, sizeof(IKCPSEG*) * size);
+    memset(bitmap, 0, sizeof(IUINT32) * words);
+
+    if (kcp->rcv_buf != NULL) {
+        for (i = 0; i <= kcp->rcv_mask; i++) {
+            if (IKCP_BITMAP_TEST(kcp->rcv_bitmap, i)) {
+                IKCPSEG *seg = kcp->rcv_buf[i];
+                slots[seg->sn & (size - 1)] = seg;
+                IKCP_BITMAP_SET(bitmap, seg->sn & (size - 1));
+            }
+        }
+        ikcp_free(kcp, kcp->rcv_buf);
+        ikcp_free(kcp, kcp->rcv_bitmap);
+    }
+
+    kcp->rcv_buf = slots;
+    kcp->rcv_bitmap = bitmap;
+    kcp->rcv_mask = size - 1;
+    return 0;
+}
+
+//---------------------------------------------------------------------
+// rto heap: every segment that has been sent at least once is kept in
+// a min-heap on resendts, seg->timer is its position in the heap
+//---------------------------------------------------------------------
+#define IKCP_TIMER_NONE 0xffffffff
+
+static inline int ikcp_timer_before(const IKCPSEG *a, const IKCPSEG *b)
+{
+    return _itimediff(a->resendts, b->resendts) < 0;
+}
+
+static void ikcp_timer_up(ikcpcb *kcp, IUINT32 i)
+{
+    IKCPSEG **heap = kcp->rto_heap;
+    IKCPSEG *seg = heap[i];
+    while (i > 0) {
+        IUINT32 parent = (i - 1) >> 1;
+        if (!ikcp_timer_before(seg, heap[parent])) break;
+        heap[i] = heap[parent];
+        heap[i]->timer = i;
+        i = parent;
+    }
+    heap[i] = seg;
+    seg->timer = i;
+}
+
+static void ikcp_timer_down(ikcpcb *kcp, IUINT32 i)
+{
+    IKCPSEG **heap = kcp->rto_heap;
+    IKCPSEG *seg = heap[i];
+    IUINT32 count = kcp->nrto_heap;
+    while (1) {
+        IUINT32 child = i * 2 + 1;
+        if (child >= count) break;
+        if (child + 1 < count && ikcp_timer_before(heap[child + 1], heap[child]))
+            child++;
+        if (!ikcp_timer_before(heap[child], seg)) break;
+        heap[i] = heap[child];
+        heap[i]->timer = i;
+        i = child;
+    }
+    heap[i] = seg;
+    seg->timer = i;
+}
+
+// resendts of a segment in the heap changed, either way
+static void ikcp_timer_update(ikcpcb *kcp, IKCPSEG *seg)
+{
+    ikcp_timer_up(kcp, seg->timer);
+    ikcp_timer_down(kcp, seg->timer);
+}
+
+static void ikcp_timer_push(ikcpcb *kcp, IKCPSEG *seg)
+{
+    kcp->rto_heap[kcp->nrto_heap] = seg;
+    ikcp_timer_up(kcp, kcp->nrto_heap++);
+}
+
+static void ikcp_timer_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+    IUINT32 i = seg->timer;
+    if (i == IKCP_TIMER_NONE) return;
+    seg->timer = IKCP_TIMER_NONE;
+    if (i == --kcp->nrto_heap) return;
+    kcp->rto_heap[i] = kcp->rto_heap[kcp->nrto_heap];
+    ikcp_timer_up(kcp, i);
+    ikcp_timer_down(kcp, kcp->rto_heap[i]->timer);
+}
+
+// move available data from rcv_buf -> rcv_queue
+static void ikcp_rcv_buf_move(ikcpcb *kcp)
+{
+    while (kcp->nrcv_buf > 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+        IUINT32 index = kcp->rcv_nxt & kcp->rcv_mask;
+        IKCPSEG *seg;
+        // buffer中的报文能够匹配上期待的接收的报文编号
+        if (!IKCP_BITMAP_TEST(kcp->rcv_bitmap, index))
+            break;
+        seg = kcp->rcv_buf[index];
+        kcp->rcv_buf[index] = NULL;
+        IKCP_BITMAP_CLR(kcp->rcv_bitmap, index);
+        kcp->nrcv_buf--;
+        // 移动到rcv_queue中
+        iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+        kcp->nrcv_que++;
+        // 更新窗口指针
+        kcp->rcv_nxt++;
+    }
 }
 
 // write log
@@ -216,6 +585,71 @@ static int ikcp_output(ikcpcb *kcp, const void *data, int size)
     return kcp->output((const char*)data, size, kcp, kcp->user);
 }
 
+// hand pending batched datagrams to output_batch
+static void ikcp_batch_flush(ikcpcb *kcp)
+{
+    if (kcp->nbatch > 0) {
+        kcp->output_batch(kcp->batch_iov, kcp->nbatch, kcp, kcp->user);
+        kcp->nbatch = 0;
+    }
+}
+
+// buffer to encode the next datagram into: one from output_acquire,
+// else the next batch slot or kcp->buffer
+static char *ikcp_output_buffer(ikcpcb *kcp)
+{
+    if (kcp->output_acquire) {
+        kcp->acquired = kcp->output_acquire((int)kcp->slot, kcp, kcp->user);
+        if (kcp->acquired) return kcp->acquired;
+    }
+    if (kcp->output_batch) {
+        return kcp->batch + (size_t)kcp->nbatch * kcp->slot;
+    }
+    return kcp->buffer;
+}
+
+// output the datagram encoded in 'buffer' (from ikcp_output_buffer)
+static void ikcp_output_emit(ikcpcb *kcp, char *buffer, int size)
+{
+    if (kcp->acquired) {
+        // committed in place, size 0 hands an unused buffer back
+        kcp->acquired = NULL;
+        if (size > 0 && ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+            ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
+        }
+        kcp->output_commit(buffer, size, kcp, kcp->user);
+        return;
+    }
+    if (size == 0) return;
+    if (kcp->output_batch == NULL) {
+        ikcp_output(kcp, buffer, size);
+        return;
+    }
+    if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+        ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
+    }
+    kcp->batch_iov[kcp->nbatch].iov_base = buffer;
+    kcp->batch_iov[kcp->nbatch].iov_len = (size_t)size;
+    if (++kcp->nbatch >= kcp->maxbatch) {
+        ikcp_batch_flush(kcp);
+    }
+}
+
+// room for 'need' more bytes behind 'ptr': outputs the datagram being
+// encoded when full, and acquires a buffer only once there is something
+// to encode (*buffer NULL), so idle flushes never touch the provider
+static char *ikcp_output_room(ikcpcb *kcp, char **buffer, char *ptr,
+    int need)
+{
+    if (*buffer != NULL) {
+        int size = (int)(ptr - *buffer);
+        if (size + need <= (int)kcp->mtu) return ptr;
+        ikcp_output_emit(kcp, *buffer, size);
+    }
+    *buffer = ikcp_output_buffer(kcp);
+    return *buffer;
+}
+
 // output queue
 void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 {
@@ -237,8 +671,21 @@ void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 //---------------------------------------------------------------------
 ikcpcb* ikcp_create(IUINT32 conv, void *user)
 {
-    ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
+    return ikcp_create_ex(conv, user, NULL);
+}
+
+ikcpcb* ikcp_create_ex(IUINT32 conv, void *user,
+    const struct IKCPALLOCATOR *allocator)
+{
+    struct IKCPALLOCATOR global = { NULL, NULL, NULL };
+    ikcpcb *kcp;
+    if (allocator == NULL) allocator = &global;
+    // both hooks or none, blocks must go back where they came from
+    if ((allocator->alloc == NULL) != (allocator->dealloc == NULL))
+        return NULL;
+    kcp = (ikcpcb*)ikcp_alloc(allocator, sizeof(struct IKCPCB));
     if (kcp == NULL) return NULL;
+    kcp->allocator = *allocator;
     kcp->conv = conv;
     kcp->user = user;
     kcp->snd_una = 0;
@@ -258,19 +705,47 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 
     // 除去头的最大数据单元
     kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+    kcp->slot = kcp->mtu;
     kcp->stream = 0;
 
     // 设置kcp内部编解码使用
-    kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
+    kcp->buffer = (char*)ikcp_malloc(kcp, (kcp->mtu + IKCP_OVERHEAD) * 3);
     if (kcp->buffer == NULL) {
-        ikcp_free(kcp);
+        ikcp_free(kcp, kcp);
         return NULL;
     }
 
     iqueue_init(&kcp->snd_queue);
     iqueue_init(&kcp->rcv_queue);
     iqueue_init(&kcp->snd_buf);
-    iqueue_init(&kcp->rcv_buf);
+    iqueue_init(&kcp->pool);
+    kcp->npool = 0;
+    kcp->pool_max = 0;
+    kcp->pool_hit = 0;
+    kcp->pool_miss = 0;
+
+    kcp->snd_ring = NULL;
+    kcp->snd_mask = 0;
+    kcp->rto_heap = NULL;
+    kcp->nrto_heap = 0;
+    kcp->fastack_sn = 0;
+    kcp->fastack_pending = 0;
+    kcp->rcv_buf = NULL;
+    kcp->rcv_bitmap = NULL;
+    kcp->rcv_mask = 0;
+    if (ikcp_snd_ring_resize(kcp, kcp->snd_wnd) != 0) {
+        ikcp_free(kcp, kcp->buffer);
+        ikcp_free(kcp, kcp);
+        return NULL;
+    }
+    if (ikcp_rcv_buf_resize(kcp, kcp->rcv_wnd) != 0) {
+        ikcp_free(kcp, kcp->rto_heap);
+        ikcp_free(kcp, kcp->snd_ring);
+        ikcp_free(kcp, kcp->buffer);
+        ikcp_free(kcp, kcp);
+        return NULL;
+    }
+
     kcp->nrcv_buf = 0;
     kcp->nsnd_buf = 0;
     kcp->nrcv_que = 0;
@@ -279,6 +754,16 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
     kcp->acklist = NULL;
     kcp->ackblock = 0;
     kcp->ackcount = 0;
+    kcp->sack = 0;
+    kcp->sack_peer = 0;
+    kcp->sack_offer = 0;
+    kcp->sack_reply = 0;
+    kcp->ackdelay = 0;
+    kcp->ackevery = 2;
+    kcp->ackpend = 0;
+    kcp->ackpend_sn = 0;
+    kcp->ackpend_ts = 0;
+    kcp->ackpend_since = 0;
     kcp->rx_srtt = 0;
     kcp->rx_rttval = 0;
     kcp->rx_rto = IKCP_RTO_DEF;
@@ -297,6 +782,28 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
     kcp->xmit = 0;
     kcp->dead_link = IKCP_DEADLINK;
     kcp->output = NULL;
+    kcp->output_batch = NULL;
+    kcp->output_acquire = NULL;
+    kcp->output_commit = NULL;
+    kcp->acquired = NULL;
+    kcp->batch_iov = NULL;
+    kcp->batch = NULL;
+    kcp->nbatch = 0;
+    kcp->maxbatch = 0;
+    kcp->cc = &ikcp_cc_reno;
+    kcp->cc_state = NULL;
+    kcp->pacing_rate = 0;
+    kcp->pacing = 0;
+    kcp->pace_rate = 0;
+    kcp->pace_ts = 0;
+    kcp->pace_next = 0;
+    kcp->pace_wait = 0;
+    kcp->pace_tokens = 0;
+    kcp->clock = 1;
+    kcp->immediate = 0;
+    kcp->inflush = 0;
+    kcp->pump = NULL;
+    kcp->mailbox = NULL;
     kcp->writelog = NULL;
 
     return kcp;
@@ -316,10 +823,15 @@ void ikcp_release(ikcpcb *kcp)
             iqueue_del(&seg->node);
             ikcp_segment_delete(kcp, seg);
         }
-        while (!iqueue_is_empty(&kcp->rcv_buf)) {
-            seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-            iqueue_del(&seg->node);
-            ikcp_segment_delete(kcp, seg);
+        if (kcp->rcv_buf) {
+            IUINT32 i;
+            for (i = 0; i <= kcp->rcv_mask; i++) {
+                if (IKCP_BITMAP_TEST(kcp->rcv_bitmap, i)) {
+                    ikcp_segment_delete(kcp, kcp->rcv_buf[i]);
+                }
+            }
+            ikcp_free(kcp, kcp->rcv_buf);
+            ikcp_free(kcp, kcp->rcv_bitmap);
         }
         while (!iqueue_is_empty(&kcp->snd_queue)) {
             seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
@@ -331,11 +843,24 @@ void ikcp_release(ikcpcb *kcp)
             iqueue_del(&seg->node);
             ikcp_segment_delete(kcp, seg);
         }
+        ikcp_pool_trim(kcp, 0);
+        if (kcp->cc->release) {
+            kcp->cc->release(kcp);
+        }
         if (kcp->buffer) {
-            ikcp_free(kcp->buffer);
+            ikcp_free(kcp, kcp->buffer);
         }
         if (kcp->acklist) {
-            ikcp_free(kcp->acklist);
+            ikcp_free(kcp, kcp->acklist);
+        }
+        if (kcp->batch_iov) {
+            ikcp_free(kcp, kcp->batch_iov);
+        }
+        if (kcp->snd_ring) {
+            ikcp_free(kcp, kcp->snd_ring);
+        }
+        if (kcp->rto_heap) {
+            ikcp_free(kcp, kcp->rto_heap);
         }
 
         kcp->nrcv_buf = 0;
@@ -345,7 +870,13 @@ void ikcp_release(ikcpcb *kcp)
         kcp->ackcount = 0;
         kcp->buffer = NULL;
         kcp->acklist = NULL;
-        ikcp_free(kcp);
+        kcp->batch_iov = NULL;
+        kcp->batch = NULL;
+        kcp->snd_ring = NULL;
+        kcp->rto_heap = NULL;
+        kcp->rcv_buf = NULL;
+        kcp->rcv_bitmap = NULL;
+        ikcp_free(kcp, kcp);
     }
 }
 
@@ -360,6 +891,49 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
+// (re)allocate the batch slots: the iovec array followed by the slots
+static int ikcp_batch_alloc(ikcpcb *kcp, int maxbatch, int mtu)
+{
+    char *block = NULL;
+    if (maxbatch > 0) {
+        block = (char*)ikcp_malloc(kcp,
+            (sizeof(ikcp_iovec) + mtu) * maxbatch);
+        if (block == NULL) return -2;
+    }
+    if (kcp->batch_iov) {
+        ikcp_free(kcp, kcp->batch_iov);
+    }
+    kcp->batch_iov = (ikcp_iovec*)block;
+    kcp->batch = block? block + sizeof(ikcp_iovec) * maxbatch : NULL;
+    kcp->maxbatch = maxbatch;
+    kcp->nbatch = 0;
+    return 0;
+}
+
+void ikcp_setoutput_buffer(ikcpcb *kcp,
+    char* (*acquire)(int size, ikcpcb *kcp, void *user),
+    int (*commit)(char *buf, int len, ikcpcb *kcp, void *user))
+{
+    if (acquire == NULL || commit == NULL) {
+        acquire = NULL;
+        commit = NULL;
+    }
+    kcp->output_acquire = acquire;
+    kcp->output_commit = commit;
+}
+
+int ikcp_setoutput_batch(ikcpcb *kcp, int (*output_batch)(
+    const ikcp_iovec *iov, int count, ikcpcb *kcp, void *user),
+    int maxbatch)
+{
+    if (output_batch == NULL) maxbatch = 0;
+    else if (maxbatch < 1) return -1;
+    if (ikcp_batch_alloc(kcp, maxbatch, (int)kcp->slot) != 0) return -2;
+    kcp->output_batch = output_batch;
+    return 0;
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -427,21 +1001,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
     assert(len == peeksize);
 
     // move available data from rcv_buf -> rcv_queue
-    while (! iqueue_is_empty(&kcp->rcv_buf)) {
-        seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-        // buffer中的报文能够匹配上期待的接收的报文编号
-        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-            iqueue_del(&seg->node);
-            kcp->nrcv_buf--;
-            // 移动到rcv_queue中
-            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-            kcp->nrcv_que++;
-            // 更新窗口指针
-            kcp->rcv_nxt++;
-        }    else {
-            break;
-        }
-    }
+    ikcp_rcv_buf_move(kcp);
 
     // fast recover
     if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -454,6 +1014,43 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 }
 
 
+//---------------------------------------------------------------------
+// zero copy recv: fragments of the next message are handed out in
+// place and released afterwards
+//---------------------------------------------------------------------
+int ikcp_recv_view(ikcpcb *kcp, ikcp_iovec *iov, int count)
+{
+    struct IQUEUEHEAD *p;
+    int n = 0;
+    assert(kcp);
+
+    if (iqueue_is_empty(&kcp->rcv_queue))
+        return -1;
+
+    if (ikcp_peeksize(kcp) < 0)
+        return -2;
+
+    for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+        if (n >= count)
+            return -3;
+        iov[n].iov_base = seg->data;
+        iov[n].iov_len = seg->len;
+        n++;
+        if (seg->frg == 0)
+            break;
+    }
+
+    return n;
+}
+
+int ikcp_recv_release(ikcpcb *kcp)
+{
+    // a NULL buffer drops the next message without copying it
+    return ikcp_recv(kcp, NULL, 0x7fffffff);
+}
+
+
 //---------------------------------------------------------------------
 // peek data size
 //---------------------------------------------------------------------
@@ -484,23 +1081,81 @@ int ikcp_peeksize(const ikcpcb *kcp)
 }
 
 
+// immediate mode, see ikcp_flush
+static void ikcp_flush_now(ikcpcb *kcp);
+
+
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+{
+    ikcp_iovec vec;
+    if (len < 0) return -1;
+    vec.iov_base = (void*)buffer;
+    vec.iov_len = (size_t)len;
+    return ikcp_sendv(kcp, &vec, 1);
+}
+
+
+// gather 'size' bytes from an iovec array into 'dst' (when not NULL),
+// advancing the (iov, offset) cursor. NULL iov_base is skipped over
+static void ikcp_iov_read(const ikcp_iovec **iov, size_t *offset,
+    char *dst, int size)
+{
+    while (size > 0) {
+        const ikcp_iovec *vec = *iov;
+        size_t avail = vec->iov_len - *offset;
+        int chunk = (avail < (size_t)size)? (int)avail : size;
+        if (chunk > 0) {
+            if (dst && vec->iov_base) {
+                memcpy(dst, (const char*)vec->iov_base + *offset, chunk);
+            }
+            if (dst) dst += chunk;
+            size -= chunk;
+            *offset += chunk;
+        }
+        if (*offset >= vec->iov_len) {
+            *iov = vec + 1;
+            *offset = 0;
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------
+// scatter/gather send: the iovec array is one message
+//---------------------------------------------------------------------
+int ikcp_sendv(ikcpcb *kcp, const ikcp_iovec *iov, int iovcnt)
 {
     IKCPSEG *seg;
-    int count, i;
+    size_t offset = 0, total = 0;
+    int count, i, len;
 
     assert(kcp->mss > 0);
-    if (len < 0) return -1;
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) return -1;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+        if (total > 0x7fffffff) return -1;
+    }
+    len = (int)total;
 
     // append to previous segment in streaming mode (if possible)
     // 在流模式下进行append
     if (kcp->stream != 0) {
         if (!iqueue_is_empty(&kcp->snd_queue)) {
             IKCPSEG *old = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
-            if (old->len < kcp->mss) {
+            if (old->len < kcp->mss && old->cap >= kcp->mss &&
+                old->ref == NULL) {
+                // enough room left in the tail segment, extend in place
+                int capacity = kcp->mss - old->len;
+                int extend = (len < capacity)? len : capacity;
+                ikcp_iov_read(&iov, &offset, old->data + old->len, extend);
+                old->len += extend;
+                len -= extend;
+            }
+            else if (old->len < kcp->mss) {
                 int capacity = kcp->mss - old->len;
                 int extend = (len < capacity)? len : capacity;
                 seg = ikcp_segment_new(kcp, old->len + extend);
@@ -509,11 +1164,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
                     return -2;
                 }
                 iqueue_add_tail(&seg->node, &kcp->snd_queue);
-                memcpy(seg->data, old->data, old->len);
-                if (buffer) {
-                    memcpy(seg->data + old->len, buffer, extend);
-                    buffer += extend;
-                }
+                memcpy(seg->data, IKCP_SEG_DATA(old), old->len);
+                ikcp_iov_read(&iov, &offset, seg->data + old->len, extend);
                 seg->len = old->len + extend;
                 seg->frg = 0;
                 len -= extend;
@@ -522,6 +1174,7 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
             }
         }
         if (len <= 0) {
+            ikcp_flush_now(kcp);
             return 0;
         }
     }
@@ -545,10 +1198,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
         if (seg == NULL) {
             return -2;
         }
-        if (buffer && len > 0) {
-            // 数据的拷贝
-            memcpy(seg->data, buffer, size);
-        }
+        // 数据的拷贝，可以跨越多个iovec
+        ikcp_iov_read(&iov, &offset, seg->data, size);
         seg->len = size;
         // 非流式协议，那么给段设计分段号
         seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
@@ -556,14 +1207,77 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
         // 将节点加入到发送队列为
         iqueue_add_tail(&seg->node, &kcp->snd_queue);
         kcp->nsnd_que++;
-        if (buffer) {
-            // 移动buffer指针
-            buffer += size;
-        }
         // 减少用户的数据
         len -= size;
     }
 
+    ikcp_flush_now(kcp);
+    return 0;
+}
+
+
+//---------------------------------------------------------------------
+// zero-copy send: segments reference the user buffer until acked
+//---------------------------------------------------------------------
+int ikcp_send_ref(ikcpcb *kcp, const char *buffer, int len,
+    void (*release)(const char *buffer, void *arg), void *arg)
+{
+    struct IKCPBUFREF *ref;
+    IKCPSEG *seg;
+    int count, i, offset = 0;
+
+    assert(kcp->mss > 0);
+    assert(release != NULL);
+
+    if (len < 0 || (buffer == NULL && len > 0)) {
+        release(buffer, arg);
+        return -1;
+    }
+
+    if (len <= (int)kcp->mss) count = 1;
+    else count = (len + kcp->mss - 1) / kcp->mss;
+
+    if (count >= (int)IKCP_WND_RCV) {
+        release(buffer, arg);
+        return -2;
+    }
+
+    ref = (struct IKCPBUFREF*)ikcp_malloc(kcp, sizeof(struct IKCPBUFREF));
+    if (ref == NULL) {
+        release(buffer, arg);
+        return -2;
+    }
+
+    // the reference held here keeps the buffer alive while fragmenting
+    ref->data = buffer;
+    ref->refcnt = 1;
+    ref->release = release;
+    ref->arg = arg;
+
+    // stream mode does not merge into the tail segment: the data is
+    // not copied, so every segment covers a slice of this buffer only
+    for (i = 0; i < count; i++) {
+        int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+        seg = ikcp_segment_new(kcp, 0);
+        assert(seg);
+        if (seg == NULL) {
+            ikcp_bufref_put(kcp, ref);
+            return -2;
+        }
+        ref->refcnt++;
+        seg->ref = ref;
+        seg->ext = buffer + offset;
+        seg->len = size;
+        seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
+        iqueue_init(&seg->node);
+        iqueue_add_tail(&seg->node, &kcp->snd_queue);
+        kcp->nsnd_que++;
+        offset += size;
+        len -= size;
+    }
+
+    ikcp_bufref_put(kcp, ref);
+    ikcp_flush_now(kcp);
     return 0;
 }
 
@@ -590,7 +1304,7 @@ static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
     }
     // 重传超时时间设置
     rto = kcp->rx_srtt + _imax_(kcp->interval, 4 * kcp->rx_rttval);
-    kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
+    kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX * kcp->clock);
 }
 
 static void ikcp_shrink_buf(ikcpcb *kcp)
@@ -608,24 +1322,30 @@ static void ikcp_shrink_buf(ikcpcb *kcp)
 
 static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
 {
-    struct IQUEUEHEAD *p, *next;
+    IKCPSEG *seg;
     //  已经确认包的sn和超过待确认的序列号
     if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
         return;
 
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-        next = p->next;
-        // 找到对应的sn的报文删除
-        if (sn == seg->sn) {
-            iqueue_del(p);
-            ikcp_segment_delete(kcp, seg);
-            kcp->nsnd_buf--;
-            break;
-        }
-        if (_itimediff(sn, seg->sn) < 0) {
-            break;
-        }
+    // 直接通过sn定位到对应的报文删除
+    seg = kcp->snd_ring[sn & kcp->snd_mask];
+    if (seg != NULL && seg->sn == sn) {
+        kcp->snd_ring[sn & kcp->snd_mask] = NULL;
+        ikcp_timer_remove(kcp, seg);
+        if (kcp->cc->on_acked) kcp->cc->on_acked(kcp, seg);
+        iqueue_del(&seg->node);
+        ikcp_segment_delete(kcp, seg);
+        kcp->nsnd_buf--;
+    }
+}
+
+// acknowledge every sn in [start, end)
+static void ikcp_parse_ack_range(ikcpcb *kcp, IUINT32 start, IUINT32 end)
+{
+    if (_itimediff(start, kcp->snd_una) < 0) start = kcp->snd_una;
+    if (_itimediff(end, kcp->snd_nxt) > 0) end = kcp->snd_nxt;
+    for (; _itimediff(end, start) > 0; start++) {
+        ikcp_parse_ack(kcp, start);
     }
 }
 
@@ -638,6 +1358,9 @@ static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
         next = p->next;
         if (_itimediff(una, seg->sn) > 0) {
             // 删除这些已经确认的报文
+            kcp->snd_ring[seg->sn & kcp->snd_mask] = NULL;
+            ikcp_timer_remove(kcp, seg);
+            if (kcp->cc->on_acked) kcp->cc->on_acked(kcp, seg);
             iqueue_del(p);
             ikcp_segment_delete(kcp, seg);
             kcp->nsnd_buf--;
@@ -669,6 +1392,15 @@ static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
             if (_itimediff(ts, seg->ts) >= 0)
                 seg->fastack++;
         #endif
+            // let ikcp_flush know it has something to fast resend
+            if (kcp->fastresend > 0 &&
+                seg->fastack >= (IUINT32)kcp->fastresend) {
+                if (kcp->fastack_pending == 0 ||
+                    _itimediff(sn, kcp->fastack_sn) > 0) {
+                    kcp->fastack_sn = sn;
+                }
+                kcp->fastack_pending = 1;
+            }
         }
     }
 }
@@ -687,7 +1419,7 @@ static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
         size_t newblock;
 
         for (newblock = 8; newblock < newsize; newblock <<= 1);
-        acklist = (IUINT32*)ikcp_malloc(newblock * sizeof(IUINT32) * 2);
+        acklist = (IUINT32*)ikcp_malloc(kcp, newblock * sizeof(IUINT32) * 2);
 
         if (acklist == NULL) {
             assert(acklist != NULL);
@@ -700,7 +1432,7 @@ static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
                 acklist[x * 2 + 0] = kcp->acklist[x * 2 + 0];
                 acklist[x * 2 + 1] = kcp->acklist[x * 2 + 1];
             }
-            ikcp_free(kcp->acklist);
+            ikcp_free(kcp, kcp->acklist);
         }
 
         kcp->acklist = acklist;
@@ -714,6 +1446,30 @@ static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
     kcp->ackcount++;
 }
 
+// queue the held back ack of the latest in order segment
+static void ikcp_ack_release(ikcpcb *kcp)
+{
+    if (kcp->ackpend > 0) {
+        ikcp_ack_push(kcp, kcp->ackpend_sn, kcp->ackpend_ts);
+        kcp->ackpend = 0;
+    }
+}
+
+// hold back the ack of an in order segment, rcv_nxt in the header of
+// the next ack covers it
+static void ikcp_ack_delay(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
+{
+    if (kcp->ackpend == 0) {
+        kcp->ackpend_since = kcp->current;
+    }
+    kcp->ackpend++;
+    kcp->ackpend_sn = sn;
+    kcp->ackpend_ts = ts;
+    if (kcp->ackpend >= kcp->ackevery) {
+        ikcp_ack_release(kcp);
+    }
+}
+
 static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
 {
     // 交替的存储sn和ts
@@ -721,85 +1477,463 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
     if (ts) ts[0] = kcp->acklist[p * 2 + 1];
 }
 
+// encode up to 'limit' [start, end) ranges of sn held in rcv_buf,
+// returns how many were written
+static int ikcp_sack_ranges(const ikcpcb *kcp, char *ptr, int limit)
+{
+    IUINT32 offset = 0, start = 0;
+    int count = 0, inside = 0;
+    while (offset < kcp->rcv_wnd && count < limit) {
+        IUINT32 index = (kcp->rcv_nxt + offset) & kcp->rcv_mask;
+        IUINT32 word = kcp->rcv_bitmap[index >> 5] >> (index & 31);
+        if (word == 0 && inside == 0) {
+            // nothing in the rest of this bitmap word
+            offset += 32 - (index & 31);
+            continue;
+        }
+        if ((word & 1) && inside == 0) {
+            start = kcp->rcv_nxt + offset;
+            inside = 1;
+        }
+        else if ((word & 1) == 0 && inside) {
+            ptr = ikcp_encode32u(ptr, start);
+            ptr = ikcp_encode32u(ptr, kcp->rcv_nxt + offset);
+            count++;
+            inside = 0;
+        }
+        offset++;
+    }
+    if (inside && count < limit) {
+        ptr = ikcp_encode32u(ptr, start);
+        ptr = ikcp_encode32u(ptr, kcp->rcv_nxt + _imin_(offset, kcp->rcv_wnd));
+        count++;
+    }
+    return count;
+}
+
 
 //---------------------------------------------------------------------
 // parse data, IKCPSEG是在外面new出来的，在这里删除，这种设计不是很好
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 {
-    struct IQUEUEHEAD *p, *prev;
     IUINT32 sn = newseg->sn;
-    int repeat = 0;
+    IUINT32 index = sn & kcp->rcv_mask;
     // 序列号非法, 直接删除
     if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
-        _itimediff(sn, kcp->rcv_nxt) < 0) {
+        _itimediff(sn, kcp->rcv_nxt) < 0 ||
+        _itimediff(sn, kcp->rcv_nxt) > (long)kcp->rcv_mask) {
         ikcp_segment_delete(kcp, newseg);
         return;
     }
-    // 逆序的的找到对应的sn
-    for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-        prev = p->prev;
-        // 如果找到了相同的序列号
-        if (seg->sn == sn) {
-            repeat = 1;
-            break;
+    // 槽位已经被占用，说明是重复发送，删除
+    if (IKCP_BITMAP_TEST(kcp->rcv_bitmap, index)) {
+        ikcp_segment_delete(kcp, newseg);
+    }    else {
+        kcp->rcv_buf[index] = newseg;
+        IKCP_BITMAP_SET(kcp->rcv_bitmap, index);
+        kcp->nrcv_buf++;
+    }
+
+    // move available data from rcv_buf -> rcv_queue
+    ikcp_rcv_buf_move(kcp);
+
+#if 0
+    ikcp_qprint("queue", &kcp->rcv_queue);
+    printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
+#endif
+
+#if 1
+//    printf("snd(buf=%d, queue=%d)\n", kcp->nsnd_buf, kcp->nsnd_que);
+//    printf("rcv(buf=%d, queue=%d)\n", kcp->nrcv_buf, kcp->nrcv_que);
+#endif
+}
+
+
+//---------------------------------------------------------------------
+// congestion control: reno, the default
+//---------------------------------------------------------------------
+static void ikcp_reno_ack(ikcpcb *kcp, const struct IKCPACKSAMPLE *sample)
+{
+    // one step per datagram that moved snd_una, as separate ikcp_input
+    // calls would take, applied at once
+    IUINT32 mss = kcp->mss;
+    IUINT32 count = sample->advance, grow;
+    // 如果发送窗口大小小于接受窗口大小
+    if (count == 0 || kcp->cwnd >= kcp->rmt_wnd) return;
+    if (kcp->cwnd < kcp->ssthresh) {
+        // 窗口大小增加, up to ssthresh
+        grow = _imin_(count, kcp->ssthresh - kcp->cwnd);
+        kcp->cwnd += grow;
+        // 增加一个mss的流量
+        kcp->incr += grow * mss;
+        count -= grow;
+    }
+    // congestion avoidance for the rest, every step sized by the incr
+    // before them (like tcp_cong_avoid_ai with 'acked')
+    if (count > 0 && kcp->cwnd < kcp->rmt_wnd) {
+        if (kcp->incr < mss) kcp->incr = mss;
+        kcp->incr += count * ((mss * mss) / kcp->incr + (mss / 16));
+        if ((kcp->cwnd + 1) * mss <= kcp->incr) {
+        #if 1
+            kcp->cwnd = (kcp->incr + mss - 1) / ((mss > 0)? mss : 1);
+        #else
+            kcp->cwnd++;
+        #endif
         }
-        if (_itimediff(sn, seg->sn) > 0) {
-            break;
+    }
+    if (kcp->cwnd > kcp->rmt_wnd) {
+        kcp->cwnd = kcp->rmt_wnd;
+        kcp->incr = kcp->rmt_wnd * mss;
+    }
+}
+
+static void ikcp_reno_fastretransmit(ikcpcb *kcp, IUINT32 count)
+{
+    // 当前未收到确认，但是已发送出去的报文数
+    IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+    (void)count;
+    // 发送窗口上限改变
+    kcp->ssthresh = inflight / 2;
+    // 发送窗口没有和tcp一样, 立即为0
+    if (kcp->ssthresh < IKCP_THRESH_MIN)
+        kcp->ssthresh = IKCP_THRESH_MIN;
+    // 当前的发送窗口改变
+    kcp->cwnd = kcp->ssthresh + (IUINT32)kcp->fastresend;
+    // 可发送的最大数据量改变
+    kcp->incr = kcp->cwnd * kcp->mss;
+}
+
+static void ikcp_reno_loss(ikcpcb *kcp, IUINT32 cwnd)
+{
+    //  发送窗口上限更新
+    kcp->ssthresh = cwnd / 2;
+    if (kcp->ssthresh < IKCP_THRESH_MIN)
+        kcp->ssthresh = IKCP_THRESH_MIN;
+    // 变成1
+    kcp->cwnd = 1;
+    kcp->incr = kcp->mss;
+}
+
+const struct IKCPCC ikcp_cc_reno = {
+    "reno",
+    NULL,
+    NULL,
+    NULL,
+    ikcp_reno_ack,
+    ikcp_reno_fastretransmit,
+    ikcp_reno_loss,
+    NULL,
+};
+
+
+//---------------------------------------------------------------------
+// congestion control: bbr like, driven by a model of the path
+//---------------------------------------------------------------------
+#define IKCP_BBR_BW_ROUNDS  10      // rounds the bandwidth max filter spans
+
+const IUINT32 IKCP_BBR_UNIT = 256;           // fixed point of gains and bw
+const IUINT32 IKCP_BBR_HIGH_GAIN = 739;      // 2/ln(2), startup
+const IUINT32 IKCP_BBR_DRAIN_GAIN = 88;      // its inverse, drain
+const IUINT32 IKCP_BBR_CWND_GAIN = 512;      // cwnd gain in probe_bw
+const IUINT32 IKCP_BBR_MIN_CWND = 4;
+const IUINT32 IKCP_BBR_RTT_WIN = 10000;      // min rtt expires after it
+const IUINT32 IKCP_BBR_PROBE_RTT = 200;      // time at min cwnd to probe
+
+#define IKCP_BBR_STARTUP    0
+#define IKCP_BBR_DRAIN      1
+#define IKCP_BBR_PROBE_BW   2
+#define IKCP_BBR_PROBE_RTT  3
+
+// probe_bw pacing gains, one min rtt each
+static const IUINT32 ikcp_bbr_cycle[8] = {
+    320, 192, 256, 256, 256, 256, 256, 256
+};
+
+struct IKCPBBR
+{
+    IUINT32 mode;
+    IUINT32 delivered, delivered_ts;
+    // rate sample of an ack batch: the latest sent segment it acked
+    IUINT32 prior_delivered, prior_ts;
+    int sampled;
+    // bottleneck bandwidth: max rate (segments per sec * unit) of each
+    // of the latest rounds, a round ends when a segment sent after its
+    // start is acked
+    IUINT32 bw[IKCP_BBR_BW_ROUNDS];
+    IUINT32 btlbw, round, next_round;
+    // min rtt: the lowest of the latest IKCP_BBR_RTT_WIN millisec, and
+    // the lowest of the current ack batch
+    IUINT32 min_rtt, min_rtt_ts, rtt;
+    // startup ends when the bandwidth stops growing by 1/4 a round
+    IUINT32 full_bw, full_cnt;
+    int filled;
+    IUINT32 pacing_gain, cwnd_gain;
+    IUINT32 cycle, cycle_ts;
+    IUINT32 probe_rtt_done, prior_cwnd;
+};
+
+static int ikcp_bbr_init(ikcpcb *kcp)
+{
+    struct IKCPBBR *bbr;
+    bbr = (struct IKCPBBR*)ikcp_malloc(kcp, sizeof(struct IKCPBBR));
+    if (bbr == NULL) return -1;
+    memset(bbr, 0, sizeof(struct IKCPBBR));
+    bbr->mode = IKCP_BBR_STARTUP;
+    bbr->pacing_gain = IKCP_BBR_HIGH_GAIN;
+    bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+    bbr->delivered_ts = kcp->current;
+    bbr->min_rtt = 0xffffffff;
+    bbr->min_rtt_ts = kcp->current;
+    bbr->rtt = 0xffffffff;
+    bbr->next_round = 0;
+    kcp->cc_state = bbr;
+    if (kcp->cwnd < IKCP_BBR_MIN_CWND) {
+        kcp->cwnd = IKCP_BBR_MIN_CWND;
+        kcp->incr = kcp->cwnd * kcp->mss;
+    }
+    return 0;
+}
+
+static void ikcp_bbr_release(ikcpcb *kcp)
+{
+    ikcp_free(kcp, kcp->cc_state);
+    kcp->cc_state = NULL;
+    kcp->pacing_rate = 0;
+}
+
+static void ikcp_bbr_send(ikcpcb *kcp, IKCPSEG *seg)
+{
+    struct IKCPBBR *bbr = (struct IKCPBBR*)kcp->cc_state;
+    // nothing in flight before: don't count the idle time as delivery
+    if (seg->sn == kcp->snd_una && seg->xmit <= 1) {
+        bbr->delivered_ts = kcp->current;
+    }
+    seg->delivered = bbr->delivered;
+    seg->delivered_ts = bbr->delivered_ts;
+}
+
+static void ikcp_bbr_acked(ikcpcb *kcp, const IKCPSEG *seg)
+{
+    struct IKCPBBR *bbr = (struct IKCPBBR*)kcp->cc_state;
+    bbr->delivered++;
+    bbr->delivered_ts = kcp->current;
+    if (bbr->sampled == 0 ||
+        _itimediff(seg->delivered, bbr->prior_delivered) > 0) {
+        bbr->prior_delivered = seg->delivered;
+        bbr->prior_ts = seg->delivered_ts;
+        bbr->sampled = 1;
+    }
+    // a retransmitted segment may be acked for any of its copies
+    if (seg->xmit == 1 && _itimediff(kcp->current, seg->ts) >= 0) {
+        IUINT32 rtt = _itimediff(kcp->current, seg->ts);
+        if (rtt < bbr->rtt) bbr->rtt = rtt;
+    }
+}
+
+// bandwidth-delay product in segments, scaled by 'gain'
+static IUINT32 ikcp_bbr_bdp(const struct IKCPBBR *bbr, IUINT32 gain,
+    IUINT32 clock)
+{
+    IUINT64 bdp;
+    if (bbr->btlbw == 0 || bbr->min_rtt == 0xffffffff) return 0;
+    bdp = (IUINT64)bbr->btlbw * _imax_(bbr->min_rtt, 1) / 1000 / clock;
+    return (IUINT32)(bdp * gain / IKCP_BBR_UNIT / IKCP_BBR_UNIT);
+}
+
+static void ikcp_bbr_ack(ikcpcb *kcp, const struct IKCPACKSAMPLE *sample)
+{
+    struct IKCPBBR *bbr = (struct IKCPBBR*)kcp->cc_state;
+    IUINT32 current = kcp->current;
+    IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+    IUINT32 target, cwnd, i;
+    int round_start = 0, expired;
+
+    // delivery rate and round trips
+    if (bbr->sampled) {
+        IUINT32 interval = _itimediff(current, bbr->prior_ts);
+        IUINT32 count = bbr->delivered - bbr->prior_delivered;
+        IUINT32 rate, slot;
+        IUINT64 bw;
+        if ((IINT32)interval < 1) interval = 1;
+        bw = (IUINT64)count * 1000 * kcp->clock * IKCP_BBR_UNIT / interval;
+        rate = (bw > 0xffffffff)? 0xffffffff : (IUINT32)bw;
+        // shorter than a round trip: the ack of an earlier copy of a
+        // retransmitted segment, the rate would be far too high
+        if (bbr->min_rtt != 0xffffffff && interval < bbr->min_rtt) {
+            rate = 0;
+        }
+        if (_itimediff(bbr->prior_delivered, bbr->next_round) >= 0) {
+            bbr->next_round = bbr->delivered;
+            bbr->round++;
+            bbr->bw[bbr->round % IKCP_BBR_BW_ROUNDS] = 0;
+            round_start = 1;
+        }
+        slot = bbr->round % IKCP_BBR_BW_ROUNDS;
+        if (rate > bbr->bw[slot]) bbr->bw[slot] = rate;
+        bbr->btlbw = 0;
+        for (i = 0; i < IKCP_BBR_BW_ROUNDS; i++) {
+            if (bbr->bw[i] > bbr->btlbw) bbr->btlbw = bbr->bw[i];
+        }
+        bbr->sampled = 0;
+    }
+
+    // min rtt, a stale one is replaced by the next sample
+    expired = _itimediff(current, bbr->min_rtt_ts) >
+        (IINT32)(IKCP_BBR_RTT_WIN * kcp->clock);
+    if (bbr->rtt != 0xffffffff && (bbr->rtt <= bbr->min_rtt || expired)) {
+        bbr->min_rtt = bbr->rtt;
+        bbr->min_rtt_ts = current;
+    }
+    bbr->rtt = 0xffffffff;
+
+    // startup: the pipe is full once the bandwidth stopped growing
+    if (round_start && bbr->filled == 0 && bbr->btlbw > 0) {
+        if (bbr->btlbw >= bbr->full_bw + bbr->full_bw / 4) {
+            bbr->full_bw = bbr->btlbw;
+            bbr->full_cnt = 0;
+        }
+        else if (++bbr->full_cnt >= 3) {
+            bbr->filled = 1;
         }
     }
-    // 插入到
-    if (repeat == 0) {
-        iqueue_init(&newseg->node);
-        // 这里保持有序了
-        iqueue_add(&newseg->node, p);
-        kcp->nrcv_buf++;
-    }    else {
-        // 重复发送，删除
-        ikcp_segment_delete(kcp, newseg);
+
+    switch (bbr->mode) {
+    case IKCP_BBR_STARTUP:
+        if (bbr->filled) {
+            bbr->mode = IKCP_BBR_DRAIN;
+            bbr->pacing_gain = IKCP_BBR_DRAIN_GAIN;
+        }
+        break;
+    case IKCP_BBR_DRAIN:
+        // the queue built by startup is gone
+        if (inflight <= ikcp_bbr_bdp(bbr, IKCP_BBR_UNIT, kcp->clock)) {
+            bbr->mode = IKCP_BBR_PROBE_BW;
+            bbr->cwnd_gain = IKCP_BBR_CWND_GAIN;
+            bbr->cycle = 2;
+            bbr->cycle_ts = current;
+            bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle];
+        }
+        break;
+    case IKCP_BBR_PROBE_BW:
+        if (_itimediff(current, bbr->cycle_ts) > (IINT32)bbr->min_rtt) {
+            bbr->cycle = (bbr->cycle + 1) & 7;
+            bbr->cycle_ts = current;
+            bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle];
+        }
+        break;
+    case IKCP_BBR_PROBE_RTT:
+        // hold the minimal window a while once it drained down to it
+        if (bbr->probe_rtt_done == 0 && inflight <= IKCP_BBR_MIN_CWND) {
+            bbr->probe_rtt_done = current + IKCP_BBR_PROBE_RTT * kcp->clock;
+            if (bbr->probe_rtt_done == 0) bbr->probe_rtt_done = 1;
+        }
+        else if (bbr->probe_rtt_done != 0 &&
+            _itimediff(current, bbr->probe_rtt_done) >= 0) {
+            bbr->min_rtt_ts = current;
+            kcp->cwnd = _imax_(kcp->cwnd, bbr->prior_cwnd);
+            if (bbr->filled) {
+                bbr->mode = IKCP_BBR_PROBE_BW;
+                bbr->cycle = 2;
+                bbr->cycle_ts = current;
+                bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle];
+                bbr->cwnd_gain = IKCP_BBR_CWND_GAIN;
+            }    else {
+                bbr->mode = IKCP_BBR_STARTUP;
+                bbr->pacing_gain = IKCP_BBR_HIGH_GAIN;
+                bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+            }
+        }
+        break;
     }
 
-#if 0
-    ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-    printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
+    // the min rtt wasn't seen for a while: drain the queue to measure it
+    if (expired && bbr->mode != IKCP_BBR_PROBE_RTT) {
+        bbr->mode = IKCP_BBR_PROBE_RTT;
+        bbr->pacing_gain = IKCP_BBR_UNIT;
+        bbr->prior_cwnd = kcp->cwnd;
+        bbr->probe_rtt_done = 0;
+    }
 
-    // move available data from rcv_buf -> rcv_queue
-    while (! iqueue_is_empty(&kcp->rcv_buf)) {
-        IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-            iqueue_del(&seg->node);
-            kcp->nrcv_buf--;
-            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-            kcp->nrcv_que++;
-            kcp->rcv_nxt++;
-        }    else {
-            break;
-        }
+    // congestion window: grow by what was acked toward the target
+    target = ikcp_bbr_bdp(bbr, bbr->cwnd_gain, kcp->clock);
+    cwnd = kcp->cwnd;
+    if (bbr->filled) {
+        cwnd = _imin_(cwnd + sample->acked, target);
     }
+    else if (cwnd < target || target == 0) {
+        cwnd += sample->acked;
+    }
+    cwnd = _imax_(cwnd, IKCP_BBR_MIN_CWND);
+    if (bbr->mode == IKCP_BBR_PROBE_RTT) {
+        cwnd = _imin_(cwnd, IKCP_BBR_MIN_CWND);
+    }
+    // no point past what the remote can take (also bounds startup)
+    kcp->cwnd = _imin_(cwnd, _imax_(kcp->rmt_wnd, IKCP_BBR_MIN_CWND));
+    kcp->incr = kcp->cwnd * kcp->mss;
 
-#if 0
-    ikcp_qprint("queue", &kcp->rcv_queue);
-    printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
+    // pacing rate in bytes per second
+    kcp->pacing_rate = (IUINT32)((IUINT64)bbr->btlbw * kcp->mss *
+        bbr->pacing_gain / IKCP_BBR_UNIT / IKCP_BBR_UNIT);
+}
 
-#if 1
-//    printf("snd(buf=%d, queue=%d)\n", kcp->nsnd_buf, kcp->nsnd_que);
-//    printf("rcv(buf=%d, queue=%d)\n", kcp->nrcv_buf, kcp->nrcv_que);
-#endif
+const struct IKCPCC ikcp_cc_bbr = {
+    "bbr",
+    ikcp_bbr_init,
+    ikcp_bbr_release,
+    ikcp_bbr_acked,
+    ikcp_bbr_ack,
+    NULL,
+    NULL,
+    ikcp_bbr_send,
+};
+
+int ikcp_setcc(ikcpcb *kcp, const struct IKCPCC *cc)
+{
+    const struct IKCPCC *prev = kcp->cc;
+    void *state = kcp->cc_state;
+    if (cc == NULL) cc = &ikcp_cc_reno;
+    if (cc == prev) return 0;
+    kcp->cc = cc;
+    kcp->cc_state = NULL;
+    if (cc->init && cc->init(kcp) < 0) {
+        kcp->cc = prev;
+        kcp->cc_state = state;
+        return -1;
+    }
+    // the new state is set up, drop the previous one
+    if (prev->release) {
+        void *fresh = kcp->cc_state;
+        kcp->cc_state = state;
+        prev->release(kcp);
+        kcp->cc_state = fresh;
+    }
+    return 0;
 }
 
 
 //---------------------------------------------------------------------
 // input data
 //---------------------------------------------------------------------
+// ack state gathered over the datagrams of one input call, applied
+// once by ikcp_input_finish
+struct IKCPINPUT
+{
+    IUINT32 maxack, latest_ts;
+    int flag;      // maxack/latest_ts are set
+    int advance;   // datagrams that moved snd_una forward
+    IUINT32 acked; // segments acknowledged
+};
+
 // 从网络层到kcp层
-int ikcp_input(ikcpcb *kcp, const char *data, long size)
+static int ikcp_input_datagram(ikcpcb *kcp, const char *data, long size,
+    struct IKCPINPUT *state)
 {
     IUINT32 prev_una = kcp->snd_una;
-    IUINT32 maxack = 0, latest_ts = 0;
-    int flag = 0;
+    IUINT32 prev_buf = kcp->nsnd_buf;
+    IUINT32 maxack = state->maxack, latest_ts = state->latest_ts;
+    int flag = state->flag;
+    int hr = 0;
 
     if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
         ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", (int)size);
@@ -817,7 +1951,10 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
         // 获取连接号
         data = ikcp_decode32u(data, &conv);
         // 不是同一个连接发送的数据，直接出错
-        if (conv != kcp->conv) return -1;
+        if (conv != kcp->conv) {
+            hr = -1;
+            break;
+        }
         // 解码kcp的头
         data = ikcp_decode8u(data, &cmd);
         // 解码段
@@ -834,11 +1971,17 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 
         size -= IKCP_OVERHEAD;
         // 剩余size < 接收到的数据，错误
-        if ((long)size < (long)len || (int)len < 0) return -2;
+        if ((long)size < (long)len || (int)len < 0) {
+            hr = -2;
+            break;
+        }
         // 非法的命令
         if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-            cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS)
-            return -3;
+            cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS &&
+            cmd != IKCP_CMD_SACK) {
+            hr = -3;
+            break;
+        }
         // 对方接收窗口的大小更新
         kcp->rmt_wnd = wnd;
         // 根据未确认报文，删除已经确认的报文
@@ -887,8 +2030,16 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
             }
             // 在窗口范围内
             if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
-                // 给kcp添加一个ack报文
-                ikcp_ack_push(kcp, sn, ts);
+                if (kcp->ackdelay > 0 && sn == kcp->rcv_nxt &&
+                    kcp->nrcv_buf == 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+                    // in order and deliverable right away
+                    ikcp_ack_delay(kcp, sn, ts);
+                }    else {
+                    // out of order or duplicated: ack everything now
+                    ikcp_ack_release(kcp);
+                    // 给kcp添加一个ack报文
+                    ikcp_ack_push(kcp, sn, ts);
+                }
                 //  接收到之后的数据
                 if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
                     // 创建一个segment
@@ -925,48 +2076,132 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
                     "input wins: %lu", (unsigned long)(wnd));
             }
         }
+        else if (cmd == IKCP_CMD_SACK) {
+            if (frg != 0) {
+                // capability offer or answer. every offer is answered,
+                // the previous answer may be lost (offers are capped)
+                if (kcp->sack) {
+                    if (frg == IKCP_SACK_OFFER) kcp->sack_reply = 1;
+                    kcp->sack_peer = 1;
+                }
+            }    else {
+                const char *ranges = data;
+                IUINT32 n = len / 8, start, end;
+                if (_itimediff(kcp->current, ts) >= 0) {
+                    ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+                }
+                for (; n > 0; n--) {
+                    ranges = ikcp_decode32u(ranges, &start);
+                    ranges = ikcp_decode32u(ranges, &end);
+                    ikcp_parse_ack_range(kcp, start, end);
+                }
+                ikcp_shrink_buf(kcp);
+                // sn is the highest sn acknowledged by this sack
+                if (flag == 0) {
+                    flag = 1;
+                    maxack = sn;
+                    latest_ts = ts;
+                }
+                else if (_itimediff(sn, maxack) > 0) {
+                    maxack = sn;
+                    latest_ts = ts;
+                }
+                if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+                    ikcp_log(kcp, IKCP_LOG_IN_ACK,
+                        "input sack: sn=%lu ranges=%lu rtt=%ld rto=%ld",
+                        (unsigned long)sn, (unsigned long)(len / 8),
+                        (long)_itimediff(kcp->current, ts),
+                        (long)kcp->rx_rto);
+                }
+            }
+        }
         else {
-            return -3;
+            hr = -3;
+            break;
         }
         // 移动指针
         data += len;
         size -= len;
     }
+    state->maxack = maxack;
+    state->latest_ts = latest_ts;
+    state->flag = flag;
+    if (_itimediff(kcp->snd_una, prev_una) > 0) {
+        state->advance++;
+    }
+    state->acked += prev_buf - kcp->nsnd_buf;
+
+    return hr;
+}
+
+// fast retransmit and congestion window for what a batch acknowledged
+static void ikcp_input_finish(ikcpcb *kcp, const struct IKCPINPUT *state)
+{
     // 说明有acksegment
-    if (flag != 0) {
-        ikcp_parse_fastack(kcp, maxack, latest_ts);
+    if (state->flag != 0) {
+        ikcp_parse_fastack(kcp, state->maxack, state->latest_ts);
     }
     // 有确认序号报文产生，那么更新发送窗口的大小
-    if (_itimediff(kcp->snd_una, prev_una) > 0) {
-        // 如果发送窗口大小小于接受窗口大小
-        if (kcp->cwnd < kcp->rmt_wnd) {
-            IUINT32 mss = kcp->mss;
-            if (kcp->cwnd < kcp->ssthresh) {
-                // 窗口大小增加
-                kcp->cwnd++;
-                // 增加一个mss的流量
-                kcp->incr += mss;
-            }    else {
-                if (kcp->incr < mss) kcp->incr = mss;
-                kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
-                if ((kcp->cwnd + 1) * mss <= kcp->incr) {
-                #if 1
-                    kcp->cwnd = (kcp->incr + mss - 1) / ((mss > 0)? mss : 1);
-                #else
-                    kcp->cwnd++;
-                #endif
-                }
-            }
-            if (kcp->cwnd > kcp->rmt_wnd) {
-                kcp->cwnd = kcp->rmt_wnd;
-                kcp->incr = kcp->rmt_wnd * mss;
-            }
-        }
+    if (kcp->cc->on_ack && (state->advance > 0 || state->acked > 0)) {
+        struct IKCPACKSAMPLE sample;
+        sample.advance = (IUINT32)state->advance;
+        sample.acked = state->acked;
+        kcp->cc->on_ack(kcp, &sample);
+    }
+}
+
+// fold the state of one good datagram into that of its batch
+static void ikcp_input_merge(struct IKCPINPUT *state,
+    const struct IKCPINPUT *one)
+{
+    if (one->flag != 0 && (state->flag == 0 ||
+        _itimediff(one->maxack, state->maxack) > 0)) {
+        state->maxack = one->maxack;
+        state->latest_ts = one->latest_ts;
+        state->flag = 1;
     }
+    state->advance += one->advance;
+    state->acked += one->acked;
+}
 
+int ikcp_input(ikcpcb *kcp, const char *data, long size)
+{
+    struct IKCPINPUT state;
+    int hr;
+    memset(&state, 0, sizeof(state));
+    hr = ikcp_input_datagram(kcp, data, size, &state);
+    // a malformed datagram leaves the window alone
+    if (hr != 0) return hr;
+    ikcp_input_finish(kcp, &state);
+    ikcp_flush_now(kcp);
     return 0;
 }
 
+//---------------------------------------------------------------------
+// input many datagrams, fastack and cwnd are updated once at the end
+//---------------------------------------------------------------------
+int ikcp_input_batch(ikcpcb *kcp, const ikcp_iovec *iov, int count,
+    int *status)
+{
+    struct IKCPINPUT state, one;
+    int accepted = 0, i;
+    memset(&state, 0, sizeof(state));
+    for (i = 0; i < count; i++) {
+        int hr;
+        memset(&one, 0, sizeof(one));
+        hr = ikcp_input_datagram(kcp, (const char*)iov[i].iov_base,
+            (long)iov[i].iov_len, &one);
+        if (status) status[i] = hr;
+        // a malformed datagram leaves the window alone, as in ikcp_input
+        if (hr != 0) continue;
+        ikcp_input_merge(&state, &one);
+        accepted++;
+    }
+    ikcp_input_finish(kcp, &state);
+    ikcp_flush_now(kcp);
+    return accepted;
+}
+
 
 //---------------------------------------------------------------------
 // ikcp_encode_seg
@@ -1000,25 +2235,133 @@ static int ikcp_wnd_unused(const ikcpcb *kcp)
     return 0;
 }
 
+// append a data segment to the flush buffer, output it first if full
+static char *ikcp_flush_data(ikcpcb *kcp, char **buffer, char *ptr,
+    IKCPSEG *segment, IUINT32 wnd)
+{
+    int need;
+    segment->ts = kcp->current;
+    segment->wnd = wnd;
+    // 每个报文会发送una
+    segment->una = kcp->rcv_nxt;
+
+    if (kcp->cc->on_send) kcp->cc->on_send(kcp, segment);
+
+    need = IKCP_OVERHEAD + segment->len;
+    if (kcp->pacing) kcp->pace_tokens -= need;
+    // 大于一个MTU直接发送
+    ptr = ikcp_output_room(kcp, buffer, ptr, need);
+
+    // 将segment进行编码
+    ptr = ikcp_encode_seg(ptr, segment);
+
+    if (segment->len > 0) {
+        memcpy(ptr, IKCP_SEG_DATA(segment), segment->len);
+        ptr += segment->len;
+    }
+
+    if (segment->xmit >= kcp->dead_link) {
+        // 设置为-1
+        kcp->state = (IUINT32)-1;
+    }
+    return ptr;
+}
+
 
 //---------------------------------------------------------------------
-// ikcp_flush
+// pacing: a token bucket of bytes for new data
 //---------------------------------------------------------------------
-void ikcp_flush(ikcpcb *kcp)
+static void ikcp_pace_refill(ikcpcb *kcp, IUINT32 cwnd)
+{
+    IUINT32 current = kcp->current;
+    IINT32 elapsed = _itimediff(current, kcp->pace_ts);
+    IUINT32 rate = kcp->pacing_rate;
+    IINT32 burst;
+    IUINT32 added;
+
+    if (rate == 0 && kcp->rx_srtt > 0) {
+        // a window per smoothed rtt, with headroom to let cwnd grow
+        IUINT64 bytes = (IUINT64)cwnd * kcp->mtu * 1000 * kcp->clock /
+            kcp->rx_srtt;
+        if (kcp->nocwnd == 0 && kcp->cwnd < kcp->ssthresh) bytes *= 2;
+        else bytes += bytes / 4;
+        rate = (bytes > 0x7fffffff)? 0x7fffffff : (IUINT32)bytes;
+    }
+    kcp->pace_rate = rate;
+
+    // no rate known yet: not paced
+    if (rate == 0) {
+        kcp->pace_tokens = 0x3fffffff;
+        kcp->pace_ts = current;
+        return;
+    }
+
+    if (elapsed < 0 || elapsed > (IINT32)kcp->interval) {
+        elapsed = (IINT32)kcp->interval;
+        kcp->pace_ts = current - kcp->interval;
+    }
+    added = (IUINT32)((IUINT64)rate * (IUINT32)elapsed / 1000 / kcp->clock);
+    // keep the fraction of a byte for later at low rates
+    if (added > 0) kcp->pace_ts = current;
+
+    // at most one interval worth at once, and a couple of datagrams
+    burst = (IINT32)_imax_(_imin_((IUINT32)((IUINT64)rate *
+        kcp->interval / 1000 / kcp->clock), 0x3fffffff), kcp->mtu * 2);
+    if (kcp->pace_tokens > burst) kcp->pace_tokens = burst;
+    if ((IINT32)added > burst - kcp->pace_tokens) {
+        kcp->pace_tokens = burst;
+    }    else {
+        kcp->pace_tokens += (IINT32)added;
+    }
+}
+
+// when queued data may go next, if the window lets it
+static void ikcp_pace_schedule(ikcpcb *kcp, IUINT32 cwnd)
+{
+    IINT32 deficit;
+    IUINT32 wait;
+
+    kcp->pace_wait = 0;
+    if (iqueue_is_empty(&kcp->snd_queue)) return;
+    if (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) >= 0) return;
+    if (kcp->pace_rate == 0) return;
+
+    // sent once the tokens are positive again
+    deficit = 1 - kcp->pace_tokens;
+    if (deficit < 0) deficit = 0;
+    wait = (IUINT32)(((IUINT64)deficit * 1000 * kcp->clock +
+        kcp->pace_rate - 1) / kcp->pace_rate);
+    kcp->pace_next = kcp->current + _imax_(wait, 1);
+    kcp->pace_wait = 1;
+}
+
+
+//---------------------------------------------------------------------
+// ikcp_flush: 'timers' 0 only sends what is ready (acks, window probe
+// answers, fast retransmits and new data), retransmission timeouts and
+// window probing are left to the next ikcp_update
+//---------------------------------------------------------------------
+static void ikcp_flush_ex(ikcpcb *kcp, int timers)
 {
     IUINT32 current = kcp->current;
-    char *buffer = kcp->buffer;
-    char *ptr = buffer;
-    int count, size, i;
+    char *buffer, *ptr;
+    int count, i;
     IUINT32 resent, cwnd;
     IUINT32 rtomin;
-    struct IQUEUEHEAD *p;
+    struct IQUEUEHEAD *p, *unsent;
     int change = 0;
     int lost = 0;
+    int active;
+    IINT32 budget = 0;
     IKCPSEG seg;
 
     // 'ikcp_update' haven't been called.
     if (kcp->updated == 0) return;
+    // an output callback sending or inputting: it goes out next time
+    if (kcp->inflush) return;
+    kcp->inflush = 1;
+    buffer = NULL;
+    ptr = NULL;
     // 设置报文的会话编号
     seg.conv = kcp->conv;
     //  应答报文
@@ -1032,20 +2375,43 @@ void ikcp_flush(ikcpcb *kcp)
     seg.sn = 0;
     seg.ts = 0;
 
+    // held back acks that waited long enough
+    if (kcp->ackpend > 0 &&
+        _itimediff(current, kcp->ackpend_since) >= (long)kcp->ackdelay) {
+        ikcp_ack_release(kcp);
+    }
+
     // flush acknowledges
     count = kcp->ackcount;
+    active = (count > 0 || !iqueue_is_empty(&kcp->snd_buf) ||
+        !iqueue_is_empty(&kcp->snd_queue));
+    if (kcp->sack_peer && count > 0) {
+        // one sack: una plus ranges held in rcv_buf, echoing the ts of
+        // the latest segment and the highest sn received
+        int limit = ((int)kcp->mtu - (int)IKCP_OVERHEAD) / 8;
+        int n;
+        IUINT32 sn, ts, maxsn;
+        ikcp_ack_get(kcp, count - 1, &maxsn, &ts);
+        for (i = 0; i < count - 1; i++) {
+            ikcp_ack_get(kcp, i, &sn, NULL);
+            if (_itimediff(sn, maxsn) > 0) maxsn = sn;
+        }
+        // nothing is encoded before it, the ranges may fill the mtu
+        ptr = ikcp_output_room(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
+        n = ikcp_sack_ranges(kcp, ptr + IKCP_OVERHEAD, limit);
+        seg.cmd = IKCP_CMD_SACK;
+        seg.sn = maxsn;
+        seg.ts = ts;
+        seg.len = 8 * n;
+        ptr = ikcp_encode_seg(ptr, &seg) + seg.len;
+        seg.cmd = IKCP_CMD_ACK;
+        seg.len = 0;
+        count = 0;
+    }
     for (i = 0; i < count; i++) {
-        // 第一次这里size为0，因为ptr就指向了buffer
-        size = (int)(ptr - buffer);
-
         // 大于一个mtu，那么执行一次output发出去
         // 发送多个ack报文
-        if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-            // 执行下层协议栈的网络发送函数
-            ikcp_output(kcp, buffer, size);
-            // 再次复用buffer
-            ptr = buffer;
-        }
+        ptr = ikcp_output_room(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
         // 设置序列号，设置时间戳
         ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
         // 这里移动了ptr
@@ -1054,25 +2420,56 @@ void ikcp_flush(ikcpcb *kcp)
     //  对ack报文清0，因为已经将ack报文发送了
     kcp->ackcount = 0;
 
+    // offer sack while the connection is active, in a datagram of its
+    // own as remotes without sack support drop it
+    if (kcp->sack && kcp->sack_peer == 0 && timers &&
+        kcp->sack_offer < IKCP_SACK_OFFERS && active) {
+        kcp->sack_offer++;
+        seg.cmd = IKCP_CMD_SACK;
+        seg.frg = IKCP_SACK_OFFER;
+        if (buffer != NULL && ptr != buffer) {
+            ikcp_output_emit(kcp, buffer, (int)(ptr - buffer));
+            buffer = NULL;
+        }
+        ptr = ikcp_output_room(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
+        ptr = ikcp_encode_seg(ptr, &seg);
+        ikcp_output_emit(kcp, buffer, (int)(ptr - buffer));
+        buffer = NULL;
+        seg.cmd = IKCP_CMD_ACK;
+        seg.frg = 0;
+    }
+    else if (kcp->sack_reply) {
+        seg.cmd = IKCP_CMD_SACK;
+        seg.frg = IKCP_SACK_ANSWER;
+        ptr = ikcp_output_room(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
+        ptr = ikcp_encode_seg(ptr, &seg);
+        seg.cmd = IKCP_CMD_ACK;
+        seg.frg = 0;
+    }
+    kcp->sack_reply = 0;
+
     // probe window size (if remote window size equals zero)
     // 如果对方的接收窗口为0，那么要进行对方窗口设置
-    if (kcp->rmt_wnd == 0) {
+    if (timers == 0) {
+        // probing is timed
+    }
+    else if (kcp->rmt_wnd == 0) {
         //  第一次进行窗口探测，设置窗口探测时间
         if (kcp->probe_wait == 0) {
             // 设置等待时间
-            kcp->probe_wait = IKCP_PROBE_INIT;
+            kcp->probe_wait = IKCP_PROBE_INIT * kcp->clock;
             kcp->ts_probe = kcp->current + kcp->probe_wait;
         }
         else {
             // 当前时间大于上次probe的时间
             if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
-                if (kcp->probe_wait < IKCP_PROBE_INIT)
-                    kcp->probe_wait = IKCP_PROBE_INIT;
+                if (kcp->probe_wait < IKCP_PROBE_INIT * kcp->clock)
+                    kcp->probe_wait = IKCP_PROBE_INIT * kcp->clock;
                 // 如果多次进行窗口探测，那么动态更新等待时间增长
                 kcp->probe_wait += kcp->probe_wait / 2;
 
-                if (kcp->probe_wait > IKCP_PROBE_LIMIT)
-                    kcp->probe_wait = IKCP_PROBE_LIMIT;
+                if (kcp->probe_wait > IKCP_PROBE_LIMIT * kcp->clock)
+                    kcp->probe_wait = IKCP_PROBE_LIMIT * kcp->clock;
                 kcp->ts_probe = kcp->current + kcp->probe_wait;
                 // 设置立即发送的状态
                 kcp->probe |= IKCP_ASK_SEND;
@@ -1089,11 +2486,7 @@ void ikcp_flush(ikcpcb *kcp)
     if (kcp->probe & IKCP_ASK_SEND) {
         // 将命令设置为Window ask
         seg.cmd = IKCP_CMD_WASK;
-        size = (int)(ptr - buffer);
-        if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
-        }
+        ptr = ikcp_output_room(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
         ptr = ikcp_encode_seg(ptr, &seg);
     }
 
@@ -1101,11 +2494,7 @@ void ikcp_flush(ikcpcb *kcp)
     // 如果要将自己的窗口大小发出去，那么直接发出去
     if (kcp->probe & IKCP_ASK_TELL) {
         seg.cmd = IKCP_CMD_WINS;
-        size = (int)(ptr - buffer);
-        if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
-        }
+        ptr = ikcp_output_room(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
         ptr = ikcp_encode_seg(ptr, &seg);
     }
     // 标志位重置
@@ -1115,16 +2504,30 @@ void ikcp_flush(ikcpcb *kcp)
     cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
     // 不进行流量控制，设置较小的窗口大小
     if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+    // never let more segments fly than snd_ring can index
+    cwnd = _imin_(kcp->snd_mask + 1, cwnd);
+
+    // paced: only as much new data as the tokens allow
+    if (kcp->pacing) {
+        ikcp_pace_refill(kcp, cwnd);
+        budget = kcp->pace_tokens;
+    }
 
     // move data from snd_queue to snd_buf
     // 要发送的序号在窗口中
     // 从snd_queue移动到snd_buffer
+    unsent = kcp->snd_buf.prev;
     while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
         IKCPSEG *newseg;
         if (iqueue_is_empty(&kcp->snd_queue)) break;
 
         newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
+        if (kcp->pacing) {
+            if (budget <= 0) break;
+            budget -= (IINT32)(IKCP_OVERHEAD + newseg->len);
+        }
+
         iqueue_del(&newseg->node);
         // 放到send buffer
         iqueue_add_tail(&newseg->node, &kcp->snd_buf);
@@ -1137,6 +2540,7 @@ void ikcp_flush(ikcpcb *kcp)
         newseg->ts = current;
         // 序号加一
         newseg->sn = kcp->snd_nxt++;
+        kcp->snd_ring[newseg->sn & kcp->snd_mask] = newseg;
         newseg->una = kcp->rcv_nxt;
         newseg->resendts = current;
         // 超时时间
@@ -1144,6 +2548,7 @@ void ikcp_flush(ikcpcb *kcp)
         // 设置没有fast ack过
         newseg->fastack = 0;
         newseg->xmit = 0;
+        newseg->timer = IKCP_TIMER_NONE;
     }
 
     // calculate resent
@@ -1152,114 +2557,92 @@ void ikcp_flush(ikcpcb *kcp)
     // 打开了nodelay，重传超时时间为0
     rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
 
-    // flush data segments
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-        IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
-        int needsend = 0;
-        //xmit为发送次数，第一次发送，设置超时时间
-        if (segment->xmit == 0) {
-            needsend = 1;
-            // 传输次数+1
-            segment->xmit++;
-            // 设置重传超时时间
-            segment->rto = kcp->rx_rto;
-            // 设置重新发送时间
-            segment->resendts = current + segment->rto + rtomin;
-        }
-        else if (_itimediff(current, segment->resendts) >= 0) {
-            // 不是第一次发送，那么就是重传，到了重传的时间
-            needsend = 1;
-            segment->xmit++;
-            // 增加一次这个会话重传次数
-            kcp->xmit++;
-            // 没有打开no_delay
-            if (kcp->nodelay == 0) {
-                // 设置重传等待时间
-                segment->rto += _imax_(segment->rto, (IUINT32)kcp->rx_rto);
-            }    else {
-                // nodelay为1，就是rto
-                IINT32 step = (kcp->nodelay < 2)?
-                    ((IINT32)(segment->rto)) : kcp->rx_rto;
-                segment->rto += step / 2;
-            }
-            // 设置下一次的重传时间
-            segment->resendts = current + segment->rto;
-            lost = 1;  // 确认这个segment之前lost
-        } // 该报文被ack跳过的次数大于等于触发快速重传的次数
-        else if (segment->fastack >= resent) { // 没有到达重传时间，但是也是需要重传
+    // fast retransmit: only segments up to the highest ack that pushed
+    // one of them over the threshold need to be looked at
+    if (kcp->fastack_pending) {
+        IUINT32 bound = kcp->fastack_sn;
+        kcp->fastack_pending = 0;
+        for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+            IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
+            if (_itimediff(segment->sn, bound) >= 0) break;
+            // 该报文被ack跳过的次数大于等于触发快速重传的次数
+            if (segment->xmit == 0 || segment->fastack < resent) continue;
             // 没有超过快速重传次数
-            if ((int)segment->xmit <= kcp->fastlimit ||
-                kcp->fastlimit <= 0) {
-                needsend = 1;
-                segment->xmit++;
-                // fastack清0
-                segment->fastack = 0;
-                // 设置重传时间
-                segment->resendts = current + segment->rto;
-                change++;
+            if ((int)segment->xmit > kcp->fastlimit && kcp->fastlimit > 0)
+                continue;
+            // timed out ones are resent below, fast resend them next time
+            if (_itimediff(current, segment->resendts) >= 0) {
+                kcp->fastack_pending = 1;
+                continue;
             }
+            segment->xmit++;
+            // fastack清0
+            segment->fastack = 0;
+            // 设置重传时间
+            // earlier than the first send's rto + rtomin, possibly
+            segment->resendts = current + segment->rto;
+            ikcp_timer_update(kcp, segment);
+            change++;
+            ptr = ikcp_flush_data(kcp, &buffer, ptr, segment, seg.wnd);
         }
-        // 需要现在发送
-        if (needsend) {
-            int need;
-            segment->ts = current;
-            segment->wnd = seg.wnd;
-            // 每个报文会发送una
-            segment->una = kcp->rcv_nxt;
-
-            size = (int)(ptr - buffer);
-            need = IKCP_OVERHEAD + segment->len;
-            // 大于一个MTU直接发送
-            if (size + need > (int)kcp->mtu) {
-                // 使用协议层来传输
-                ikcp_output(kcp, buffer, size);
-                ptr = buffer;
-            }
-
-            // 将segment进行编码
-            ptr = ikcp_encode_seg(ptr, segment);
-
-            if (segment->len > 0) {
-                memcpy(ptr, segment->data, segment->len);
-                ptr += segment->len;
-            }
+    }
 
-            if (segment->xmit >= kcp->dead_link) {
-                // 设置为-1
-                kcp->state = (IUINT32)-1;
-            }
+    // 不是第一次发送，那么就是重传，到了重传的时间
+    while (timers && kcp->nrto_heap > 0) {
+        IKCPSEG *segment = kcp->rto_heap[0];
+        if (_itimediff(current, segment->resendts) < 0) break;
+        segment->xmit++;
+        // 增加一次这个会话重传次数
+        kcp->xmit++;
+        // 没有打开no_delay
+        if (kcp->nodelay == 0) {
+            // 设置重传等待时间
+            segment->rto += _imax_(segment->rto, (IUINT32)kcp->rx_rto);
+        }    else {
+            // nodelay为1，就是rto
+            IINT32 step = (kcp->nodelay < 2)?
+                ((IINT32)(segment->rto)) : kcp->rx_rto;
+            segment->rto += step / 2;
         }
+        // 设置下一次的重传时间
+        segment->resendts = current + segment->rto;
+        ikcp_timer_down(kcp, 0);
+        lost = 1;  // 确认这个segment之前lost
+        ptr = ikcp_flush_data(kcp, &buffer, ptr, segment, seg.wnd);
+    }
+
+    // 第一次发送，设置超时时间
+    for (p = unsent->next; p != &kcp->snd_buf; p = p->next) {
+        IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
+        // 传输次数+1
+        segment->xmit++;
+        // 设置重传超时时间
+        segment->rto = kcp->rx_rto;
+        // 设置重新发送时间
+        segment->resendts = current + segment->rto + rtomin;
+        ikcp_timer_push(kcp, segment);
+        ptr = ikcp_flush_data(kcp, &buffer, ptr, segment, seg.wnd);
     }
 
     // flash remain segments
-    size = (int)(ptr - buffer);
-    if (size > 0) {
-        ikcp_output(kcp, buffer, size);
+    if (buffer != NULL) {
+        ikcp_output_emit(kcp, buffer, (int)(ptr - buffer));
+    }
+    if (kcp->output_batch) {
+        ikcp_batch_flush(kcp);
     }
 
-    // update ssthresh
-    if (change) {
-        // 当前未收到确认，但是已发送出去的报文数
-        IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
-        // 发送窗口上限改变
-        kcp->ssthresh = inflight / 2;
-        // 发送窗口没有和tcp一样, 立即为0
-        if (kcp->ssthresh < IKCP_THRESH_MIN)
-            kcp->ssthresh = IKCP_THRESH_MIN;
-        // 当前的发送窗口改变
-        kcp->cwnd = kcp->ssthresh + resent;
-        // 可发送的最大数据量改变
-        kcp->incr = kcp->cwnd * kcp->mss;
+    if (kcp->pacing) {
+        ikcp_pace_schedule(kcp, cwnd);
+    }
+
+    // 快速重传了，发送窗口改变
+    if (change && kcp->cc->on_fastretransmit) {
+        kcp->cc->on_fastretransmit(kcp, (IUINT32)change);
     }
     // 有数据包丢失，发送窗口改变
-    if (lost) {
-        //  发送窗口上限更新
-        kcp->ssthresh = cwnd / 2;
-        if (kcp->ssthresh < IKCP_THRESH_MIN)
-            kcp->ssthresh = IKCP_THRESH_MIN;
-        // 变成1
-        kcp->cwnd = 1;
-        kcp->incr = kcp->mss;
+    if (lost && kcp->cc->on_loss) {
+        kcp->cc->on_loss(kcp, cwnd);
     }
 
     if (kcp->cwnd < 1) {
@@ -1267,21 +2650,58 @@ void ikcp_flush(ikcpcb *kcp)
         kcp->cwnd = 1;
         kcp->incr = kcp->mss;
     }
+
+    kcp->inflush = 0;
+}
+
+void ikcp_flush(ikcpcb *kcp)
+{
+    ikcp_flush_ex(kcp, 1);
+}
+
+// messages handed over by other threads, sent by the flush after it
+static void ikcp_pump(ikcpcb *kcp)
+{
+    if (kcp->pump) {
+        kcp->inflush = 1;
+        kcp->pump(kcp, kcp->mailbox);
+        kcp->inflush = 0;
+    }
+}
+
+// immediate mode: send right away what a send or input made ready,
+// along with what the mailbox holds
+static void ikcp_flush_now(ikcpcb *kcp)
+{
+    IUINT32 wnd;
+    if (kcp->immediate == 0 || kcp->updated == 0 || kcp->inflush) return;
+    ikcp_pump(kcp);
+    wnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
+    if (kcp->ackcount == 0 && kcp->probe == 0 && kcp->sack_reply == 0 &&
+        kcp->fastack_pending == 0 &&
+        (iqueue_is_empty(&kcp->snd_queue) ||
+        _itimediff(kcp->snd_nxt, kcp->snd_una + wnd) >= 0)) {
+        return;
+    }
+    ikcp_flush_ex(kcp, 0);
 }
 
 
 //---------------------------------------------------------------------
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
-// 'current' - current timestamp in millisec.
+// 'current' - current timestamp in kcp->clock units.
 //---------------------------------------------------------------------
-void ikcp_update(ikcpcb *kcp, IUINT32 current)
+static void ikcp_update_clock(ikcpcb *kcp, IUINT32 current)
 {
     IINT32 slap;
+    IINT32 limit = (IINT32)(10000 * kcp->clock);
 
     // 获取kcp当前时间
     kcp->current = current;
 
+    ikcp_pump(kcp);
+
     if (kcp->updated == 0) {
         kcp->updated = 1;
         // 设置这一次flush的时间
@@ -1291,7 +2711,7 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
     slap = _itimediff(kcp->current, kcp->ts_flush);
 
     // 时间间隔太大，超过10s
-    if (slap >= 10000 || slap < -10000) {
+    if (slap >= limit || slap < -limit) {
         kcp->ts_flush = kcp->current;
         slap = 0;
     }
@@ -1304,6 +2724,26 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
         }
         ikcp_flush(kcp);
     }
+    else if (kcp->pace_wait &&
+        _itimediff(kcp->current, kcp->pace_next) >= 0) {
+        // paced data due between two intervals
+        ikcp_flush(kcp);
+    }
+    else {
+        ikcp_flush_now(kcp);
+    }
+}
+
+
+void ikcp_update(ikcpcb *kcp, IUINT32 current)
+{
+    ikcp_update_clock(kcp, current * kcp->clock);
+}
+
+void ikcp_update_us(ikcpcb *kcp, IUINT64 current)
+{
+    ikcp_update_clock(kcp, (IUINT32)((kcp->clock == 1)? current / 1000 :
+        current));
 }
 
 
@@ -1316,20 +2756,20 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 // schedule ikcp_update (eg. implementing an epoll-like mechanism,
 // or optimize ikcp_update when handling massive kcp connections)
 //---------------------------------------------------------------------
-IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
+static IUINT32 ikcp_check_clock(const ikcpcb *kcp, IUINT32 current)
 {
     IUINT32 ts_flush = kcp->ts_flush;
     IINT32 tm_flush = 0x7fffffff;
     IINT32 tm_packet = 0x7fffffff;
+    IINT32 limit = (IINT32)(10000 * kcp->clock);
     IUINT32 minimal = 0;
-    struct IQUEUEHEAD *p;
 
     if (kcp->updated == 0) {
         return current;
     }
 
-    if (_itimediff(current, ts_flush) >= 10000 ||
-        _itimediff(current, ts_flush) < -10000) {
+    if (_itimediff(current, ts_flush) >= limit ||
+        _itimediff(current, ts_flush) < -limit) {
         ts_flush = current;
     }
 
@@ -1339,9 +2779,18 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
     tm_flush = _itimediff(ts_flush, current);
 
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-        const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-        IINT32 diff = _itimediff(seg->resendts, current);
+    // the earliest resendts is on top of the rto heap
+    if (kcp->nrto_heap > 0) {
+        IINT32 diff = _itimediff(kcp->rto_heap[0]->resendts, current);
+        if (diff <= 0) {
+            return current;
+        }
+        tm_packet = diff;
+    }
+
+    // paced data waiting for tokens
+    if (kcp->pace_wait) {
+        IINT32 diff = _itimediff(kcp->pace_next, current);
         if (diff <= 0) {
             return current;
         }
@@ -1354,21 +2803,68 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
     return current + minimal;
 }
 
+IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
+{
+    IUINT32 now, wait;
+    if (kcp->clock == 1) {
+        return ikcp_check_clock(kcp, current);
+    }
+    // rounded up: updating earlier would find nothing to do
+    now = current * kcp->clock;
+    wait = ikcp_check_clock(kcp, now) - now;
+    return current + (wait + kcp->clock - 1) / kcp->clock;
+}
+
+IUINT64 ikcp_check_us(const ikcpcb *kcp, IUINT64 current)
+{
+    IUINT32 now = (IUINT32)((kcp->clock == 1)? current / 1000 : current);
+    IUINT32 wait = ikcp_check_clock(kcp, now) - now;
+    if (wait == 0) return current;
+    if (kcp->clock == 1000) return current + wait;
+    // due at the start of a later millisec
+    return (current / 1000 + wait) * 1000;
+}
+
+
 
+// largest segment in 'head', at least 'len'
+static IUINT32 ikcp_seg_maxlen(const struct IQUEUEHEAD *head, IUINT32 len)
+{
+    const struct IQUEUEHEAD *p;
+    for (p = head->next; p != head; p = p->next) {
+        const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+        if (seg->len > len) len = seg->len;
+    }
+    return len;
+}
 
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
     char *buffer;
+    IUINT32 slot;
     if (mtu < 50 || mtu < (int)IKCP_OVERHEAD)
         return -1;
+    // queued segments keep the mss they were cut for: until the next
+    // ikcp_setmtu every output buffer must still hold one of them
+    slot = ikcp_seg_maxlen(&kcp->snd_buf,
+        ikcp_seg_maxlen(&kcp->snd_queue, 0)) + IKCP_OVERHEAD;
+    slot = _imax_(slot, (IUINT32)mtu);
     // 设置buffer缓存大小
-    buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
+    buffer = (char*)ikcp_malloc(kcp, (slot + IKCP_OVERHEAD) * 3);
     if (buffer == NULL)
         return -2;
+    if (kcp->output_batch &&
+        ikcp_batch_alloc(kcp, kcp->maxbatch, (int)slot)) {
+        ikcp_free(kcp, buffer);
+        return -2;
+    }
     kcp->mtu = mtu;
     kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-    ikcp_free(kcp->buffer);
+    kcp->slot = slot;
+    ikcp_free(kcp, kcp->buffer);
     kcp->buffer = buffer;
+    // pooled segments are sized for the old mss
+    ikcp_pool_trim(kcp, 0);
     return 0;
 }
 
@@ -1376,7 +2872,55 @@ int ikcp_interval(ikcpcb *kcp, int interval)
 {
     if (interval > 5000) interval = 5000;
     else if (interval < 10) interval = 10;
-    kcp->interval = interval;
+    kcp->interval = interval * kcp->clock;
+    return 0;
+}
+
+int ikcp_interval_us(ikcpcb *kcp, int interval)
+{
+    if (kcp->clock == 1) {
+        return ikcp_interval(kcp, (interval + 999) / 1000);
+    }
+    if (interval > 5000000) interval = 5000000;
+    else if (interval < 100) interval = 100;
+    kcp->interval = (IUINT32)interval;
+    return 0;
+}
+
+int ikcp_usec(ikcpcb *kcp, int enable)
+{
+    IUINT32 clock = enable? 1000 : 1;
+    // timestamps already handed out would be misread
+    if (kcp->updated) return -1;
+    if (clock == kcp->clock) return 0;
+    if (clock > kcp->clock) {
+        kcp->rx_rto *= (IINT32)clock;
+        kcp->rx_minrto *= (IINT32)clock;
+        kcp->interval *= clock;
+        kcp->ackdelay *= clock;
+    }    else {
+        kcp->rx_rto /= (IINT32)kcp->clock;
+        kcp->rx_minrto /= (IINT32)kcp->clock;
+        kcp->interval = _imax_(kcp->interval / kcp->clock, 10);
+        kcp->ackdelay /= kcp->clock;
+    }
+    kcp->ts_flush = kcp->interval;
+    kcp->clock = clock;
+    return 0;
+}
+
+int ikcp_immediate(ikcpcb *kcp, int enable)
+{
+    kcp->immediate = enable? 1 : 0;
+    return 0;
+}
+
+int ikcp_pacing(ikcpcb *kcp, int enable)
+{
+    kcp->pacing = enable? 1 : 0;
+    kcp->pace_ts = kcp->current;
+    kcp->pace_tokens = 0;
+    kcp->pace_wait = 0;
     return 0;
 }
 
@@ -1385,18 +2929,18 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
     if (nodelay >= 0) {
         kcp->nodelay = nodelay;
         if (nodelay) {
-            kcp->rx_minrto = IKCP_RTO_NDL;
+            kcp->rx_minrto = IKCP_RTO_NDL * kcp->clock;
         }
         else {
             // rto重传超时时间
-            kcp->rx_minrto = IKCP_RTO_MIN;
+            kcp->rx_minrto = IKCP_RTO_MIN * kcp->clock;
         }
     }
     if (interval >= 0) {
         // 最大5s，最小10ms
         if (interval > 5000) interval = 5000;
         else if (interval < 10) interval = 10;
-        kcp->interval = interval;
+        kcp->interval = interval * kcp->clock;
     }
     // 是否快速重传
     if (resend >= 0) {
@@ -1413,15 +2957,52 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 {
     if (kcp) {
         if (sndwnd > 0) {
+            if (ikcp_snd_ring_resize(kcp, sndwnd) != 0)
+                return -2;
             kcp->snd_wnd = sndwnd;
         }
         if (rcvwnd > 0) {   // must >= max fragment size
+            if (ikcp_rcv_buf_resize(kcp, _imax_(rcvwnd, IKCP_WND_RCV)) != 0)
+                return -2;
             kcp->rcv_wnd = _imax_(rcvwnd, IKCP_WND_RCV);
         }
     }
     return 0;
 }
 
+int ikcp_setpool(ikcpcb *kcp, int maxfree)
+{
+    if (maxfree < 0) return -1;
+    kcp->pool_max = (IUINT32)maxfree;
+    ikcp_pool_trim(kcp, kcp->pool_max);
+    return 0;
+}
+
+int ikcp_sack(ikcpcb *kcp, int enable)
+{
+    kcp->sack = (enable != 0)? 1 : 0;
+    if (kcp->sack == 0) {
+        kcp->sack_peer = 0;
+        kcp->sack_reply = 0;
+    }
+    kcp->sack_offer = 0;
+    return 0;
+}
+
+int ikcp_delack(ikcpcb *kcp, int delay, int every)
+{
+    if (delay >= 0) {
+        kcp->ackdelay = (IUINT32)delay * kcp->clock;
+        if (delay == 0) {
+            ikcp_ack_release(kcp);
+        }
+    }
+    if (every > 0) {
+        kcp->ackevery = (IUINT32)every;
+    }
+    return 0;
+}
+
 int ikcp_waitsnd(const ikcpcb *kcp)
 {
     return kcp->nsnd_buf + kcp->nsnd_que;
@@ -261,6 +261,22 @@ typedef struct IQUEUEHEAD iqueue_head;
 #endif
 
 
+//---------------------------------------------------------------------
+// IO VECTOR, struct iovec itself on posix
+//---------------------------------------------------------------------
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+struct IKCPIOVEC
+{
+    void *iov_base;
+    size_t iov_len;
+};
+typedef struct IKCPIOVEC ikcp_iovec;
+#else
+#include <sys/uio.h>
+typedef struct iovec ikcp_iovec;
+#endif
+
+
 //=====================================================================
 // SEGMENT, 报文段的定义
 //=====================================================================
@@ -279,10 +295,63 @@ struct IKCPSEG
     IUINT32 rto;  // 下一次重传要等待的时间
     IUINT32 fastack;  //快速重传机制，记录被跳过的次数，超过次数进行快速重传
     IUINT32 xmit;   //重传次数
+    IUINT32 cap;    // bytes allocated for data
+    IUINT32 timer;  // position in kcp->rto_heap
+    // delivery rate sampling: segments delivered when this one was
+    // (re)sent and the time of the latest delivery then
+    IUINT32 delivered, delivered_ts;
+    struct IKCPBUFREF *ref;  // shared user buffer, NULL when data is owned
+    const char *ext;  // payload inside ref when ref is not NULL
     char data[1];  //数据内容
 };
 
 
+//---------------------------------------------------------------------
+// ALLOCATOR
+//---------------------------------------------------------------------
+struct IKCPALLOCATOR
+{
+    void* (*alloc)(size_t size, void *ctx);
+    void (*dealloc)(void *ptr, void *ctx);
+    void *ctx;
+};
+
+
+//---------------------------------------------------------------------
+// CONGESTION CONTROL
+//---------------------------------------------------------------------
+struct IKCPCB;
+
+// what one ikcp_input (or ikcp_input_batch) acknowledged
+struct IKCPACKSAMPLE
+{
+    IUINT32 advance;   // datagrams that moved snd_una forward
+    IUINT32 acked;     // segments removed from snd_buf
+};
+
+// congestion controller: shared and read-only, per connection state
+// goes to kcp->cc_state. controllers keep kcp->cwnd (in segments) up
+// to date, ikcp_flush sends no more than that unless nocwnd is set.
+// every hook may be NULL
+struct IKCPCC
+{
+    const char *name;
+    // set up / free kcp->cc_state, init returns below zero for error
+    int (*init)(struct IKCPCB *kcp);
+    void (*release)(struct IKCPCB *kcp);
+    // a segment was acknowledged, just before it is freed
+    void (*on_acked)(struct IKCPCB *kcp, const struct IKCPSEG *seg);
+    // acks arrived, after the fast retransmit counters were updated
+    void (*on_ack)(struct IKCPCB *kcp, const struct IKCPACKSAMPLE *sample);
+    // 'count' segments were fast retransmitted by a flush
+    void (*on_fastretransmit)(struct IKCPCB *kcp, IUINT32 count);
+    // a retransmission timed out during a flush sending at most 'cwnd'
+    void (*on_loss)(struct IKCPCB *kcp, IUINT32 cwnd);
+    // a data segment is about to be transmitted (xmit counts this one)
+    void (*on_send)(struct IKCPCB *kcp, struct IKCPSEG *seg);
+};
+
+
 //---------------------------------------------------------------------
 // IKCPCB
 //---------------------------------------------------------------------
@@ -314,14 +383,41 @@ struct IKCPCB
     struct IQUEUEHEAD rcv_queue;
     // 发送buffer
     struct IQUEUEHEAD snd_buf;
-    // 接收buffer
-    struct IQUEUEHEAD rcv_buf;
+    // 接收buffer, slots indexed by sn & rcv_mask, rcv_bitmap marks
+    // the occupied ones
+    struct IKCPSEG **rcv_buf;
+    IUINT32 *rcv_bitmap;
+    IUINT32 rcv_mask;
+    // snd_buf indexed by sn, power-of-two slots (snd_mask + 1)
+    struct IKCPSEG **snd_ring;
+    IUINT32 snd_mask;
+    // segments in flight ordered by resendts (binary min-heap)
+    struct IKCPSEG **rto_heap;
+    IUINT32 nrto_heap;
+    // a segment up to fastack_sn reached the fast resend threshold
+    IUINT32 fastack_sn;
+    int fastack_pending;
+    // segment pool: recycled segments with mss bytes of data
+    struct IQUEUEHEAD pool;
+    IUINT32 npool, pool_max;
+    IUINT32 pool_hit, pool_miss;
     IUINT32 *acklist;
     IUINT32 ackcount;
     IUINT32 ackblock;
+    // selective ack: enabled locally, confirmed by the remote, offers
+    // sent so far and whether an offer must be answered
+    IUINT32 sack, sack_peer, sack_offer, sack_reply;
+    // delayed ack: in order segments held back (ackpend) since
+    // ackpend_ts, acknowledged by the latest one (ackpend_sn/ackpend_ts)
+    IUINT32 ackdelay, ackevery;
+    IUINT32 ackpend, ackpend_sn, ackpend_ts, ackpend_since;
     void *user;
     //
     char *buffer;
+    // bytes each output buffer holds (buffer, batch slots, acquired
+    // ones): the mtu, or more while segments cut for a larger mss
+    // before ikcp_setmtu are queued
+    IUINT32 slot;
     // 触发快速重传的重复ACK个数
     int fastresend;
     int fastlimit;
@@ -329,7 +425,42 @@ struct IKCPCB
     // 是否是流式
     int nocwnd, stream;
     int logmask;
+    // allocator for this object, alloc == NULL for the global one
+    struct IKCPALLOCATOR allocator;
     int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
+    // batched output: datagrams of one flush go to rotating slots of
+    // 'slot' bytes each in batch, handed over 'maxbatch' at a time
+    int (*output_batch)(const ikcp_iovec *iov, int count,
+        struct IKCPCB *kcp, void *user);
+    ikcp_iovec *batch_iov;
+    char *batch;
+    int nbatch, maxbatch;
+    // encode in place: datagrams are written into buffers taken from
+    // output_acquire and handed over by output_commit
+    char* (*output_acquire)(int size, struct IKCPCB *kcp, void *user);
+    int (*output_commit)(char *buf, int len, struct IKCPCB *kcp,
+        void *user);
+    char *acquired;
+    // congestion controller, ikcp_cc_reno by default. pacing_rate is
+    // the rate it asks for in bytes per second, 0 for none
+    const struct IKCPCC *cc;
+    void *cc_state;
+    IUINT32 pacing_rate;
+    // pacing: bytes new data may take now (below zero once overdrawn by
+    // retransmissions), refilled at pace_rate since pace_ts. pace_wait
+    // is set when queued data waits for pace_next
+    IUINT32 pacing, pace_rate, pace_ts, pace_next, pace_wait;
+    IINT32 pace_tokens;
+    // time units per millisec, 1000 in microsec mode (ikcp_usec): current,
+    // ts, interval, the rto and rtt estimates are all in these units
+    IUINT32 clock;
+    // immediate mode (ikcp_immediate), inflush guards against a flush
+    // within a flush (eg. ikcp_send from the output callback)
+    IUINT32 immediate, inflush;
+    // cross-thread handoff (ikcp_mailbox.h), pumped by ikcp_update and
+    // by immediate mode flushes
+    void (*pump)(struct IKCPCB *kcp, void *mailbox);
+    void *mailbox;
     void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
 };
 
@@ -362,6 +493,13 @@ extern "C" {
 // output callback can be setup like this: 'kcp->output = my_udp_output'
 ikcpcb* ikcp_create(IUINT32 conv, void *user);
 
+// same as ikcp_create, everything this kcp object allocates (itself,
+// segments, acklist, buffers) goes through 'allocator', which is copied.
+// NULL falls back to the global allocator set by ikcp_allocator. it
+// needs both alloc and dealloc (or neither), returns NULL otherwise
+ikcpcb* ikcp_create_ex(IUINT32 conv, void *user,
+    const struct IKCPALLOCATOR *allocator);
+
 // release kcp control object
 void ikcp_release(ikcpcb *kcp);
 
@@ -369,17 +507,57 @@ void ikcp_release(ikcpcb *kcp);
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
     ikcpcb *kcp, void *user));
 
+// set batched output callback, invoked with up to 'maxbatch' datagrams
+// at once (sendmmsg style) instead of 'output'. NULL turns it off.
+// returns below zero for error
+int ikcp_setoutput_batch(ikcpcb *kcp, int (*output_batch)(
+    const ikcp_iovec *iov, int count, ikcpcb *kcp, void *user),
+    int maxbatch);
+
+// set output buffer provider: acquire returns a writable buffer of at
+// least 'size' bytes (the mtu, more while segments cut before the mtu
+// was lowered are queued), or NULL to use kcp's own buffer this time,
+// and each datagram is encoded into it then passed to commit instead of
+// the output callbacks. commit may get len 0 for a buffer left unused
+void ikcp_setoutput_buffer(ikcpcb *kcp,
+    char* (*acquire)(int size, ikcpcb *kcp, void *user),
+    int (*commit)(char *buf, int len, ikcpcb *kcp, void *user));
+
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
+// zero copy recv: point iov[] at the fragments of the next message,
+// which stay queued until ikcp_recv_release. returns how many entries
+// were filled, -1 for EAGAIN, -2 for an incomplete message, -3 when
+// 'count' is too small
+int ikcp_recv_view(ikcpcb *kcp, ikcp_iovec *iov, int count);
+
+// drop the message returned by ikcp_recv_view, returns its size
+int ikcp_recv_release(ikcpcb *kcp);
+
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// scatter/gather send: the 'iovcnt' buffers of 'iov' form one message
+// (or are appended to the stream), fragmented across buffer boundaries
+int ikcp_sendv(ikcpcb *kcp, const ikcp_iovec *iov, int iovcnt);
+
+// zero-copy send: segments point into 'buffer' instead of copying it,
+// release(buffer, arg) is called once no segment references it anymore
+// (also on error). buffer must stay unchanged until then.
+int ikcp_send_ref(ikcpcb *kcp, const char *buffer, int len,
+    void (*release)(const char *buffer, void *arg), void *arg);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec.
 void ikcp_update(ikcpcb *kcp, IUINT32 current);
 
+// ikcp_update with a timestamp in microsec (eg. CLOCK_MONOTONIC), which
+// keeps sub-millisec precision in microsec mode. calling it before
+// ikcp_input also refreshes the time rtt samples are taken against
+void ikcp_update_us(ikcpcb *kcp, IUINT64 current);
+
 // Determine when should you invoke ikcp_update:
 // returns when you should invoke ikcp_update in millisec, if there
 // is no ikcp_input/_send calling. you can call ikcp_update in that
@@ -389,9 +567,19 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current);
 // or optimize ikcp_update when handling massive kcp connections)
 IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current);
 
+// ikcp_check in microsec, for ikcp_update_us
+IUINT64 ikcp_check_us(const ikcpcb *kcp, IUINT64 current);
+
 // when you received a low level packet (eg. UDP packet), call it
 int ikcp_input(ikcpcb *kcp, const char *data, long size);
 
+// input 'count' datagrams at once (eg. from recvmmsg): fast retransmit
+// and window updates are worked out once for the whole batch. status[i]
+// (if not NULL) gets what ikcp_input would return for iov[i], returns
+// the number of datagrams accepted
+int ikcp_input_batch(ikcpcb *kcp, const ikcp_iovec *iov, int count,
+    int *status);
+
 // flush pending data
 void ikcp_flush(ikcpcb *kcp);
 
@@ -404,6 +592,11 @@ int ikcp_setmtu(ikcpcb *kcp, int mtu);
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 
+// segment pool: recycle up to 'maxfree' mss sized segments instead of
+// returning them to the allocator, 0 to disable (default). hits and
+// misses are counted in kcp->pool_hit / kcp->pool_miss
+int ikcp_setpool(ikcpcb *kcp, int maxfree);
+
 // get how many packet is waiting to be sent
 int ikcp_waitsnd(const ikcpcb *kcp);
 
@@ -414,12 +607,82 @@ int ikcp_waitsnd(const ikcpcb *kcp);
 // nc: 0:normal congestion control(default), 1:disable congestion control
 int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc);
 
+// internal update interval in millisec (10 to 5000)
+int ikcp_interval(ikcpcb *kcp, int interval);
+
+// microsec mode: time is kept in microsec instead of millisec, so the
+// rtt and rto of sub-millisec paths are measured rather than rounded
+// to whole millisec. parameters of the other calls stay in millisec,
+// kcp->rx_minrto (like rx_rto) is in microsec. call it before the
+// first ikcp_update, returns below zero after. the wire format doesn't
+// change, the remote only echoes ts back. 0 to disable (default)
+int ikcp_usec(ikcpcb *kcp, int enable);
+
+// internal update interval in microsec: 100 to 5000000 in microsec
+// mode, otherwise rounded up to millisec
+int ikcp_interval_us(ikcpcb *kcp, int interval);
+
+// selective ack: 1 to offer IKCP_CMD_SACK (ranges of received sn with
+// one echo timestamp) to the remote, acks switch to it once the remote
+// offers it as well. 0 to disable (default), plain acks are used
+int ikcp_sack(ikcpcb *kcp, int enable);
+
+// pacing: new data goes out at kcp->pacing_rate when the congestion
+// controller sets one, else at cwnd/srtt (x2 in slow start, x5/4
+// after), rather than a whole window per flush. bursts are bounded by
+// one interval worth, so drive ikcp_update by ikcp_check, which then
+// returns the next send time. 0 to disable (default)
+int ikcp_pacing(ikcpcb *kcp, int enable);
+
+// immediate mode: ikcp_send and ikcp_input transmit right away what
+// they made ready, acks and new data within the window (as paced),
+// instead of waiting for the next ikcp_update. each call flushes once,
+// so messages and datagrams passed in one call share datagrams.
+// retransmission timeouts still wait for ikcp_update. ts of new
+// segments is the time of the latest ikcp_update, call it (or
+// ikcp_update_us) before to keep rtt samples exact. 0 to disable
+// (default)
+int ikcp_immediate(ikcpcb *kcp, int enable);
+
+// delayed ack: acks for segments arriving in order are held back for
+// at most 'delay' millisec (rounded up to the flush interval) or until
+// 'every' of them are pending, then a single ack for the latest one is
+// sent, out of order data is still acked right away. 'delay' 0 to
+// disable (default), 'every' defaults to 2
+int ikcp_delack(ikcpcb *kcp, int delay, int every);
+
+// the default congestion controller: slow start up to ssthresh, then
+// additive increase; halved on fast retransmit, back to 1 on timeout
+extern const struct IKCPCC ikcp_cc_reno;
+
+// model based controller (BBR like): estimates the bottleneck bandwidth
+// from delivery rate samples and the min rtt, sets cwnd to a multiple
+// of their product and pacing_rate from the bandwidth. losses alone
+// don't shrink the window
+extern const struct IKCPCC ikcp_cc_bbr;
+
+// select the congestion controller of this connection, NULL for
+// ikcp_cc_reno. cwnd and ssthresh are kept as they are. returns below
+// zero when its init fails (the previous one stays)
+int ikcp_setcc(ikcpcb *kcp, const struct IKCPCC *cc);
+
 
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 
 // setup allocator
 void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 
+// bundled allocator: thread-local free lists of power-of-two size
+// classes, blocks are refilled from the global allocator. use it with
+// ikcp_create_ex so worker threads recycle their own memory:
+//   struct IKCPALLOCATOR a = { ikcp_arena_malloc, ikcp_arena_free, 0 };
+// a block freed on another thread joins that thread's cache.
+void* ikcp_arena_malloc(size_t size, void *ctx);
+void ikcp_arena_free(void *ptr, void *ctx);
+
+// release every block cached by the calling thread (eg. before exit)
+void ikcp_arena_trim(void);
+
 // read conv
 IUINT32 ikcp_getconv(const void *ptr);
 
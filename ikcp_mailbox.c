@@ -0,0 +1,290 @@
+//=====================================================================
+//
+// ikcp_mailbox.c - lock-free handoff between application threads and
+//                  the thread owning a kcp object
+//
+//=====================================================================
+#include "ikcp_mailbox.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+//=====================================================================
+// MAILBOX
+//=====================================================================
+#define IKCP_LOAD(p, order)        __atomic_load_n((p), (order))
+#define IKCP_STORE(p, v, order)    __atomic_store_n((p), (v), (order))
+
+struct IKCPMESSAGE
+{
+    struct IKCPMESSAGE *next;
+    int len;
+    char data[1];
+};
+
+struct IKCPMAILBOX
+{
+    ikcpcb *kcp;
+    int capacity;
+    int send_fd, recv_fd;
+    // posted messages: intrusive mpsc queue, producers swap 'tail' and
+    // link behind the previous one, the owning thread pops at 'head'
+    struct IKCPMESSAGE stub;
+    struct IKCPMESSAGE *head;
+    char pad0[64];
+    struct IKCPMESSAGE *tail;
+    int nsend;                  // posted and not popped yet
+    char pad1[64];
+    // received messages: spsc ring, the owning thread produces at
+    // 'rtail', the application consumes at 'rhead'
+    struct IKCPMESSAGE **ring;
+    IUINT32 mask;
+    IUINT32 rtail;
+    int pumping;                // immediate mode flushes re-enter a pump
+    char pad2[64];
+    IUINT32 rhead;
+};
+
+
+static void ikcp_mailbox_wake(int fd)
+{
+    IUINT64 one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        // counter saturated: it is readable anyway
+    }
+}
+
+static void ikcp_mailbox_push(ikcp_mailbox *mailbox, struct IKCPMESSAGE *msg)
+{
+    struct IKCPMESSAGE *prev;
+    IKCP_STORE(&msg->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&mailbox->tail, msg, __ATOMIC_ACQ_REL);
+    IKCP_STORE(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+// NULL when empty or when a producer hasn't linked its message yet
+static struct IKCPMESSAGE* ikcp_mailbox_pop(ikcp_mailbox *mailbox)
+{
+    struct IKCPMESSAGE *head = mailbox->head;
+    struct IKCPMESSAGE *next = IKCP_LOAD(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &mailbox->stub) {
+        if (next == NULL) return NULL;
+        mailbox->head = next;
+        head = next;
+        next = IKCP_LOAD(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        mailbox->head = next;
+        return head;
+    }
+    // 'head' is the last one: put the stub behind it to take it out
+    if (head != IKCP_LOAD(&mailbox->tail, __ATOMIC_ACQUIRE)) return NULL;
+    ikcp_mailbox_push(mailbox, &mailbox->stub);
+    next = IKCP_LOAD(&head->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        mailbox->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+static void ikcp_mailbox_hook(ikcpcb *kcp, void *mailbox)
+{
+    (void)kcp;
+    ikcp_mailbox_pump((ikcp_mailbox*)mailbox);
+}
+
+ikcp_mailbox* ikcp_mailbox_create(ikcpcb *kcp, int capacity)
+{
+    ikcp_mailbox *mailbox;
+    IUINT32 size = 1;
+
+    if (capacity < 1 || capacity > (1 << 24)) return NULL;
+    while (size < (IUINT32)capacity) size <<= 1;
+
+    mailbox = (ikcp_mailbox*)calloc(1, sizeof(ikcp_mailbox));
+    if (mailbox == NULL) return NULL;
+
+    mailbox->ring = (struct IKCPMESSAGE**)calloc(size,
+        sizeof(struct IKCPMESSAGE*));
+    mailbox->send_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mailbox->recv_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mailbox->ring == NULL || mailbox->send_fd < 0 ||
+        mailbox->recv_fd < 0) {
+        if (mailbox->send_fd >= 0) close(mailbox->send_fd);
+        if (mailbox->recv_fd >= 0) close(mailbox->recv_fd);
+        free(mailbox->ring);
+        free(mailbox);
+        return NULL;
+    }
+
+    mailbox->kcp = kcp;
+    mailbox->capacity = (int)size;
+    mailbox->mask = size - 1;
+    mailbox->stub.next = NULL;
+    mailbox->head = &mailbox->stub;
+    mailbox->tail = &mailbox->stub;
+
+    kcp->mailbox = mailbox;
+    kcp->pump = ikcp_mailbox_hook;
+
+    return mailbox;
+}
+
+void ikcp_mailbox_release(ikcp_mailbox *mailbox)
+{
+    struct IKCPMESSAGE *msg;
+
+    if (mailbox == NULL) return;
+
+    mailbox->kcp->pump = NULL;
+    mailbox->kcp->mailbox = NULL;
+
+    while ((msg = ikcp_mailbox_pop(mailbox)) != NULL) free(msg);
+    for (; mailbox->rhead != mailbox->rtail; mailbox->rhead++) {
+        free(mailbox->ring[mailbox->rhead & mailbox->mask]);
+    }
+
+    close(mailbox->send_fd);
+    close(mailbox->recv_fd);
+    free(mailbox->ring);
+    free(mailbox);
+}
+
+int ikcp_mailbox_recv_fd(const ikcp_mailbox *mailbox)
+{
+    return mailbox->recv_fd;
+}
+
+int ikcp_mailbox_send_fd(const ikcp_mailbox *mailbox)
+{
+    return mailbox->send_fd;
+}
+
+
+//---------------------------------------------------------------------
+// application side
+//---------------------------------------------------------------------
+int ikcp_mailbox_send(ikcp_mailbox *mailbox, const char *buffer, int len)
+{
+    struct IKCPMESSAGE *msg;
+    int count;
+
+    if (len < 0 || (len > 0 && buffer == NULL)) return -1;
+
+    count = __atomic_fetch_add(&mailbox->nsend, 1, __ATOMIC_ACQ_REL);
+    if (count >= mailbox->capacity) {
+        __atomic_fetch_sub(&mailbox->nsend, 1, __ATOMIC_ACQ_REL);
+        return -2;
+    }
+
+    msg = (struct IKCPMESSAGE*)malloc(sizeof(struct IKCPMESSAGE) + len);
+    if (msg == NULL) {
+        __atomic_fetch_sub(&mailbox->nsend, 1, __ATOMIC_ACQ_REL);
+        return -3;
+    }
+    msg->len = len;
+    if (len > 0) memcpy(msg->data, buffer, len);
+
+    ikcp_mailbox_push(mailbox, msg);
+
+    // the owning thread drained everything before: wake it up
+    if (count == 0) ikcp_mailbox_wake(mailbox->send_fd);
+
+    return 0;
+}
+
+int ikcp_mailbox_peeksize(const ikcp_mailbox *mailbox)
+{
+    IUINT32 head = mailbox->rhead;
+    if (head == IKCP_LOAD(&mailbox->rtail, __ATOMIC_ACQUIRE)) return -1;
+    return mailbox->ring[head & mailbox->mask]->len;
+}
+
+int ikcp_mailbox_recv(ikcp_mailbox *mailbox, char *buffer, int len)
+{
+    IUINT32 head = mailbox->rhead;
+    struct IKCPMESSAGE *msg;
+    int size;
+
+    if (head == IKCP_LOAD(&mailbox->rtail, __ATOMIC_ACQUIRE)) return -1;
+
+    msg = mailbox->ring[head & mailbox->mask];
+    if (msg->len > len) return -2;
+
+    size = msg->len;
+    if (size > 0) memcpy(buffer, msg->data, size);
+    free(msg);
+    IKCP_STORE(&mailbox->rhead, head + 1, __ATOMIC_RELEASE);
+
+    // the ring was full, kcp holds more: the owning thread may pump again
+    if (IKCP_LOAD(&mailbox->rtail, __ATOMIC_ACQUIRE) - head > mailbox->mask) {
+        ikcp_mailbox_wake(mailbox->send_fd);
+    }
+
+    return size;
+}
+
+
+//---------------------------------------------------------------------
+// owning thread
+//---------------------------------------------------------------------
+int ikcp_mailbox_pump(ikcp_mailbox *mailbox)
+{
+    ikcpcb *kcp = mailbox->kcp;
+    IUINT32 limit = kcp->snd_wnd * 2;
+    IUINT32 tail = mailbox->rtail;
+    int moved = 0, received = 0;
+
+    // a flush from ikcp_send below pumps again: leave it to this one
+    if (mailbox->pumping) return 0;
+    mailbox->pumping = 1;
+
+    // posted messages, as long as kcp isn't too far behind: the rest
+    // waits for the next ikcp_update
+    while ((IUINT32)ikcp_waitsnd(kcp) < limit) {
+        struct IKCPMESSAGE *msg = ikcp_mailbox_pop(mailbox);
+        if (msg == NULL) {
+            // a producer is between its swap and its link: come back
+            if (IKCP_LOAD(&mailbox->nsend, __ATOMIC_ACQUIRE) > 0) {
+                ikcp_mailbox_wake(mailbox->send_fd);
+            }
+            break;
+        }
+        __atomic_fetch_sub(&mailbox->nsend, 1, __ATOMIC_ACQ_REL);
+        // too large for kcp (ikcp_send fails): dropped
+        ikcp_send(kcp, msg->data, msg->len);
+        free(msg);
+        moved++;
+    }
+
+    // received messages, while the ring has room
+    while (tail - IKCP_LOAD(&mailbox->rhead, __ATOMIC_ACQUIRE) <=
+        mailbox->mask) {
+        struct IKCPMESSAGE *msg;
+        int size = ikcp_peeksize(kcp);
+        if (size < 0) break;
+        msg = (struct IKCPMESSAGE*)malloc(sizeof(struct IKCPMESSAGE) +
+            size);
+        if (msg == NULL) break;
+        msg->len = ikcp_recv(kcp, msg->data, size);
+        mailbox->ring[tail & mailbox->mask] = msg;
+        tail++;
+        received++;
+    }
+
+    if (received > 0) {
+        IKCP_STORE(&mailbox->rtail, tail, __ATOMIC_RELEASE);
+        ikcp_mailbox_wake(mailbox->recv_fd);
+    }
+
+    mailbox->pumping = 0;
+    return moved + received;
+}
+
+
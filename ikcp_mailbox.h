@@ -0,0 +1,73 @@
+//=====================================================================
+//
+// ikcp_mailbox.h - lock-free handoff between application threads and
+//                  the thread owning a kcp object
+//
+// Application threads post messages to a multi-producer queue and take
+// received ones from a single-producer/single-consumer ring, none of
+// them touching the kcp object. The owning (network) thread pumps the
+// mailbox in ikcp_update (and in immediate mode, whenever ikcp_send or
+// ikcp_input flushes): posted messages go to ikcp_send, received ones
+// from ikcp_recv to the ring. Each side has an eventfd to wait on.
+//
+//=====================================================================
+#ifndef __IKCP_MAILBOX_H__
+#define __IKCP_MAILBOX_H__
+
+#include "ikcp.h"
+
+
+//=====================================================================
+// MAILBOX
+//=====================================================================
+struct IKCPMAILBOX;
+typedef struct IKCPMAILBOX ikcp_mailbox;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// create a mailbox for 'kcp' and hook it into ikcp_update. at most
+// 'capacity' messages wait in each direction (rounded up to a power of
+// two). call from the owning thread, returns NULL for error
+ikcp_mailbox* ikcp_mailbox_create(ikcpcb *kcp, int capacity);
+
+// unhook from the kcp object and free messages still queued. call from
+// the owning thread once the application threads are done with it
+void ikcp_mailbox_release(ikcp_mailbox *mailbox);
+
+// application threads, any number of them: queue a message for
+// ikcp_send. returns below zero when the mailbox is full (-2) or for
+// error
+int ikcp_mailbox_send(ikcp_mailbox *mailbox, const char *buffer, int len);
+
+// one application thread: take a received message, returns its size,
+// -1 when none is waiting, -2 when 'len' is too small (kept queued)
+int ikcp_mailbox_recv(ikcp_mailbox *mailbox, char *buffer, int len);
+
+// size of the next received message, -1 for none
+int ikcp_mailbox_peeksize(const ikcp_mailbox *mailbox);
+
+// eventfd readable when messages were received (application side).
+// read it to clear, then ikcp_mailbox_recv until it returns -1
+int ikcp_mailbox_recv_fd(const ikcp_mailbox *mailbox);
+
+// eventfd readable when messages were posted to an empty queue or a
+// full receive ring got room (owning side): read it, pump (or
+// ikcp_update) and reschedule the kcp object
+int ikcp_mailbox_send_fd(const ikcp_mailbox *mailbox);
+
+// owning thread: move posted messages to ikcp_send and received ones
+// to the ring, ikcp_update does it first thing, immediate mode flushes
+// too. returns how many messages were moved
+int ikcp_mailbox_pump(ikcp_mailbox *mailbox);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
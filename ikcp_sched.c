@@ -0,0 +1,225 @@
+//=====================================================================
+//
+// ikcp_sched.c - timer wheel driving ikcp_update by ikcp_check
+//
+//=====================================================================
+#include "ikcp_sched.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//=====================================================================
+// TIMER WHEEL
+//=====================================================================
+#define IKCP_SCHED_MASK0    (IKCP_SCHED_SIZE0 - 1)
+#define IKCP_SCHED_MASKN    (IKCP_SCHED_SIZEN - 1)
+
+// slot index of 'expires' in level n (1..3)
+#define IKCP_SCHED_INDEX(expires, n) \
+    (((expires) >> (IKCP_SCHED_BITS0 + ((n) - 1) * IKCP_SCHED_BITSN)) & \
+    IKCP_SCHED_MASKN)
+
+// farthest deadline the wheel can hold, later ones are clamped
+#define IKCP_SCHED_SPAN \
+    (((IUINT32)1 << (IKCP_SCHED_BITS0 + 3 * IKCP_SCHED_BITSN)) - 1)
+
+
+ikcp_sched* ikcp_sched_create(IUINT32 current)
+{
+    ikcp_sched *sched;
+    int i, j;
+
+    sched = (ikcp_sched*)malloc(sizeof(ikcp_sched));
+    if (sched == NULL) return NULL;
+
+    sched->current = current;
+    sched->jiffies = current;
+    sched->count = 0;
+    memset(sched->tv1_map, 0, sizeof(sched->tv1_map));
+    for (i = 0; i < IKCP_SCHED_SIZE0; i++) {
+        iqueue_init(&sched->tv1[i]);
+    }
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < IKCP_SCHED_SIZEN; j++) {
+            iqueue_init(&sched->tvn[i][j]);
+        }
+    }
+    return sched;
+}
+
+void ikcp_sched_release(ikcp_sched *sched)
+{
+    free(sched);
+}
+
+// link an entry into the slot of its expires
+static void ikcp_sched_link(ikcp_sched *sched, ikcp_sched_entry *entry)
+{
+    IUINT32 expires = entry->expires;
+    IUINT32 idx = expires - sched->jiffies;
+    struct IQUEUEHEAD *vec;
+
+    if ((IINT32)idx < IKCP_SCHED_SIZE0) {
+        // already due ones run on the next slot
+        IUINT32 index = (((IINT32)idx < 0)? sched->jiffies : expires) &
+            IKCP_SCHED_MASK0;
+        sched->tv1_map[index >> 5] |= (IUINT32)1 << (index & 31);
+        vec = &sched->tv1[index];
+    }
+    else if (idx < ((IUINT32)1 << (IKCP_SCHED_BITS0 + IKCP_SCHED_BITSN))) {
+        vec = &sched->tvn[0][IKCP_SCHED_INDEX(expires, 1)];
+    }
+    else if (idx < ((IUINT32)1 <<
+        (IKCP_SCHED_BITS0 + 2 * IKCP_SCHED_BITSN))) {
+        vec = &sched->tvn[1][IKCP_SCHED_INDEX(expires, 2)];
+    }
+    else {
+        if (idx > IKCP_SCHED_SPAN) {
+            expires = sched->jiffies + IKCP_SCHED_SPAN;
+            entry->expires = expires;
+        }
+        vec = &sched->tvn[2][IKCP_SCHED_INDEX(expires, 3)];
+    }
+
+    iqueue_add_tail(&entry->node, vec);
+}
+
+// move the entries of a higher level slot down, returns the slot index
+static int ikcp_sched_cascade(ikcp_sched *sched, int level, int index)
+{
+    struct IQUEUEHEAD *head = &sched->tvn[level][index];
+    while (!iqueue_is_empty(head)) {
+        ikcp_sched_entry *entry = iqueue_entry(head->next,
+            ikcp_sched_entry, node);
+        iqueue_del(&entry->node);
+        ikcp_sched_link(sched, entry);
+    }
+    return index;
+}
+
+// slots from 'index' to the next occupied one of the first level, or
+// to its end. bits left by entries removed since are cleared
+static IUINT32 ikcp_sched_skip(ikcp_sched *sched, IUINT32 index)
+{
+    IUINT32 i = index;
+    while (i < IKCP_SCHED_SIZE0) {
+        IUINT32 word = sched->tv1_map[i >> 5] >> (i & 31);
+        if (word == 0) {
+            i = (i | 31) + 1;
+            continue;
+        }
+        for (; (word & 1) == 0; word >>= 1) i++;
+        if (!iqueue_is_empty(&sched->tv1[i])) break;
+        sched->tv1_map[i >> 5] &= ~((IUINT32)1 << (i & 31));
+        i++;
+    }
+    return i - index;
+}
+
+// nothing to send, acknowledge or probe: ikcp_update would only move
+// ts_flush, so the connection is parked until touched
+static int ikcp_sched_idle(const ikcpcb *kcp)
+{
+    return kcp->nsnd_buf == 0 && kcp->nsnd_que == 0 &&
+        kcp->ackcount == 0 && kcp->ackpend == 0 &&
+        kcp->probe == 0 && kcp->rmt_wnd != 0;
+}
+
+void ikcp_sched_add(ikcp_sched *sched, ikcp_sched_entry *entry,
+    ikcpcb *kcp)
+{
+    entry->kcp = kcp;
+    entry->expires = sched->current;
+    ikcp_sched_link(sched, entry);
+    sched->count++;
+}
+
+void ikcp_sched_touch(ikcp_sched *sched, ikcp_sched_entry *entry,
+    IUINT32 current)
+{
+    IUINT32 expires = ikcp_check(entry->kcp, current);
+    int parked = iqueue_is_empty(&entry->node);
+    if (expires == entry->expires && !parked) return;
+    iqueue_del(&entry->node);
+    entry->expires = expires;
+    ikcp_sched_link(sched, entry);
+}
+
+void ikcp_sched_remove(ikcp_sched *sched, ikcp_sched_entry *entry)
+{
+    iqueue_del_init(&entry->node);
+    sched->count--;
+}
+
+int ikcp_sched_run(ikcp_sched *sched, IUINT32 current)
+{
+    struct IQUEUEHEAD queue;
+    int count = 0;
+
+    sched->current = current;
+
+    while ((IINT32)(current - sched->jiffies) >= 0) {
+        int index = (int)(sched->jiffies & IKCP_SCHED_MASK0);
+
+        // refill the first level from the next ones when it wraps
+        if (index == 0 &&
+            ikcp_sched_cascade(sched, 0,
+                IKCP_SCHED_INDEX(sched->jiffies, 1)) == 0 &&
+            ikcp_sched_cascade(sched, 1,
+                IKCP_SCHED_INDEX(sched->jiffies, 2)) == 0) {
+            ikcp_sched_cascade(sched, 2, IKCP_SCHED_INDEX(sched->jiffies, 3));
+        }
+
+        // empty: go straight to the next occupied slot, at most to the
+        // next wrap (which cascades) and to 'current'
+        if (iqueue_is_empty(&sched->tv1[index])) {
+            IUINT32 skip = ikcp_sched_skip(sched, (IUINT32)index);
+            IUINT32 left = current - sched->jiffies + 1;
+            sched->jiffies += (skip < left)? skip : left;
+            continue;
+        }
+
+        // take the slot before updating: rescheduled entries that are
+        // due again go to the next slot, not this one
+        queue.next = sched->tv1[index].next;
+        queue.prev = sched->tv1[index].prev;
+        queue.next->prev = &queue;
+        queue.prev->next = &queue;
+        iqueue_init(&sched->tv1[index]);
+        sched->tv1_map[index >> 5] &= ~((IUINT32)1 << (index & 31));
+        sched->jiffies++;
+
+        while (!iqueue_is_empty(&queue)) {
+            ikcp_sched_entry *entry = iqueue_entry(queue.next,
+                ikcp_sched_entry, node);
+            iqueue_del(&entry->node);
+            ikcp_update(entry->kcp, current);
+            count++;
+            if (ikcp_sched_idle(entry->kcp)) {
+                iqueue_init(&entry->node);
+                continue;
+            }
+            entry->expires = ikcp_check(entry->kcp, current);
+            ikcp_sched_link(sched, entry);
+        }
+    }
+
+    return count;
+}
+
+IUINT32 ikcp_sched_next(const ikcp_sched *sched)
+{
+    IUINT32 jiffies = sched->jiffies;
+    IUINT32 i;
+    // the first level holds everything due before it wraps
+    for (i = 0; i < IKCP_SCHED_SIZE0; i++) {
+        IUINT32 index = (jiffies + i) & IKCP_SCHED_MASK0;
+        if (index == 0 && i > 0) break;
+        if (!iqueue_is_empty(&sched->tv1[index])) return jiffies + i;
+    }
+    return jiffies + i;
+}
+
+
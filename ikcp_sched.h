@@ -0,0 +1,87 @@
+//=====================================================================
+//
+// ikcp_sched.h - timer wheel driving ikcp_update by ikcp_check
+//
+// Each connection sits in a hierarchical timer wheel at the time
+// ikcp_check returns for it. ikcp_sched_run only updates connections
+// that are due, so the cost of a tick follows the number of active
+// connections rather than the total.
+//
+//=====================================================================
+#ifndef __IKCP_SCHED_H__
+#define __IKCP_SCHED_H__
+
+#include "ikcp.h"
+
+
+//=====================================================================
+// TIMER WHEEL
+//=====================================================================
+#define IKCP_SCHED_BITS0    8    // first level: 256 one ms slots
+#define IKCP_SCHED_BITSN    6    // three more levels of 64 slots
+#define IKCP_SCHED_SIZE0    (1 << IKCP_SCHED_BITS0)
+#define IKCP_SCHED_SIZEN    (1 << IKCP_SCHED_BITSN)
+
+// a scheduled connection, usually embedded in the caller's session
+struct IKCPSCHEDENTRY
+{
+    struct IQUEUEHEAD node;
+    ikcpcb *kcp;
+    IUINT32 expires;
+};
+
+struct IKCPSCHED
+{
+    IUINT32 current;    // time given to the last ikcp_sched_run
+    IUINT32 jiffies;    // next slot time to run
+    IUINT32 count;
+    // first level slots that may be occupied, so runs after a stall
+    // jump over the empty ones
+    IUINT32 tv1_map[IKCP_SCHED_SIZE0 / 32];
+    struct IQUEUEHEAD tv1[IKCP_SCHED_SIZE0];
+    struct IQUEUEHEAD tvn[3][IKCP_SCHED_SIZEN];
+};
+
+typedef struct IKCPSCHED ikcp_sched;
+typedef struct IKCPSCHEDENTRY ikcp_sched_entry;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// create a scheduler, 'current' is the clock in millisec
+ikcp_sched* ikcp_sched_create(IUINT32 current);
+
+// free the scheduler, entries still in it are just forgotten
+void ikcp_sched_release(ikcp_sched *sched);
+
+// schedule 'kcp' through 'entry', due at once
+void ikcp_sched_add(ikcp_sched *sched, ikcp_sched_entry *entry,
+    ikcpcb *kcp);
+
+// reschedule by ikcp_check at 'current', call it after ikcp_send,
+// ikcp_input or ikcp_recv. idle connections (nothing in flight, no ack
+// or probe pending) are not updated any more until touched
+void ikcp_sched_touch(ikcp_sched *sched, ikcp_sched_entry *entry,
+    IUINT32 current);
+
+// stop scheduling an entry
+void ikcp_sched_remove(ikcp_sched *sched, ikcp_sched_entry *entry);
+
+// ikcp_update every connection due by 'current' and schedule it again,
+// returns how many were updated
+int ikcp_sched_run(ikcp_sched *sched, IUINT32 current);
+
+// when ikcp_sched_run has work next, never later than the earliest
+// deadline (use it as the poll/epoll timeout)
+IUINT32 ikcp_sched_next(const ikcp_sched *sched);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
@@ -0,0 +1,612 @@
+//=====================================================================
+//
+// ikcp_shard.c - multi-threaded KCP server runtime
+//
+//=====================================================================
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ikcp_shard.h"
+#include "ikcp_table.h"
+#include "ikcp_sched.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+
+//=====================================================================
+// SHARDED RUNTIME
+//=====================================================================
+#define IKCP_SHARD_BATCH     64      // datagrams per syscall or input batch
+#define IKCP_SHARD_BUDGET    1024    // datagrams read per loop iteration
+#define IKCP_SHARD_INBOX     4096    // handed over datagrams queued at most
+#define IKCP_SHARD_WAIT      100     // longest poll timeout in millisec
+
+// a session: the peer of its kcp object points here by 'data'
+struct IKCPSESSION
+{
+    struct IQUEUEHEAD node;     // sessions of the worker
+    struct IQUEUEHEAD dirty;    // received data, not settled yet
+    ikcp_sched_entry entry;
+    void *data;                 // kcp->user before ikcp_worker_attach
+};
+
+// a datagram received by another worker
+struct IKCPFORWARD
+{
+    struct IKCPFORWARD *next;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int size;
+    char data[1];
+};
+
+struct IKCPWORKER
+{
+    ikcp_shard *shard;
+    int index;
+    ikcp_udp *udp;
+    ikcp_table *table;
+    ikcp_sched *sched;
+    struct IQUEUEHEAD sessions;
+    struct IQUEUEHEAD dirty;
+    struct IKCPSESSION *settling;    // session in the receive callback
+    pthread_t thread;
+    int running;
+    int efd;                          // wakes the worker up
+    // datagrams handed over by the other workers
+    pthread_mutex_t lock;
+    struct IKCPFORWARD *inbox, *inbox_tail;
+    int ninbox;
+};
+
+struct IKCPSHARD
+{
+    int count;
+    int steered;
+    int quit;
+    ikcp_shard_ops ops;
+    void *user;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    ikcp_worker *workers;
+};
+
+
+static IUINT32 ikcp_shard_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (IUINT32)((IUINT64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static struct IKCPSESSION* ikcp_session_of(ikcpcb *kcp)
+{
+    return (struct IKCPSESSION*)((ikcp_udp_peer*)kcp->user)->data;
+}
+
+int ikcp_shard_of(const ikcp_shard *shard, IUINT32 conv)
+{
+    return (int)(conv % (IUINT32)shard->count);
+}
+
+int ikcp_shard_count(const ikcp_shard *shard)
+{
+    return shard->count;
+}
+
+ikcp_worker* ikcp_shard_worker(ikcp_shard *shard, int index)
+{
+    if (index < 0 || index >= shard->count) return NULL;
+    return &shard->workers[index];
+}
+
+int ikcp_shard_steered(const ikcp_shard *shard)
+{
+    return shard->steered;
+}
+
+int ikcp_shard_address(const ikcp_shard *shard, struct sockaddr *addr,
+    socklen_t *addrlen)
+{
+    if (*addrlen < shard->addrlen) return -1;
+    memcpy(addr, &shard->addr, shard->addrlen);
+    *addrlen = shard->addrlen;
+    return 0;
+}
+
+int ikcp_worker_index(const ikcp_worker *worker)
+{
+    return worker->index;
+}
+
+void* ikcp_worker_user(ikcpcb *kcp)
+{
+    return ikcp_session_of(kcp)->data;
+}
+
+
+//---------------------------------------------------------------------
+// sessions
+//---------------------------------------------------------------------
+int ikcp_worker_attach(ikcp_worker *worker, ikcpcb *kcp,
+    const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct IKCPSESSION *session;
+    ikcp_udp_peer *peer;
+
+    if (ikcp_shard_of(worker->shard, kcp->conv) != worker->index) return -1;
+    if (ikcp_table_find(worker->table, kcp->conv) != NULL) return -1;
+
+    session = (struct IKCPSESSION*)malloc(sizeof(struct IKCPSESSION));
+    if (session == NULL) return -2;
+
+    if (ikcp_udp_attach(worker->udp, kcp, addr, addrlen) != 0) {
+        free(session);
+        return -3;
+    }
+
+    if (ikcp_table_insert(worker->table, kcp->conv, kcp) != 0) {
+        ikcp_udp_detach(kcp);
+        free(session);
+        return -2;
+    }
+
+    peer = (ikcp_udp_peer*)kcp->user;
+    session->data = peer->data;
+    peer->data = session;
+    iqueue_init(&session->dirty);
+    iqueue_add_tail(&session->node, &worker->sessions);
+    ikcp_sched_add(worker->sched, &session->entry, kcp);
+
+    return 0;
+}
+
+void ikcp_worker_touch(ikcp_worker *worker, ikcpcb *kcp)
+{
+    ikcp_sched_touch(worker->sched, &ikcp_session_of(kcp)->entry,
+        ikcp_shard_clock());
+}
+
+void ikcp_worker_close(ikcp_worker *worker, ikcpcb *kcp)
+{
+    struct IKCPSESSION *session = ikcp_session_of(kcp);
+
+    ikcp_table_erase(worker->table, kcp->conv);
+    ikcp_sched_remove(worker->sched, &session->entry);
+    iqueue_del(&session->node);
+    iqueue_del(&session->dirty);
+    if (worker->settling == session) worker->settling = NULL;
+
+    ikcp_udp_detach(kcp);
+    kcp->user = session->data;
+    free(session);
+    ikcp_release(kcp);
+}
+
+
+//---------------------------------------------------------------------
+// input
+//---------------------------------------------------------------------
+
+// hand a datagram over to the worker owning its conv
+static void ikcp_worker_forward(ikcp_worker *owner, const char *data,
+    int size, const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct IKCPFORWARD *fwd;
+    IUINT64 one = 1;
+    int wake;
+
+    if (addrlen > sizeof(struct sockaddr_storage)) return;
+
+    fwd = (struct IKCPFORWARD*)malloc(sizeof(struct IKCPFORWARD) + size);
+    if (fwd == NULL) return;
+
+    fwd->next = NULL;
+    memcpy(&fwd->addr, addr, addrlen);
+    fwd->addrlen = addrlen;
+    fwd->size = size;
+    memcpy(fwd->data, data, size);
+
+    pthread_mutex_lock(&owner->lock);
+    if (owner->ninbox >= IKCP_SHARD_INBOX) {
+        // the owner is behind: drop it, kcp retransmits as for any loss
+        pthread_mutex_unlock(&owner->lock);
+        free(fwd);
+        return;
+    }
+    if (owner->inbox_tail) owner->inbox_tail->next = fwd;
+    else owner->inbox = fwd;
+    owner->inbox_tail = fwd;
+    wake = (__atomic_fetch_add(&owner->ninbox, 1, __ATOMIC_RELAXED) ==
+        0);
+    pthread_mutex_unlock(&owner->lock);
+
+    if (wake) {
+        if (write(owner->efd, &one, sizeof(one)) < 0) {
+            // counter saturated, the owner is awake anyway
+        }
+    }
+}
+
+static ikcpcb* ikcp_worker_lookup(ikcp_udp *udp, IUINT32 conv,
+    const char *data, int size, const struct sockaddr *addr,
+    socklen_t addrlen, void *user)
+{
+    ikcp_worker *worker = (ikcp_worker*)user;
+    ikcp_shard *shard = worker->shard;
+    struct IKCPSESSION *session;
+    ikcpcb *kcp;
+
+    (void)udp;
+    kcp = ikcp_table_find(worker->table, conv);
+
+    if (kcp == NULL) {
+        int owner = ikcp_shard_of(shard, conv);
+        if (owner != worker->index) {
+            ikcp_worker_forward(&shard->workers[owner], data, size,
+                addr, addrlen);
+            return NULL;
+        }
+        if (shard->ops.accept == NULL) return NULL;
+        kcp = shard->ops.accept(worker, conv, addr, addrlen, shard->user);
+        if (kcp == NULL) return NULL;
+        if (kcp->conv != conv ||
+            ikcp_worker_attach(worker, kcp, addr, addrlen) != 0) {
+            ikcp_release(kcp);
+            return NULL;
+        }
+    }
+
+    session = ikcp_session_of(kcp);
+    if (iqueue_is_empty(&session->dirty)) {
+        iqueue_add_tail(&session->dirty, &worker->dirty);
+    }
+
+    return kcp;
+}
+
+// input the forwarded datagrams gathered for one session, then free them
+static void ikcp_worker_deliver(ikcpcb *kcp, struct IKCPFORWARD **held,
+    int count)
+{
+    struct iovec iov[IKCP_SHARD_BATCH];
+    int i;
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = held[i]->data;
+        iov[i].iov_len = (size_t)held[i]->size;
+    }
+    if (count > 0) ikcp_input_batch(kcp, iov, count, NULL);
+    for (i = 0; i < count; i++) {
+        free(held[i]);
+    }
+}
+
+// input the datagrams other workers handed over
+static void ikcp_worker_drain(ikcp_worker *worker)
+{
+    struct IKCPFORWARD *fwd, *held[IKCP_SHARD_BATCH];
+    ikcpcb *batch = NULL;
+    int nin = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    fwd = worker->inbox;
+    worker->inbox = NULL;
+    worker->inbox_tail = NULL;
+    __atomic_store_n(&worker->ninbox, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+
+    // sequential datagrams of one session are input together
+    while (fwd) {
+        struct IKCPFORWARD *next = fwd->next;
+        ikcpcb *kcp = ikcp_worker_lookup(worker->udp,
+            ikcp_getconv(fwd->data), fwd->data, fwd->size,
+            (const struct sockaddr*)&fwd->addr, fwd->addrlen, worker);
+        if (kcp == NULL) {
+            free(fwd);
+        }
+        else {
+            if (kcp != batch || nin >= IKCP_SHARD_BATCH) {
+                ikcp_worker_deliver(batch, held, nin);
+                batch = kcp;
+                nin = 0;
+            }
+            held[nin++] = fwd;
+        }
+        fwd = next;
+    }
+    ikcp_worker_deliver(batch, held, nin);
+}
+
+// let the user receive, then reschedule the sessions that got input
+static void ikcp_worker_settle(ikcp_worker *worker)
+{
+    ikcp_shard *shard = worker->shard;
+    IUINT32 current = ikcp_shard_clock();
+
+    while (!iqueue_is_empty(&worker->dirty)) {
+        struct IKCPSESSION *session = iqueue_entry(worker->dirty.next,
+            struct IKCPSESSION, dirty);
+        ikcpcb *kcp = session->entry.kcp;
+        iqueue_del_init(&session->dirty);
+        worker->settling = session;
+        if (shard->ops.receive) {
+            shard->ops.receive(worker, kcp, shard->user);
+        }
+        // unless the callback closed it
+        if (worker->settling) {
+            ikcp_sched_touch(worker->sched, &session->entry, current);
+        }
+        worker->settling = NULL;
+    }
+}
+
+
+//---------------------------------------------------------------------
+// worker thread
+//---------------------------------------------------------------------
+static void* ikcp_worker_main(void *arg)
+{
+    ikcp_worker *worker = (ikcp_worker*)arg;
+    ikcp_shard *shard = worker->shard;
+    struct pollfd fds[2];
+    IUINT32 current;
+
+    if (shard->ops.start) shard->ops.start(worker, shard->user);
+
+    fds[0].fd = ikcp_udp_fd(worker->udp);
+    fds[1].fd = worker->efd;
+    fds[1].events = POLLIN;
+
+    while (!__atomic_load_n(&shard->quit, __ATOMIC_ACQUIRE)) {
+        IUINT32 next = ikcp_sched_next(worker->sched);
+        IINT32 timeout;
+
+        current = ikcp_shard_clock();
+        timeout = (IINT32)(next - current);
+        if (timeout < 0) timeout = 0;
+        if (timeout > IKCP_SHARD_WAIT) timeout = IKCP_SHARD_WAIT;
+        if (shard->ops.poll && timeout > 1) timeout = 1;
+
+        // output left in the queue: wait until the socket takes it
+        fds[0].events = POLLIN;
+        if (ikcp_udp_flush(worker->udp) > 0) fds[0].events |= POLLOUT;
+
+        if (poll(fds, 2, (int)timeout) < 0 && errno != EINTR) break;
+
+        if (fds[1].revents & POLLIN) {
+            IUINT64 value;
+            if (read(worker->efd, &value, sizeof(value)) < 0) {
+                // spurious wakeup
+            }
+        }
+
+        if (__atomic_load_n(&worker->ninbox, __ATOMIC_RELAXED) > 0) {
+            ikcp_worker_drain(worker);
+        }
+        ikcp_udp_recv(worker->udp, IKCP_SHARD_BUDGET);
+        ikcp_worker_settle(worker);
+
+        if (shard->ops.poll) shard->ops.poll(worker, shard->user);
+
+        ikcp_sched_run(worker->sched, ikcp_shard_clock());
+        ikcp_udp_flush(worker->udp);
+    }
+
+    if (shard->ops.stop) shard->ops.stop(worker, shard->user);
+
+    return NULL;
+}
+
+
+//---------------------------------------------------------------------
+// create: one reuseport socket per worker, bound in worker order
+//---------------------------------------------------------------------
+static int ikcp_shard_socket(ikcp_shard *shard)
+{
+    int fd, one = 1;
+    fd = socket(shard->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK |
+        SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+        bind(fd, (const struct sockaddr*)&shard->addr, shard->addrlen) != 0) {
+        close(fd);
+        return -1;
+    }
+    // a zero port: the next sockets join the port the first one got
+    shard->addrlen = sizeof(shard->addr);
+    if (getsockname(fd, (struct sockaddr*)&shard->addr,
+        &shard->addrlen) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// the reuseport group picks socket 'conv % count', which is the worker
+// of the same index since sockets join the group in bind order.
+// conv is little endian on the wire, the loads are big endian
+static int ikcp_shard_steer(ikcp_shard *shard, int fd)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+
+    code[13].k = (IUINT32)shard->count;
+    prog.len = (unsigned short)(sizeof(code) / sizeof(code[0]));
+    prog.filter = code;
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+        &prog, sizeof(prog));
+}
+
+ikcp_shard* ikcp_shard_create(const struct sockaddr *addr,
+    socklen_t addrlen, int count, const ikcp_shard_ops *ops, void *user)
+{
+    ikcp_shard *shard;
+    IUINT32 current = ikcp_shard_clock();
+    int i;
+
+    if (addr == NULL || addrlen > sizeof(struct sockaddr_storage)) {
+        return NULL;
+    }
+    if (count < 1 || ops == NULL) return NULL;
+
+    shard = (ikcp_shard*)calloc(1, sizeof(ikcp_shard));
+    if (shard == NULL) return NULL;
+
+    shard->workers = (ikcp_worker*)calloc(count, sizeof(ikcp_worker));
+    if (shard->workers == NULL) {
+        free(shard);
+        return NULL;
+    }
+
+    shard->ops = *ops;
+    shard->user = user;
+    memcpy(&shard->addr, addr, addrlen);
+    shard->addrlen = addrlen;
+
+    for (i = 0; i < count; i++) {
+        ikcp_worker *worker = &shard->workers[i];
+        int fd;
+
+        worker->shard = shard;
+        worker->index = i;
+        worker->efd = -1;
+        iqueue_init(&worker->sessions);
+        iqueue_init(&worker->dirty);
+        pthread_mutex_init(&worker->lock, NULL);
+        shard->count = i + 1;
+
+        fd = ikcp_shard_socket(shard);
+        if (fd >= 0) {
+            worker->udp = ikcp_udp_create_fd(fd, IKCP_SHARD_BATCH,
+                ikcp_worker_lookup, worker);
+            if (worker->udp == NULL) close(fd);
+        }
+        worker->table = ikcp_table_create(1024);
+        worker->sched = ikcp_sched_create(current);
+        worker->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (worker->udp == NULL || worker->table == NULL ||
+            worker->sched == NULL || worker->efd < 0) {
+            ikcp_shard_release(shard);
+            return NULL;
+        }
+    }
+
+    // without it (old kernel) datagrams are handed over between workers
+    shard->steered = (ikcp_shard_steer(shard,
+        ikcp_udp_fd(shard->workers[0].udp)) == 0);
+
+    return shard;
+}
+
+
+//---------------------------------------------------------------------
+// start / stop
+//---------------------------------------------------------------------
+int ikcp_shard_start(ikcp_shard *shard)
+{
+    int i;
+
+    __atomic_store_n(&shard->quit, 0, __ATOMIC_RELEASE);
+
+    for (i = 0; i < shard->count; i++) {
+        ikcp_worker *worker = &shard->workers[i];
+        if (worker->running) continue;
+        if (pthread_create(&worker->thread, NULL, ikcp_worker_main,
+            worker) != 0) {
+            ikcp_shard_stop(shard);
+            return -1;
+        }
+        worker->running = 1;
+    }
+
+    return 0;
+}
+
+void ikcp_shard_stop(ikcp_shard *shard)
+{
+    IUINT64 one = 1;
+    int i;
+
+    __atomic_store_n(&shard->quit, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < shard->count; i++) {
+        ikcp_worker *worker = &shard->workers[i];
+        if (!worker->running) continue;
+        if (write(worker->efd, &one, sizeof(one)) < 0) {
+            // already signaled
+        }
+        pthread_join(worker->thread, NULL);
+        worker->running = 0;
+    }
+}
+
+void ikcp_shard_release(ikcp_shard *shard)
+{
+    int i;
+
+    if (shard == NULL) return;
+
+    ikcp_shard_stop(shard);
+
+    for (i = 0; i < shard->count; i++) {
+        ikcp_worker *worker = &shard->workers[i];
+        struct IKCPFORWARD *fwd = worker->inbox;
+
+        while (!iqueue_is_empty(&worker->sessions)) {
+            struct IKCPSESSION *session = iqueue_entry(
+                worker->sessions.next, struct IKCPSESSION, node);
+            ikcp_worker_close(worker, session->entry.kcp);
+        }
+        while (fwd) {
+            struct IKCPFORWARD *next = fwd->next;
+            free(fwd);
+            fwd = next;
+        }
+
+        ikcp_udp_release(worker->udp);
+        ikcp_table_release(worker->table);
+        if (worker->sched) ikcp_sched_release(worker->sched);
+        if (worker->efd >= 0) close(worker->efd);
+        pthread_mutex_destroy(&worker->lock);
+    }
+
+    free(shard->workers);
+    free(shard);
+}
+
+
@@ -0,0 +1,111 @@
+//=====================================================================
+//
+// ikcp_shard.h - multi-threaded KCP server runtime
+//
+// Connections are sharded across N worker threads. Each worker owns
+// a UDP socket bound to the same port with SO_REUSEPORT, a session
+// table and a scheduler, so no lock is taken on the data path. A
+// reuseport BPF program steers datagrams by conv, so a conversation
+// always lands on the worker owning it; datagrams which still arrive
+// on another worker (no BPF support, workers joining the group) are
+// handed over to the owner through its queue.
+//
+//=====================================================================
+#ifndef __IKCP_SHARD_H__
+#define __IKCP_SHARD_H__
+
+#include "ikcp_udp.h"
+
+
+//=====================================================================
+// SHARDED RUNTIME
+//=====================================================================
+struct IKCPSHARD;
+struct IKCPWORKER;
+typedef struct IKCPSHARD ikcp_shard;
+typedef struct IKCPWORKER ikcp_worker;
+
+// callbacks, all run on the thread of the worker concerned
+struct IKCPSHARDOPS
+{
+    // worker thread started / about to stop (optional)
+    void (*start)(ikcp_worker *worker, void *user);
+    void (*stop)(ikcp_worker *worker, void *user);
+    // first datagram of an unknown conv owned by this worker: return a
+    // new kcp object to accept the session, NULL to drop the datagram
+    ikcpcb* (*accept)(ikcp_worker *worker, IUINT32 conv,
+        const struct sockaddr *addr, socklen_t addrlen, void *user);
+    // datagrams were input to 'kcp', ikcp_recv what is ready
+    void (*receive)(ikcp_worker *worker, ikcpcb *kcp, void *user);
+    // once per loop iteration, e.g. to ikcp_send more (optional)
+    void (*poll)(ikcp_worker *worker, void *user);
+};
+
+typedef struct IKCPSHARDOPS ikcp_shard_ops;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// create 'count' workers, each with a socket bound to 'addr' (a zero
+// port picks one ephemeral port for all of them). 'ops' is copied.
+// returns NULL for error
+ikcp_shard* ikcp_shard_create(const struct sockaddr *addr,
+    socklen_t addrlen, int count, const ikcp_shard_ops *ops, void *user);
+
+// stop the workers if running, release every session and free all
+void ikcp_shard_release(ikcp_shard *shard);
+
+// run the workers on their own threads, returns below zero for error
+int ikcp_shard_start(ikcp_shard *shard);
+
+// ask the workers to exit and wait for them
+void ikcp_shard_stop(ikcp_shard *shard);
+
+// non-zero when the kernel steers datagrams by conv (reuseport bpf)
+int ikcp_shard_steered(const ikcp_shard *shard);
+
+// number of workers and worker 'index'
+int ikcp_shard_count(const ikcp_shard *shard);
+ikcp_worker* ikcp_shard_worker(ikcp_shard *shard, int index);
+
+// index of the worker owning 'conv', the same the bpf program picks
+int ikcp_shard_of(const ikcp_shard *shard, IUINT32 conv);
+
+// bound address (the port chosen for a zero port)
+int ikcp_shard_address(const ikcp_shard *shard, struct sockaddr *addr,
+    socklen_t *addrlen);
+
+
+//---------------------------------------------------------------------
+// worker side, only from the worker thread (its callbacks)
+//---------------------------------------------------------------------
+
+// index of the worker
+int ikcp_worker_index(const ikcp_worker *worker);
+
+// add a session sending to 'addr', e.g. a client connection. its conv
+// must be owned by this worker. the worker owns the kcp object from
+// now on, kcp->user is replaced (see ikcp_worker_user).
+// returns below zero for error
+int ikcp_worker_attach(ikcp_worker *worker, ikcpcb *kcp,
+    const struct sockaddr *addr, socklen_t addrlen);
+
+// user pointer the kcp object had before it was attached
+void* ikcp_worker_user(ikcpcb *kcp);
+
+// reschedule a session, call after ikcp_send outside 'receive'
+void ikcp_worker_touch(ikcp_worker *worker, ikcpcb *kcp);
+
+// remove a session and ikcp_release it
+void ikcp_worker_close(ikcp_worker *worker, ikcpcb *kcp);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
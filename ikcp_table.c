@@ -0,0 +1,273 @@
+//=====================================================================
+//
+// ikcp_table.c - conv to kcp object table
+//
+//=====================================================================
+#include "ikcp_table.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//=====================================================================
+// SESSION TABLE
+//=====================================================================
+#define IKCP_TABLE_MIN_BITS    4
+#define IKCP_TABLE_STEP        16    // old slots migrated per update
+
+#if defined(__GNUC__) || defined(__clang__)
+#define IKCP_PREFETCH(p) __builtin_prefetch((p), 0, 1)
+#else
+#define IKCP_PREFETCH(p) ((void)(p))
+#endif
+
+// marks a slot of the old array as moved or erased while growing,
+// so probing goes on past it
+static char ikcp_table_moved;
+#define IKCP_TABLE_MOVED ((ikcpcb*)&ikcp_table_moved)
+
+// fibonacci hashing: sequential convs spread over the whole array
+static inline IUINT32 ikcp_table_hash(IUINT32 conv, IUINT32 bits)
+{
+    return (IUINT32)(conv * 2654435769u) >> (32 - bits);
+}
+
+static struct IKCPTABLESLOT* ikcp_table_alloc(IUINT32 bits)
+{
+    return (struct IKCPTABLESLOT*)calloc((size_t)1 << bits,
+        sizeof(struct IKCPTABLESLOT));
+}
+
+ikcp_table* ikcp_table_create(IUINT32 capacity)
+{
+    ikcp_table *table;
+    IUINT32 bits = IKCP_TABLE_MIN_BITS;
+
+    // keep the load under 3/4
+    while (bits < 31 && ((IUINT32)1 << bits) / 4 * 3 < capacity) bits++;
+
+    table = (ikcp_table*)malloc(sizeof(ikcp_table));
+    if (table == NULL) return NULL;
+
+    table->slots = ikcp_table_alloc(bits);
+    if (table->slots == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->bits = bits;
+    table->mask = ((IUINT32)1 << bits) - 1;
+    table->count = 0;
+    table->old = NULL;
+    table->old_mask = 0;
+    table->old_bits = 0;
+    table->old_count = 0;
+    table->migrate = 0;
+    return table;
+}
+
+void ikcp_table_release(ikcp_table *table)
+{
+    if (table) {
+        free(table->old);
+        free(table->slots);
+        free(table);
+    }
+}
+
+IUINT32 ikcp_table_size(const ikcp_table *table)
+{
+    return table->count + table->old_count;
+}
+
+
+//---------------------------------------------------------------------
+// probing
+//---------------------------------------------------------------------
+
+// slot holding 'conv' in the current array, NULL if not found
+static struct IKCPTABLESLOT* ikcp_table_probe(const ikcp_table *table,
+    IUINT32 conv)
+{
+    IUINT32 i = ikcp_table_hash(conv, table->bits);
+    for (;; i = (i + 1) & table->mask) {
+        struct IKCPTABLESLOT *slot = &table->slots[i];
+        if (slot->kcp == NULL) return NULL;
+        if (slot->conv == conv) return slot;
+    }
+}
+
+// same for the old array, where moved slots don't end a probe
+static struct IKCPTABLESLOT* ikcp_table_probe_old(const ikcp_table *table,
+    IUINT32 conv)
+{
+    IUINT32 i = ikcp_table_hash(conv, table->old_bits);
+    for (;; i = (i + 1) & table->old_mask) {
+        struct IKCPTABLESLOT *slot = &table->old[i];
+        if (slot->kcp == NULL) return NULL;
+        if (slot->kcp != IKCP_TABLE_MOVED && slot->conv == conv) return slot;
+    }
+}
+
+// put an absent conv in the current array
+static void ikcp_table_put(ikcp_table *table, IUINT32 conv, ikcpcb *kcp)
+{
+    IUINT32 i = ikcp_table_hash(conv, table->bits);
+    while (table->slots[i].kcp != NULL) i = (i + 1) & table->mask;
+    table->slots[i].conv = conv;
+    table->slots[i].kcp = kcp;
+    table->count++;
+}
+
+// remove a slot of the current array, shifting back the entries after
+// it that would no longer be reachable (no tombstones needed)
+static void ikcp_table_remove(ikcp_table *table, struct IKCPTABLESLOT *slot)
+{
+    IUINT32 hole = (IUINT32)(slot - table->slots);
+    IUINT32 i = hole;
+    for (;;) {
+        IUINT32 home;
+        i = (i + 1) & table->mask;
+        if (table->slots[i].kcp == NULL) break;
+        home = ikcp_table_hash(table->slots[i].conv, table->bits);
+        // entry i may fill the hole if its home isn't in (hole, i]
+        if (((i - home) & table->mask) >= ((i - hole) & table->mask)) {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+    table->slots[hole].kcp = NULL;
+    table->count--;
+}
+
+
+//---------------------------------------------------------------------
+// growing
+//---------------------------------------------------------------------
+static void ikcp_table_migrate(ikcp_table *table, IUINT32 steps)
+{
+    IUINT32 size = table->old_mask + 1;
+    while (table->old && steps-- > 0) {
+        struct IKCPTABLESLOT *slot = &table->old[table->migrate];
+        if (slot->kcp != NULL && slot->kcp != IKCP_TABLE_MOVED) {
+            ikcp_table_put(table, slot->conv, slot->kcp);
+            slot->kcp = IKCP_TABLE_MOVED;
+            table->old_count--;
+        }
+        if (++table->migrate == size) {
+            free(table->old);
+            table->old = NULL;
+            table->old_count = 0;
+        }
+    }
+}
+
+static int ikcp_table_grow(ikcp_table *table)
+{
+    struct IKCPTABLESLOT *slots;
+    IUINT32 bits = table->bits + 1;
+
+    if (bits > 31) return -1;
+
+    // the previous growth must be done before starting another one
+    if (table->old) ikcp_table_migrate(table, table->old_mask + 1);
+
+    slots = ikcp_table_alloc(bits);
+    if (slots == NULL) return -2;
+
+    table->old = table->slots;
+    table->old_bits = table->bits;
+    table->old_mask = table->mask;
+    table->old_count = table->count;
+    table->migrate = 0;
+    table->slots = slots;
+    table->bits = bits;
+    table->mask = ((IUINT32)1 << bits) - 1;
+    table->count = 0;
+    return 0;
+}
+
+
+//---------------------------------------------------------------------
+// interface
+//---------------------------------------------------------------------
+int ikcp_table_insert(ikcp_table *table, IUINT32 conv, ikcpcb *kcp)
+{
+    struct IKCPTABLESLOT *slot;
+
+    if (kcp == NULL) return -1;
+
+    ikcp_table_migrate(table, IKCP_TABLE_STEP);
+
+    slot = ikcp_table_probe(table, conv);
+    if (slot != NULL) {
+        slot->kcp = kcp;
+        return 0;
+    }
+
+    if (table->old) {
+        slot = ikcp_table_probe_old(table, conv);
+        if (slot != NULL) {
+            slot->kcp = IKCP_TABLE_MOVED;
+            table->old_count--;
+        }
+    }
+
+    if (table->count + 1 > (table->mask + 1) / 4 * 3) {
+        int hr = ikcp_table_grow(table);
+        if (hr != 0) return hr;
+    }
+
+    ikcp_table_put(table, conv, kcp);
+    return 0;
+}
+
+ikcpcb* ikcp_table_erase(ikcp_table *table, IUINT32 conv)
+{
+    struct IKCPTABLESLOT *slot;
+    ikcpcb *kcp = NULL;
+
+    ikcp_table_migrate(table, IKCP_TABLE_STEP);
+
+    slot = ikcp_table_probe(table, conv);
+    if (slot != NULL) {
+        kcp = slot->kcp;
+        ikcp_table_remove(table, slot);
+    }
+    else if (table->old) {
+        slot = ikcp_table_probe_old(table, conv);
+        if (slot != NULL) {
+            kcp = slot->kcp;
+            slot->kcp = IKCP_TABLE_MOVED;
+            table->old_count--;
+        }
+    }
+
+    return kcp;
+}
+
+ikcpcb* ikcp_table_find(const ikcp_table *table, IUINT32 conv)
+{
+    struct IKCPTABLESLOT *slot = ikcp_table_probe(table, conv);
+    if (slot == NULL && table->old) {
+        slot = ikcp_table_probe_old(table, conv);
+    }
+    return slot? slot->kcp : NULL;
+}
+
+ikcpcb* ikcp_table_find_packet(const ikcp_table *table, const char *data,
+    long size)
+{
+    if (data == NULL || size < 4) return NULL;
+    return ikcp_table_find(table, ikcp_getconv(data));
+}
+
+void ikcp_table_prefetch(const ikcp_table *table, IUINT32 conv)
+{
+    IKCP_PREFETCH(&table->slots[ikcp_table_hash(conv, table->bits)]);
+    if (table->old) {
+        IKCP_PREFETCH(&table->old[ikcp_table_hash(conv, table->old_bits)]);
+    }
+}
+
+
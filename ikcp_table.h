@@ -0,0 +1,74 @@
+//=====================================================================
+//
+// ikcp_table.h - conv to kcp object table
+//
+// Open addressing (linear probing) hash table for servers holding many
+// sessions. Growing doesn't rehash everything at once: the old slots
+// are moved a few at a time by later inserts and erases.
+//
+//=====================================================================
+#ifndef __IKCP_TABLE_H__
+#define __IKCP_TABLE_H__
+
+#include "ikcp.h"
+
+
+//=====================================================================
+// SESSION TABLE
+//=====================================================================
+struct IKCPTABLESLOT
+{
+    IUINT32 conv;
+    ikcpcb *kcp;    // NULL for an empty slot
+};
+
+struct IKCPTABLE
+{
+    struct IKCPTABLESLOT *slots;
+    IUINT32 mask, bits, count;
+    // previous slots while growing, migrated from index 'migrate' on
+    struct IKCPTABLESLOT *old;
+    IUINT32 old_mask, old_bits, old_count, migrate;
+};
+
+typedef struct IKCPTABLE ikcp_table;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// create a table sized for 'capacity' sessions (it grows past that)
+ikcp_table* ikcp_table_create(IUINT32 capacity);
+
+// free the table, the kcp objects are not released
+void ikcp_table_release(ikcp_table *table);
+
+// add or replace the kcp object of 'conv', returns below zero for error
+int ikcp_table_insert(ikcp_table *table, IUINT32 conv, ikcpcb *kcp);
+
+// remove 'conv', returns its kcp object or NULL if it wasn't there
+ikcpcb* ikcp_table_erase(ikcp_table *table, IUINT32 conv);
+
+// kcp object of 'conv', NULL if not found
+ikcpcb* ikcp_table_find(const ikcp_table *table, IUINT32 conv);
+
+// kcp object a received datagram belongs to (by ikcp_getconv)
+ikcpcb* ikcp_table_find_packet(const ikcp_table *table, const char *data,
+    long size);
+
+// fetch the slot of 'conv' into cache ahead of ikcp_table_find, for
+// batches of datagrams: prefetch all of them, then look them up
+void ikcp_table_prefetch(const ikcp_table *table, IUINT32 conv);
+
+// number of sessions
+IUINT32 ikcp_table_size(const ikcp_table *table);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
@@ -0,0 +1,512 @@
+//=====================================================================
+//
+// ikcp_udp.c - Linux UDP transport for KCP
+//
+//=====================================================================
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE    // recvmmsg, sendmmsg
+#endif
+
+#include "ikcp_udp.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+
+//=====================================================================
+// UDP TRANSPORT
+//=====================================================================
+#define IKCP_UDP_DGRAM    2048    // slot size, kcp mtu must not exceed it
+#define IKCP_UDP_GRO_DGRAM 65536  // receive slot size with gro
+#define IKCP_UDP_GSO_SEGS  64     // datagrams per gso message
+#define IKCP_UDP_GSO_BYTES 65000  // payload per gso message
+#define IKCP_UDP_CMSG      64     // control buffer per message
+
+struct IKCPUDP
+{
+    int fd;
+    int batch;
+    ikcp_udp_lookup lookup;
+    void *user;
+    // receive slots, refilled by each recvmmsg
+    struct mmsghdr *rx_msg;
+    struct iovec *rx_iov;
+    struct sockaddr_storage *rx_addr;
+    char *rx_data;
+    char *rx_cmsg;
+    // queued output of all attached kcp objects
+    struct mmsghdr *tx_msg;
+    struct iovec *tx_iov;
+    struct sockaddr_storage *tx_addr;
+    char *tx_data;
+    int ntx;
+    // offload: queued datagrams packed into gso messages, gso_count[i]
+    // is the number of datagrams in gso_msg[i]
+    struct mmsghdr *gso_msg;
+    char *gso_cmsg;
+    int *gso_count;
+    int gso, gro;
+    // consecutive datagrams of one kcp object, input as a batch
+    ikcpcb *in_kcp;
+    struct iovec in_iov[IKCP_UDP_GSO_SEGS];
+    int nin;
+};
+
+
+static void ikcp_udp_free(ikcp_udp *udp)
+{
+    free(udp->rx_msg);
+    free(udp->rx_iov);
+    free(udp->rx_addr);
+    free(udp->rx_data);
+    free(udp->rx_cmsg);
+    free(udp->tx_msg);
+    free(udp->tx_iov);
+    free(udp->tx_addr);
+    free(udp->tx_data);
+    free(udp->gso_msg);
+    free(udp->gso_cmsg);
+    free(udp->gso_count);
+    free(udp);
+}
+
+ikcp_udp* ikcp_udp_create_fd(int fd, int batch, ikcp_udp_lookup lookup,
+    void *user)
+{
+    ikcp_udp *udp;
+    int flags, i;
+
+    if (fd < 0 || batch < 1 || lookup == NULL) return NULL;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return NULL;
+    }
+
+    udp = (ikcp_udp*)calloc(1, sizeof(ikcp_udp));
+    if (udp == NULL) return NULL;
+
+    udp->fd = fd;
+    udp->batch = batch;
+    udp->lookup = lookup;
+    udp->user = user;
+    udp->rx_msg = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+    udp->rx_iov = (struct iovec*)calloc(batch, sizeof(struct iovec));
+    udp->rx_addr = (struct sockaddr_storage*)calloc(batch,
+        sizeof(struct sockaddr_storage));
+    udp->rx_data = (char*)malloc((size_t)batch * IKCP_UDP_DGRAM);
+    udp->rx_cmsg = (char*)malloc((size_t)batch * IKCP_UDP_CMSG);
+    udp->tx_msg = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+    udp->tx_iov = (struct iovec*)calloc(batch, sizeof(struct iovec));
+    udp->tx_addr = (struct sockaddr_storage*)calloc(batch,
+        sizeof(struct sockaddr_storage));
+    udp->tx_data = (char*)malloc((size_t)batch * IKCP_UDP_DGRAM);
+
+    if (udp->rx_msg == NULL || udp->rx_iov == NULL ||
+        udp->rx_addr == NULL || udp->rx_data == NULL ||
+        udp->rx_cmsg == NULL ||
+        udp->tx_msg == NULL || udp->tx_iov == NULL ||
+        udp->tx_addr == NULL || udp->tx_data == NULL) {
+        ikcp_udp_free(udp);
+        return NULL;
+    }
+
+    for (i = 0; i < batch; i++) {
+        udp->rx_iov[i].iov_base = udp->rx_data + (size_t)i * IKCP_UDP_DGRAM;
+        udp->rx_iov[i].iov_len = IKCP_UDP_DGRAM;
+        udp->rx_msg[i].msg_hdr.msg_name = &udp->rx_addr[i];
+        udp->rx_msg[i].msg_hdr.msg_iov = &udp->rx_iov[i];
+        udp->rx_msg[i].msg_hdr.msg_iovlen = 1;
+        udp->tx_iov[i].iov_base = udp->tx_data + (size_t)i * IKCP_UDP_DGRAM;
+        udp->tx_msg[i].msg_hdr.msg_name = &udp->tx_addr[i];
+        udp->tx_msg[i].msg_hdr.msg_iov = &udp->tx_iov[i];
+        udp->tx_msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return udp;
+}
+
+ikcp_udp* ikcp_udp_create(const struct sockaddr *addr, socklen_t addrlen,
+    int batch, ikcp_udp_lookup lookup, void *user)
+{
+    struct sockaddr_in any;
+    ikcp_udp *udp;
+    int fd;
+
+    if (batch < 1 || lookup == NULL) return NULL;
+
+    if (addr == NULL) {
+        memset(&any, 0, sizeof(any));
+        any.sin_family = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr = (const struct sockaddr*)&any;
+        addrlen = sizeof(any);
+    }
+
+    fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+
+    if (bind(fd, addr, addrlen) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    udp = ikcp_udp_create_fd(fd, batch, lookup, user);
+    if (udp == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    return udp;
+}
+
+void ikcp_udp_release(ikcp_udp *udp)
+{
+    if (udp) {
+        close(udp->fd);
+        ikcp_udp_free(udp);
+    }
+}
+
+int ikcp_udp_fd(const ikcp_udp *udp)
+{
+    return udp->fd;
+}
+
+int ikcp_udp_offload(ikcp_udp *udp, int gso, int gro)
+{
+    int result = 0, zero = 0;
+
+    if (gso && udp->gso_msg == NULL) {
+        // probe: the socket option is there since UDP_SEGMENT is
+        if (setsockopt(udp->fd, SOL_UDP, UDP_SEGMENT, &zero,
+            sizeof(zero)) != 0) {
+            result = -1;
+            gso = 0;
+        }
+        else {
+            udp->gso_msg = (struct mmsghdr*)calloc(udp->batch,
+                sizeof(struct mmsghdr));
+            udp->gso_cmsg = (char*)calloc(udp->batch, IKCP_UDP_CMSG);
+            udp->gso_count = (int*)calloc(udp->batch, sizeof(int));
+            if (udp->gso_msg == NULL || udp->gso_cmsg == NULL ||
+                udp->gso_count == NULL) {
+                free(udp->gso_msg);
+                free(udp->gso_cmsg);
+                free(udp->gso_count);
+                udp->gso_msg = NULL;
+                udp->gso_cmsg = NULL;
+                udp->gso_count = NULL;
+                result = -2;
+                gso = 0;
+            }
+        }
+    }
+    udp->gso = gso? 1 : 0;
+
+    if ((gro? 1 : 0) != udp->gro) {
+        int rxsize = gro? IKCP_UDP_GRO_DGRAM : IKCP_UDP_DGRAM;
+        int value = gro? 1 : 0, i;
+        char *data = (char*)malloc((size_t)udp->batch * rxsize);
+        if (data == NULL) {
+            return -2;
+        }
+        if (setsockopt(udp->fd, SOL_UDP, UDP_GRO, &value,
+            sizeof(value)) != 0) {
+            free(data);
+            return -1;
+        }
+        free(udp->rx_data);
+        udp->rx_data = data;
+        for (i = 0; i < udp->batch; i++) {
+            udp->rx_iov[i].iov_base = data + (size_t)i * rxsize;
+            udp->rx_iov[i].iov_len = rxsize;
+        }
+        udp->gro = value;
+    }
+
+    return result;
+}
+
+
+//---------------------------------------------------------------------
+// output: queue the datagram, write the queue once it is full
+//---------------------------------------------------------------------
+static int ikcp_udp_output(const char *buf, int len, ikcpcb *kcp,
+    void *user)
+{
+    ikcp_udp_peer *peer = (ikcp_udp_peer*)user;
+    ikcp_udp *udp = peer->udp;
+    int i;
+
+    (void)kcp;
+    if (len > IKCP_UDP_DGRAM) return -1;
+
+    if (udp->ntx >= udp->batch) {
+        ikcp_udp_flush(udp);
+        // socket buffer full: drop it, kcp retransmits as for any loss
+        if (udp->ntx >= udp->batch) return -1;
+    }
+
+    i = udp->ntx++;
+    memcpy(udp->tx_iov[i].iov_base, buf, len);
+    udp->tx_iov[i].iov_len = (size_t)len;
+    memcpy(&udp->tx_addr[i], &peer->addr, peer->addrlen);
+    udp->tx_msg[i].msg_hdr.msg_namelen = peer->addrlen;
+
+    return 0;
+}
+
+int ikcp_udp_attach(ikcp_udp *udp, ikcpcb *kcp,
+    const struct sockaddr *addr, socklen_t addrlen)
+{
+    ikcp_udp_peer *peer;
+
+    if (addrlen > sizeof(struct sockaddr_storage)) return -1;
+    if (kcp->mtu > IKCP_UDP_DGRAM) return -1;
+
+    peer = (ikcp_udp_peer*)malloc(sizeof(ikcp_udp_peer));
+    if (peer == NULL) return -2;
+
+    peer->udp = udp;
+    memcpy(&peer->addr, addr, addrlen);
+    peer->addrlen = addrlen;
+    peer->data = kcp->user;
+
+    kcp->user = peer;
+    ikcp_setoutput_batch(kcp, NULL, 0);
+    ikcp_setoutput(kcp, ikcp_udp_output);
+
+    return 0;
+}
+
+void ikcp_udp_detach(ikcpcb *kcp)
+{
+    ikcp_udp_peer *peer = (ikcp_udp_peer*)kcp->user;
+    kcp->user = peer->data;
+    kcp->output = NULL;
+    free(peer);
+}
+
+
+//---------------------------------------------------------------------
+// gso: pack runs of equally sized datagrams to the same peer (the last
+// one may be shorter) into one message, which the kernel segments
+//---------------------------------------------------------------------
+static int ikcp_udp_pack(ikcp_udp *udp, int start)
+{
+    int nmsg = 0, i = start;
+
+    while (i < udp->ntx) {
+        struct msghdr *hdr = &udp->gso_msg[nmsg].msg_hdr;
+        const struct msghdr *first = &udp->tx_msg[i].msg_hdr;
+        size_t size = udp->tx_iov[i].iov_len, total = size;
+        int k = 1;
+
+        while (i + k < udp->ntx && k < IKCP_UDP_GSO_SEGS) {
+            const struct msghdr *next = &udp->tx_msg[i + k].msg_hdr;
+            size_t len = udp->tx_iov[i + k].iov_len;
+            if (len > size || total + len > IKCP_UDP_GSO_BYTES) break;
+            if (next->msg_namelen != first->msg_namelen) break;
+            if (memcmp(next->msg_name, first->msg_name,
+                first->msg_namelen) != 0) break;
+            total += len;
+            k++;
+            if (len < size) break;
+        }
+
+        hdr->msg_name = first->msg_name;
+        hdr->msg_namelen = first->msg_namelen;
+        hdr->msg_iov = &udp->tx_iov[i];
+        hdr->msg_iovlen = k;
+        hdr->msg_flags = 0;
+        if (k > 1) {
+            struct cmsghdr *cm;
+            hdr->msg_control = udp->gso_cmsg + (size_t)nmsg * IKCP_UDP_CMSG;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(IUINT16));
+            cm = CMSG_FIRSTHDR(hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(IUINT16));
+            *(IUINT16*)CMSG_DATA(cm) = (IUINT16)size;
+        }
+        else {
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+        }
+
+        udp->gso_count[nmsg++] = k;
+        i += k;
+    }
+
+    return nmsg;
+}
+
+
+//---------------------------------------------------------------------
+// write queued datagrams
+//---------------------------------------------------------------------
+int ikcp_udp_flush(ikcp_udp *udp)
+{
+    int sent = 0, i;
+
+    while (sent < udp->ntx) {
+        struct mmsghdr *msgs = udp->tx_msg + sent;
+        int nmsg = udp->ntx - sent, hr;
+        if (udp->gso) {
+            msgs = udp->gso_msg;
+            nmsg = ikcp_udp_pack(udp, sent);
+        }
+        hr = sendmmsg(udp->fd, msgs, nmsg, 0);
+        if (hr < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            // the route can't segment (no checksum offload, a path mtu
+            // below the segment size, checksums turned off): stop gso
+            if (udp->gso && udp->gso_count[0] > 1 &&
+                (errno == EIO || errno == EINVAL)) {
+                udp->gso = 0;
+                continue;
+            }
+            // the first datagram can't be sent (unreachable peer, ...)
+            sent += udp->gso? udp->gso_count[0] : 1;
+            continue;
+        }
+        if (udp->gso) {
+            for (i = 0; i < hr; i++) sent += udp->gso_count[i];
+        }
+        else {
+            sent += hr;
+        }
+    }
+
+    // keep what the socket buffer didn't take at the queue head
+    for (i = sent; i < udp->ntx; i++) {
+        int k = i - sent;
+        memcpy(udp->tx_iov[k].iov_base, udp->tx_iov[i].iov_base,
+            udp->tx_iov[i].iov_len);
+        udp->tx_iov[k].iov_len = udp->tx_iov[i].iov_len;
+        udp->tx_addr[k] = udp->tx_addr[i];
+        udp->tx_msg[k].msg_hdr.msg_namelen =
+            udp->tx_msg[i].msg_hdr.msg_namelen;
+    }
+    udp->ntx -= sent;
+
+    return udp->ntx;
+}
+
+
+//---------------------------------------------------------------------
+// read datagrams and dispatch them by conv
+//---------------------------------------------------------------------
+static void ikcp_udp_deliver(ikcp_udp *udp)
+{
+    if (udp->nin > 0) {
+        ikcp_input_batch(udp->in_kcp, udp->in_iov, udp->nin, NULL);
+        udp->nin = 0;
+    }
+}
+
+static int ikcp_udp_dispatch(ikcp_udp *udp, const char *data, int size,
+    const struct msghdr *msg)
+{
+    ikcpcb *kcp;
+    if (size < 4) return 0;
+    kcp = udp->lookup(udp, ikcp_getconv(data), data, size,
+        (const struct sockaddr*)msg->msg_name, msg->msg_namelen, udp->user);
+    if (kcp == NULL) return 0;
+    if (kcp != udp->in_kcp || udp->nin >= IKCP_UDP_GSO_SEGS) {
+        ikcp_udp_deliver(udp);
+        udp->in_kcp = kcp;
+    }
+    udp->in_iov[udp->nin].iov_base = (void*)data;
+    udp->in_iov[udp->nin].iov_len = (size_t)size;
+    udp->nin++;
+    return 1;
+}
+
+// segment size of a gro coalesced receive, 0 for a plain datagram
+static int ikcp_udp_gro_size(struct msghdr *msg)
+{
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            return gso_size;
+        }
+    }
+    return 0;
+}
+
+int ikcp_udp_recv(ikcp_udp *udp, int limit)
+{
+    int count = 0;
+
+    for (;;) {
+        int want = udp->batch, hr, i;
+
+        if (limit > 0 && limit - count < want) want = limit - count;
+        if (want <= 0) break;
+
+        for (i = 0; i < want; i++) {
+            struct msghdr *msg = &udp->rx_msg[i].msg_hdr;
+            msg->msg_namelen = sizeof(struct sockaddr_storage);
+            msg->msg_control = udp->gro?
+                udp->rx_cmsg + (size_t)i * IKCP_UDP_CMSG : NULL;
+            msg->msg_controllen = udp->gro? IKCP_UDP_CMSG : 0;
+        }
+
+        hr = recvmmsg(udp->fd, udp->rx_msg, want, MSG_DONTWAIT, NULL);
+        if (hr < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return (count > 0)? count : -1;
+        }
+
+        for (i = 0; i < hr; i++) {
+            struct msghdr *msg = &udp->rx_msg[i].msg_hdr;
+            const char *data = (const char*)udp->rx_iov[i].iov_base;
+            int size = (int)udp->rx_msg[i].msg_len;
+            int segment = udp->gro? ikcp_udp_gro_size(msg) : 0;
+
+            if (msg->msg_flags & MSG_TRUNC) continue;
+
+            // split a gro receive back into the datagrams it merged
+            if (segment > 0) {
+                for (; size > 0; data += segment, size -= segment) {
+                    int len = (size < segment)? size : segment;
+                    count += ikcp_udp_dispatch(udp, data, len, msg);
+                }
+            }
+            else {
+                count += ikcp_udp_dispatch(udp, data, size, msg);
+            }
+        }
+
+        // before the next recvmmsg reuses the slots
+        ikcp_udp_deliver(udp);
+
+        if (hr < want) break;
+    }
+
+    return count;
+}
+
+
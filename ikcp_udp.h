@@ -0,0 +1,96 @@
+//=====================================================================
+//
+// ikcp_udp.h - Linux UDP transport for KCP
+//
+// One nonblocking UDP socket shared by many kcp objects: datagrams
+// are read with recvmmsg and dispatched by conv, datagrams produced by
+// all kcp objects are queued and written with sendmmsg.
+//
+//=====================================================================
+#ifndef __IKCP_UDP_H__
+#define __IKCP_UDP_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ikcp.h"
+
+
+//=====================================================================
+// UDP TRANSPORT
+//=====================================================================
+struct IKCPUDP;
+typedef struct IKCPUDP ikcp_udp;
+
+// a kcp object attached to a transport: kcp->user points to its peer,
+// the user pointer given to ikcp_udp_attach is kept in 'data'
+struct IKCPUDPPEER
+{
+    ikcp_udp *udp;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    void *data;
+};
+
+typedef struct IKCPUDPPEER ikcp_udp_peer;
+
+// resolve the kcp object of a received datagram, NULL drops it.
+// 'addr' is the sender, so a server can attach new sessions here;
+// 'data' is only valid during the call
+typedef ikcpcb* (*ikcp_udp_lookup)(ikcp_udp *udp, IUINT32 conv,
+    const char *data, int size, const struct sockaddr *addr,
+    socklen_t addrlen, void *user);
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// create a transport bound to 'addr' (NULL for an ephemeral ipv4 port),
+// 'batch' is the number of datagrams per recvmmsg/sendmmsg call
+ikcp_udp* ikcp_udp_create(const struct sockaddr *addr, socklen_t addrlen,
+    int batch, ikcp_udp_lookup lookup, void *user);
+
+// same on a bound socket made by the caller (e.g. with socket options
+// to set before bind), which the transport owns from now on
+ikcp_udp* ikcp_udp_create_fd(int fd, int batch, ikcp_udp_lookup lookup,
+    void *user);
+
+// close the socket and free the transport, queued output is dropped
+void ikcp_udp_release(ikcp_udp *udp);
+
+// socket descriptor, for poll/epoll
+int ikcp_udp_fd(const ikcp_udp *udp);
+
+// segmentation offload: with 'gso', runs of equally sized datagrams to
+// one peer are written as a single UDP_SEGMENT message; with 'gro',
+// coalesced receives (UDP_GRO) are split before ikcp_input. returns
+// below zero when the kernel doesn't support one of them
+int ikcp_udp_offload(ikcp_udp *udp, int gso, int gro);
+
+// send the output of 'kcp' to 'addr' through this transport. kcp->user
+// is replaced by an ikcp_udp_peer keeping the previous value in 'data'.
+// returns below zero for error
+int ikcp_udp_attach(ikcp_udp *udp, ikcpcb *kcp,
+    const struct sockaddr *addr, socklen_t addrlen);
+
+// undo ikcp_udp_attach, restoring kcp->user
+void ikcp_udp_detach(ikcpcb *kcp);
+
+// read available datagrams, at most 'limit' (<= 0 for no limit), and
+// feed them to ikcp_input. returns how many were dispatched, below zero
+// for socket error (errno is set)
+int ikcp_udp_recv(ikcp_udp *udp, int limit);
+
+// write queued datagrams, call after updating the kcp objects. returns
+// how many are still queued (socket buffer full), below zero for error
+int ikcp_udp_flush(ikcp_udp *udp);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
@@ -0,0 +1,562 @@
+//=====================================================================
+//
+// ikcp_uring.c - Linux io_uring transport for KCP
+//
+//=====================================================================
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ikcp_uring.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+
+//=====================================================================
+// IO_URING TRANSPORT
+//=====================================================================
+#define IKCP_URING_DGRAM    2048    // datagram size, kcp mtu must fit
+#define IKCP_URING_BGID     1       // provided buffer group
+#define IKCP_URING_RECV     0       // user_data of the recvmsg request
+#define IKCP_URING_BATCH    64      // datagrams per ikcp_input_batch
+
+// receive buffer: io_uring_recvmsg_out, sender address, payload
+#define IKCP_URING_BUFSIZE  (sizeof(struct io_uring_recvmsg_out) + \
+    sizeof(struct sockaddr_storage) + IKCP_URING_DGRAM)
+
+#define ikcp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ikcp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// a datagram being sent, user_data of its sqe is its index + 1
+struct IKCPURINGSLOT
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    int next;    // free list
+};
+
+struct IKCPURING
+{
+    int fd;      // socket
+    int ring;    // io_uring
+    ikcp_uring_lookup lookup;
+    void *user;
+    // submission queue
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+    unsigned sq_local;    // tail not published to the kernel yet
+    unsigned sq_submit;   // sqes queued since the last io_uring_enter
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    // provided receive buffers
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned nbufs;
+    char *rx_data;
+    struct msghdr rx_msg;
+    int rx_armed;
+    // sequential datagrams of one kcp object, input together
+    ikcpcb *in_kcp;
+    struct iovec in_iov[IKCP_URING_BATCH];
+    unsigned in_bid[IKCP_URING_BATCH];
+    int nin;
+    // send slots
+    struct IKCPURINGSLOT *slots;
+    char *tx_data;
+    int free_slot;
+};
+
+
+static int ikcp_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ikcp_uring_enter(int ring, unsigned submit, unsigned wait,
+    unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ring, submit, wait, flags,
+        arg, argsz);
+}
+
+static int ikcp_uring_register(int ring, unsigned opcode, void *arg,
+    unsigned nargs)
+{
+    return (int)syscall(__NR_io_uring_register, ring, opcode, arg, nargs);
+}
+
+static unsigned ikcp_uring_pow2(unsigned count)
+{
+    unsigned size = 1;
+    while (size < count) size <<= 1;
+    return size;
+}
+
+
+//---------------------------------------------------------------------
+// submission queue
+//---------------------------------------------------------------------
+static int ikcp_uring_submit(ikcp_uring *ur, unsigned wait, unsigned flags,
+    void *arg, size_t argsz)
+{
+    int hr;
+    ikcp_store_release(ur->sq_tail, ur->sq_local);
+    for (;;) {
+        hr = ikcp_uring_enter(ur->ring, ur->sq_submit, wait, flags,
+            arg, argsz);
+        if (hr >= 0) {
+            ur->sq_submit -= ((unsigned)hr < ur->sq_submit)?
+                (unsigned)hr : ur->sq_submit;
+            return hr;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+static struct io_uring_sqe *ikcp_uring_sqe(ikcp_uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = ikcp_load_acquire(ur->sq_head);
+    if (ur->sq_local - head >= ur->sq_entries) {
+        // queue full, hand it to the kernel first
+        ikcp_uring_submit(ur, 0, 0, NULL, 0);
+        head = ikcp_load_acquire(ur->sq_head);
+        if (ur->sq_local - head >= ur->sq_entries) return NULL;
+    }
+    sqe = &ur->sqes[ur->sq_local & ur->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_local++;
+    ur->sq_submit++;
+    return sqe;
+}
+
+// arm the multishot recvmsg, which completes once per datagram
+static int ikcp_uring_arm(ikcp_uring *ur)
+{
+    struct io_uring_sqe *sqe = ikcp_uring_sqe(ur);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ur->fd;
+    sqe->addr = (IUINT64)(size_t)&ur->rx_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IKCP_URING_BGID;
+    sqe->user_data = IKCP_URING_RECV;
+    ur->rx_armed = 1;
+    return 0;
+}
+
+// give receive buffer 'bid' back to the kernel. the entries start
+// at the ring itself: compiled as c++, the header's flexible 'bufs'
+// member is placed after its empty first member instead
+static void ikcp_uring_recycle(ikcp_uring *ur, unsigned bid)
+{
+    unsigned short tail = ur->br->tail;
+    struct io_uring_buf *buf = (struct io_uring_buf*)(void*)ur->br +
+        (tail & (ur->nbufs - 1));
+    buf->addr = (IUINT64)(size_t)(ur->rx_data + IKCP_URING_BUFSIZE * bid);
+    buf->len = (unsigned)IKCP_URING_BUFSIZE;
+    buf->bid = (unsigned short)bid;
+    ikcp_store_release(&ur->br->tail, (unsigned short)(tail + 1));
+}
+
+
+//---------------------------------------------------------------------
+// create / release
+//---------------------------------------------------------------------
+static void ikcp_uring_free(ikcp_uring *ur)
+{
+    if (ur->br) munmap(ur->br, ur->br_size);
+    if (ur->sqes) munmap(ur->sqes, ur->sqes_size);
+    if (ur->cq_map && ur->cq_map != ur->sq_map)
+        munmap(ur->cq_map, ur->cq_map_size);
+    if (ur->sq_map) munmap(ur->sq_map, ur->sq_map_size);
+    if (ur->ring >= 0) close(ur->ring);
+    if (ur->fd >= 0) close(ur->fd);
+    free(ur->rx_data);
+    free(ur->tx_data);
+    free(ur->slots);
+    free(ur);
+}
+
+static int ikcp_uring_map(ikcp_uring *ur, struct io_uring_params *p)
+{
+    char *sq, *cq;
+    unsigned *array, i;
+
+    ur->sq_map_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ur->cq_map_size = p->cq_off.cqes +
+        p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_map_size > ur->sq_map_size)
+            ur->sq_map_size = ur->cq_map_size;
+        ur->cq_map_size = ur->sq_map_size;
+    }
+
+    ur->sq_map = mmap(NULL, ur->sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ur->ring, IORING_OFF_SQ_RING);
+    if (ur->sq_map == MAP_FAILED) {
+        ur->sq_map = NULL;
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_map = ur->sq_map;
+    }
+    else {
+        ur->cq_map = mmap(NULL, ur->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring, IORING_OFF_CQ_RING);
+        if (ur->cq_map == MAP_FAILED) {
+            ur->cq_map = NULL;
+            return -1;
+        }
+    }
+
+    ur->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = (struct io_uring_sqe*)mmap(NULL, ur->sqes_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring,
+        IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        return -1;
+    }
+
+    sq = (char*)ur->sq_map;
+    cq = (char*)ur->cq_map;
+    ur->sq_head = (unsigned*)(sq + p->sq_off.head);
+    ur->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+    ur->sq_mask = *(unsigned*)(sq + p->sq_off.ring_mask);
+    ur->sq_entries = p->sq_entries;
+    ur->sq_local = *ur->sq_tail;
+    ur->cq_head = (unsigned*)(cq + p->cq_off.head);
+    ur->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+    ur->cq_mask = *(unsigned*)(cq + p->cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+
+    // sqe i always sits in slot i
+    array = (unsigned*)(sq + p->sq_off.array);
+    for (i = 0; i < p->sq_entries; i++) array[i] = i;
+
+    return 0;
+}
+
+static int ikcp_uring_bufs(ikcp_uring *ur, unsigned count)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    ur->nbufs = count;
+    ur->br_size = count * sizeof(struct io_uring_buf);
+    ur->br = (struct io_uring_buf_ring*)mmap(NULL, ur->br_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ur->br == MAP_FAILED) {
+        ur->br = NULL;
+        return -1;
+    }
+
+    ur->rx_data = (char*)malloc(IKCP_URING_BUFSIZE * count);
+    if (ur->rx_data == NULL) return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (IUINT64)(size_t)ur->br;
+    reg.ring_entries = count;
+    reg.bgid = IKCP_URING_BGID;
+    if (ikcp_uring_register(ur->ring, IORING_REGISTER_PBUF_RING,
+        &reg, 1) != 0) {
+        return -1;
+    }
+
+    ur->br->tail = 0;
+    for (i = 0; i < count; i++) {
+        ikcp_uring_recycle(ur, i);
+    }
+
+    return 0;
+}
+
+ikcp_uring* ikcp_uring_create(const struct sockaddr *addr,
+    socklen_t addrlen, int depth, ikcp_uring_lookup lookup, void *user)
+{
+    struct io_uring_params params;
+    struct sockaddr_in any;
+    ikcp_uring *ur;
+    unsigned entries;
+    int i;
+
+    if (depth < 1 || depth > 16384 || lookup == NULL) return NULL;
+
+    ur = (ikcp_uring*)calloc(1, sizeof(ikcp_uring));
+    if (ur == NULL) return NULL;
+
+    ur->fd = -1;
+    ur->ring = -1;
+    ur->lookup = lookup;
+    ur->user = user;
+    entries = ikcp_uring_pow2((unsigned)depth);
+
+    if (addr == NULL) {
+        memset(&any, 0, sizeof(any));
+        any.sin_family = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr = (const struct sockaddr*)&any;
+        addrlen = sizeof(any);
+    }
+
+    ur->fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ur->fd < 0 || bind(ur->fd, addr, addrlen) != 0) {
+        ikcp_uring_free(ur);
+        return NULL;
+    }
+
+    // one cqe per received datagram: leave room for bursts
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ur->ring = ikcp_uring_setup(entries, &params);
+    if (ur->ring < 0 || ikcp_uring_map(ur, &params) != 0 ||
+        ikcp_uring_bufs(ur, entries) != 0) {
+        ikcp_uring_free(ur);
+        return NULL;
+    }
+
+    ur->slots = (struct IKCPURINGSLOT*)calloc(entries,
+        sizeof(struct IKCPURINGSLOT));
+    ur->tx_data = (char*)malloc((size_t)entries * IKCP_URING_DGRAM);
+    if (ur->slots == NULL || ur->tx_data == NULL) {
+        ikcp_uring_free(ur);
+        return NULL;
+    }
+
+    for (i = 0; i < (int)entries; i++) {
+        struct IKCPURINGSLOT *slot = &ur->slots[i];
+        slot->iov.iov_base = ur->tx_data + (size_t)i * IKCP_URING_DGRAM;
+        slot->msg.msg_name = &slot->addr;
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+        slot->next = (i + 1 < (int)entries)? i + 1 : -1;
+    }
+    ur->free_slot = 0;
+
+    // the kernel reads namelen/controllen from here for every datagram
+    ur->rx_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    ur->rx_msg.msg_controllen = 0;
+
+    if (ikcp_uring_arm(ur) != 0 || ikcp_uring_submit(ur, 0, 0, NULL, 0) < 0) {
+        ikcp_uring_free(ur);
+        return NULL;
+    }
+
+    return ur;
+}
+
+void ikcp_uring_release(ikcp_uring *uring)
+{
+    if (uring) {
+        ikcp_uring_free(uring);
+    }
+}
+
+int ikcp_uring_fd(const ikcp_uring *uring)
+{
+    return uring->ring;
+}
+
+
+//---------------------------------------------------------------------
+// output: copy into a send slot and queue a sendmsg
+//---------------------------------------------------------------------
+static int ikcp_uring_output(const char *buf, int len, ikcpcb *kcp,
+    void *user)
+{
+    ikcp_uring_peer *peer = (ikcp_uring_peer*)user;
+    ikcp_uring *ur = peer->uring;
+    struct IKCPURINGSLOT *slot;
+    struct io_uring_sqe *sqe;
+    int index = ur->free_slot;
+
+    (void)kcp;
+    // all slots in flight: drop it, kcp retransmits as for any loss
+    if (len > IKCP_URING_DGRAM || index < 0) return -1;
+
+    sqe = ikcp_uring_sqe(ur);
+    if (sqe == NULL) return -1;
+
+    slot = &ur->slots[index];
+    ur->free_slot = slot->next;
+    memcpy(slot->iov.iov_base, buf, len);
+    slot->iov.iov_len = (size_t)len;
+    memcpy(&slot->addr, &peer->addr, peer->addrlen);
+    slot->msg.msg_namelen = peer->addrlen;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = ur->fd;
+    sqe->addr = (IUINT64)(size_t)&slot->msg;
+    sqe->len = 1;
+    sqe->user_data = (IUINT64)index + 1;
+
+    return 0;
+}
+
+int ikcp_uring_attach(ikcp_uring *uring, ikcpcb *kcp,
+    const struct sockaddr *addr, socklen_t addrlen)
+{
+    ikcp_uring_peer *peer;
+
+    if (addrlen > sizeof(struct sockaddr_storage)) return -1;
+    if (kcp->mtu > IKCP_URING_DGRAM) return -1;
+
+    peer = (ikcp_uring_peer*)malloc(sizeof(ikcp_uring_peer));
+    if (peer == NULL) return -2;
+
+    peer->uring = uring;
+    memcpy(&peer->addr, addr, addrlen);
+    peer->addrlen = addrlen;
+    peer->data = kcp->user;
+
+    kcp->user = peer;
+    ikcp_setoutput_batch(kcp, NULL, 0);
+    ikcp_setoutput(kcp, ikcp_uring_output);
+
+    return 0;
+}
+
+void ikcp_uring_detach(ikcpcb *kcp)
+{
+    ikcp_uring_peer *peer = (ikcp_uring_peer*)kcp->user;
+    kcp->user = peer->data;
+    kcp->output = NULL;
+    free(peer);
+}
+
+int ikcp_uring_flush(ikcp_uring *uring)
+{
+    if (uring->sq_submit == 0) return 0;
+    return (ikcp_uring_submit(uring, 0, 0, NULL, 0) < 0)? -1 : 0;
+}
+
+
+//---------------------------------------------------------------------
+// completions
+//---------------------------------------------------------------------
+// input the datagrams gathered so far, then recycle their buffers
+static void ikcp_uring_deliver(ikcp_uring *ur)
+{
+    int i;
+    if (ur->nin > 0) {
+        ikcp_input_batch(ur->in_kcp, ur->in_iov, ur->nin, NULL);
+        for (i = 0; i < ur->nin; i++) {
+            ikcp_uring_recycle(ur, ur->in_bid[i]);
+        }
+        ur->nin = 0;
+    }
+}
+
+static int ikcp_uring_input(ikcp_uring *ur, const struct io_uring_cqe *cqe)
+{
+    const struct io_uring_recvmsg_out *out;
+    const char *buf, *data;
+    unsigned bid;
+    ikcpcb *kcp;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        ur->rx_armed = 0;
+    }
+    if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        return 0;
+    }
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = ur->rx_data + IKCP_URING_BUFSIZE * bid;
+    out = (const struct io_uring_recvmsg_out*)buf;
+    data = buf + sizeof(*out) + ur->rx_msg.msg_namelen +
+        ur->rx_msg.msg_controllen;
+
+    if (out->payloadlen >= 4 && !(out->flags & MSG_TRUNC)) {
+        kcp = ur->lookup(ur, ikcp_getconv(data), data,
+            (int)out->payloadlen, (const struct sockaddr*)(out + 1),
+            out->namelen, ur->user);
+        // the datagram is parsed right in the provided buffer, which
+        // goes back to the kernel once its batch is input
+        if (kcp != NULL) {
+            if (kcp != ur->in_kcp || ur->nin >= IKCP_URING_BATCH) {
+                ikcp_uring_deliver(ur);
+                ur->in_kcp = kcp;
+            }
+            ur->in_iov[ur->nin].iov_base = (void*)data;
+            ur->in_iov[ur->nin].iov_len = (size_t)out->payloadlen;
+            ur->in_bid[ur->nin] = bid;
+            ur->nin++;
+            return 1;
+        }
+    }
+
+    ikcp_uring_recycle(ur, bid);
+    return 0;
+}
+
+int ikcp_uring_run(ikcp_uring *ur, int timeout)
+{
+    unsigned head, tail;
+    int count = 0;
+
+    if (timeout > 0) {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (IUINT64)(size_t)&ts;
+        if (ikcp_uring_submit(ur, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg)) < 0 && errno != ETIME) {
+            return -1;
+        }
+    }
+    else if (ur->sq_submit > 0) {
+        if (ikcp_uring_submit(ur, 0, 0, NULL, 0) < 0) return -1;
+    }
+
+    head = *ur->cq_head;
+    tail = ikcp_load_acquire(ur->cq_tail);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+        if (cqe->user_data == IKCP_URING_RECV) {
+            count += ikcp_uring_input(ur, cqe);
+        }
+        else {
+            // a send completed, its slot can be reused
+            int index = (int)(cqe->user_data - 1);
+            ur->slots[index].next = ur->free_slot;
+            ur->free_slot = index;
+        }
+        ikcp_store_release(ur->cq_head, head + 1);
+    }
+
+    ikcp_uring_deliver(ur);
+
+    // multishot stopped (out of buffers, error): rearm it
+    if (ur->rx_armed == 0) {
+        if (ikcp_uring_arm(ur) != 0) return -1;
+    }
+    if (ur->sq_submit > 0) {
+        if (ikcp_uring_submit(ur, 0, 0, NULL, 0) < 0) return -1;
+    }
+
+    return count;
+}
+
+
@@ -0,0 +1,89 @@
+//=====================================================================
+//
+// ikcp_uring.h - Linux io_uring transport for KCP
+//
+// Like ikcp_udp, one UDP socket serves many kcp objects, but all socket
+// i/o goes through an io_uring: a single multishot recvmsg receives into
+// a ring of kernel provided buffers (fed to ikcp_input in place), and
+// output is queued as sendmsg SQEs submitted in batches. It talks to
+// the kernel directly (no liburing) and needs linux 6.0 or later.
+//
+//=====================================================================
+#ifndef __IKCP_URING_H__
+#define __IKCP_URING_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ikcp.h"
+
+
+//=====================================================================
+// IO_URING TRANSPORT
+//=====================================================================
+struct IKCPURING;
+typedef struct IKCPURING ikcp_uring;
+
+// a kcp object attached to a transport: kcp->user points to its peer,
+// the user pointer given to ikcp_uring_attach is kept in 'data'
+struct IKCPURINGPEER
+{
+    ikcp_uring *uring;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    void *data;
+};
+
+typedef struct IKCPURINGPEER ikcp_uring_peer;
+
+// resolve the kcp object of a received datagram, NULL drops it.
+// 'addr' is the sender, so a server can attach new sessions here;
+// 'data' is only valid during the call
+typedef ikcpcb* (*ikcp_uring_lookup)(ikcp_uring *uring, IUINT32 conv,
+    const char *data, int size, const struct sockaddr *addr,
+    socklen_t addrlen, void *user);
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// create a transport bound to 'addr' (NULL for an ephemeral ipv4 port),
+// 'depth' is the ring size, also the number of receive buffers and of
+// datagrams that can be in flight for sending
+ikcp_uring* ikcp_uring_create(const struct sockaddr *addr,
+    socklen_t addrlen, int depth, ikcp_uring_lookup lookup, void *user);
+
+// close the ring and the socket, free the transport
+void ikcp_uring_release(ikcp_uring *uring);
+
+// ring descriptor, readable (poll/epoll) when completions are pending
+int ikcp_uring_fd(const ikcp_uring *uring);
+
+// send the output of 'kcp' to 'addr' through this transport. kcp->user
+// is replaced by an ikcp_uring_peer keeping the previous value in
+// 'data'. returns below zero for error
+int ikcp_uring_attach(ikcp_uring *uring, ikcpcb *kcp,
+    const struct sockaddr *addr, socklen_t addrlen);
+
+// undo ikcp_uring_attach, restoring kcp->user
+void ikcp_uring_detach(ikcpcb *kcp);
+
+// submit queued sends, call after updating the kcp objects. returns
+// below zero for error
+int ikcp_uring_flush(ikcp_uring *uring);
+
+// submit queued sends, wait up to 'timeout' ms (0: don't wait) for
+// completions and process them: received datagrams are dispatched to
+// ikcp_input_batch, sequential ones of the same kcp object together.
+// returns how many were dispatched, below zero for error
+int ikcp_uring_run(ikcp_uring *uring, int timeout);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
@@ -12,6 +12,27 @@
 
 #include "test.h"
 #include "ikcp.c"
+#include "ikcp_table.c"
+#include "ikcp_sched.c"
+
+#ifdef KCP_TEST_UDP
+#include "ikcp_udp.c"
+#endif
+
+#ifdef KCP_TEST_MAILBOX
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include "ikcp_mailbox.c"
+#endif
+
+#ifdef KCP_TEST_URING
+#include "ikcp_uring.c"
+#endif
+
+#ifdef KCP_TEST_SHARD
+#include "ikcp_shard.c"
+#endif
 
 
 // 模拟网络
@@ -70,6 +91,33 @@ void test(int mode)
         // 普通模式，关闭流控等
         ikcp_nodelay(kcp1, 0, 10, 0, 1);
         ikcp_nodelay(kcp2, 0, 10, 0, 1);
+    }
+    else if (mode == 3) {
+        // bbr mode: fast retransmit, window from the bbr model
+        ikcp_nodelay(kcp1, 1, 10, 2, 0);
+        ikcp_nodelay(kcp2, 1, 10, 2, 0);
+        ikcp_setcc(kcp1, &ikcp_cc_bbr);
+        ikcp_setcc(kcp2, &ikcp_cc_bbr);
+    }
+    else if (mode == 4) {
+        // fast mode with a microsec clock and a 1ms update interval
+        ikcp_usec(kcp1, 1);
+        ikcp_usec(kcp2, 1);
+        ikcp_nodelay(kcp1, 2, 10, 2, 1);
+        ikcp_nodelay(kcp2, 2, 10, 2, 1);
+        ikcp_interval_us(kcp1, 1000);
+        ikcp_interval_us(kcp2, 1000);
+        kcp1->rx_minrto = 10000;
+        kcp1->fastresend = 1;
+    }
+    else if (mode == 5) {
+        // fast mode, sends and acks go out without waiting for update
+        ikcp_nodelay(kcp1, 2, 10, 2, 1);
+        ikcp_nodelay(kcp2, 2, 10, 2, 1);
+        ikcp_immediate(kcp1, 1);
+        ikcp_immediate(kcp2, 1);
+        kcp1->rx_minrto = 10;
+        kcp1->fastresend = 1;
     }    else {
         // 启动快速模式
         // 第二个参数 nodelay用以后若干常规加速将启动
@@ -95,8 +143,15 @@ void test(int mode)
         // 获取当前的毫秒
         current = iclock();
         // 会执行刷新操作
-        ikcp_update(kcp1, iclock());
-        ikcp_update(kcp2, iclock());
+        if (mode == 4) {
+            long s, u;
+            itimeofday(&s, &u);
+            ikcp_update_us(kcp1, (IUINT64)s * 1000000 + u);
+            ikcp_update_us(kcp2, (IUINT64)s * 1000000 + u);
+        }    else {
+            ikcp_update(kcp1, iclock());
+            ikcp_update(kcp2, iclock());
+        }
 
         // 积累了多个20m毫秒的的时间，那么发送多次发送数据
         for (; current >= slap; slap += 20) {
@@ -170,18 +225,2017 @@ void test(int mode)
     ikcp_release(kcp1);
     ikcp_release(kcp2);
 
-    const char *names[3] = { "default", "normal", "fast" };
+    const char *names[6] = {
+        "default", "normal", "fast", "bbr", "usec", "immediate"
+    };
     printf("%s mode result (%dms):\n", names[mode], (int)ts1);
     printf("avgrtt=%d maxrtt=%d tx=%d\n", (int)(sumrtt / count), (int)maxrtt, (int)vnet->tx1);
     printf("press enter to next ...\n");
     char ch; scanf("%c", &ch);
 }
 
-int main()
+//=====================================================================
+// checks: deterministic, on a virtual clock over a vnet without loss
+// or delay. "test check" runs them and returns 1 if any failed
+//=====================================================================
+static IUINT32 check_clock = 1000;
+static int check_failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                #cond); \
+            check_failed++; \
+        } \
+    } while (0)
+
+// datagrams and segments (by cmd) each side sent, sack offers (frg 1)
+// and answers (frg 2), and how many times kcp1 sent each sn
+static int check_dgrams[2];
+static int check_cmds[2][8];
+static int check_sacks[2][4];
+static int check_sent[1024];
+
+// segments for which it returns nonzero are lost
+static int (*check_drop)(int peer, int cmd, IUINT32 sn) = NULL;
+
+static int check_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+    union { int id; void *ptr; } parameter;
+    const char *ptr = buf;
+    char kept[2000];
+    int size = 0;
+    (void)kcp;
+    parameter.ptr = user;
+    check_dgrams[parameter.id]++;
+    while (ptr + IKCP_OVERHEAD <= buf + len) {
+        IUINT8 cmd, frg;
+        IUINT32 sn, n;
+        ikcp_decode8u(ptr + 4, &cmd);
+        ikcp_decode8u(ptr + 5, &frg);
+        ikcp_decode32u(ptr + 12, &sn);
+        ikcp_decode32u(ptr + 20, &n);
+        check_cmds[parameter.id][(cmd - IKCP_CMD_PUSH) & 7]++;
+        if (cmd == IKCP_CMD_SACK) check_sacks[parameter.id][frg & 3]++;
+        if (parameter.id == 0 && cmd == IKCP_CMD_PUSH) {
+            check_sent[sn & 1023]++;
+        }
+        if (check_drop == NULL || !check_drop(parameter.id, cmd, sn)) {
+            memcpy(kept + size, ptr, IKCP_OVERHEAD + n);
+            size += IKCP_OVERHEAD + n;
+        }
+        ptr += IKCP_OVERHEAD + n;
+    }
+    if (size > 0) vnet->send(parameter.id, kept, size);
+    return 0;
+}
+
+// two connected kcp objects in nodelay mode with an interval of 10ms,
+// fast resend after 'resend' skips (0 to disable) and no cwnd
+static void check_begin(ikcpcb **kcp1, ikcpcb **kcp2, int resend)
+{
+    vnet = new LatencySimulator(0, 0, 0);
+    check_drop = NULL;
+    memset(check_dgrams, 0, sizeof(check_dgrams));
+    memset(check_cmds, 0, sizeof(check_cmds));
+    memset(check_sacks, 0, sizeof(check_sacks));
+    memset(check_sent, 0, sizeof(check_sent));
+    *kcp1 = ikcp_create(0x11223344, (void*)0);
+    *kcp2 = ikcp_create(0x11223344, (void*)1);
+    (*kcp1)->output = check_output;
+    (*kcp2)->output = check_output;
+    ikcp_nodelay(*kcp1, 1, 10, resend, 1);
+    ikcp_nodelay(*kcp2, 1, 10, resend, 1);
+}
+
+static void check_end(ikcpcb *kcp1, ikcpcb *kcp2)
+{
+    ikcp_release(kcp1);
+    ikcp_release(kcp2);
+    delete vnet;
+    vnet = NULL;
+}
+
+// hand over everything in flight, both ways
+static void check_deliver(ikcpcb *kcp1, ikcpcb *kcp2)
+{
+    char buffer[2000];
+    int hr;
+    while ((hr = vnet->recv(1, buffer, 2000)) > 0) ikcp_input(kcp2, buffer, hr);
+    while ((hr = vnet->recv(0, buffer, 2000)) > 0) ikcp_input(kcp1, buffer, hr);
+}
+
+// advance the clock 'ms' millisec, updating both sides each one
+static void check_run(ikcpcb *kcp1, ikcpcb *kcp2, int ms)
+{
+    for (; ms > 0; ms--) {
+        check_clock++;
+        ikcp_update(kcp1, check_clock);
+        ikcp_update(kcp2, check_clock);
+        check_deliver(kcp1, kcp2);
+    }
+}
+
+// about one in ten first transmissions from kcp1 is lost
+static int check_drop_tenth(int peer, int cmd, IUINT32 sn)
+{
+    if (peer != 0 || cmd != (int)IKCP_CMD_PUSH) return 0;
+    return (sn * 7) % 10 == 3 && check_sent[sn & 1023] == 1;
+}
+
+// rcv_buf ring: sn wraps around the slots several times with holes,
+// the ring grows with data in it, sn past the window is dropped
+static void check_rcv_ring()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[100];
+    IUINT32 value, next = 0, held = 0;
+    int i, ordered = 1;
+
+    check_begin(&kcp1, &kcp2, 2);
+    ikcp_wndsize(kcp1, 128, 128);
+    ikcp_wndsize(kcp2, 128, 128);
+    CHECK(kcp2->rcv_mask == 127);
+    check_drop = check_drop_tenth;
+    for (value = 0; value < 800; value++) {
+        memcpy(buffer, &value, 4);
+        ikcp_send(kcp1, buffer, 100);
+    }
+    for (i = 0; i < 5000 && next < 800; i++) {
+        check_run(kcp1, kcp2, 1);
+        if (kcp2->nrcv_buf > held) held = kcp2->nrcv_buf;
+        if (next >= 300 && kcp2->rcv_mask == 127 && kcp2->nrcv_buf > 0) {
+            ikcp_wndsize(kcp2, 0, 256);
+        }
+        // the reader stalls for a while to close the window
+        if (next >= 500 && next < 600 && i % 50 != 0) continue;
+        while (ikcp_recv(kcp2, buffer, 100) == 100) {
+            memcpy(&value, buffer, 4);
+            if (value != next) ordered = 0;
+            next++;
+        }
+    }
+    check_run(kcp1, kcp2, 100);
+    CHECK(next == 800 && ordered);
+    CHECK(held > 0);
+    CHECK(kcp2->rcv_mask == 255 && kcp2->rcv_wnd == 256);
+    CHECK(kcp2->nrcv_buf == 0 && kcp1->snd_una == kcp1->snd_nxt);
+
+    // past the window, or a whole ring ahead
+    check_drop = NULL;
+    for (i = 0; i < 2; i++) {
+        IKCPSEG *seg = ikcp_segment_new(kcp2, 0);
+        seg->len = 0;
+        seg->frg = 0;
+        seg->sn = kcp2->rcv_nxt + ((i == 0)? kcp2->rcv_wnd : 1024);
+        ikcp_parse_data(kcp2, seg);
+        CHECK(kcp2->nrcv_buf == 0);
+    }
+    check_end(kcp1, kcp2);
+}
+
+// segment pool: a second burst like the first one is served from the
+// pool alone, trimming returns the surplus
+static void check_pool()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[1400];
+    IUINT32 misses1, misses2;
+    int i, round;
+
+    check_begin(&kcp1, &kcp2, 0);
+    memset(buffer, 0, sizeof(buffer));
+    CHECK(ikcp_setpool(kcp1, -1) == -1);
+    ikcp_setpool(kcp1, 64);
+    ikcp_setpool(kcp2, 64);
+    for (round = 0; round < 2; round++) {
+        misses1 = kcp1->pool_miss;
+        misses2 = kcp2->pool_miss;
+        for (i = 0; i < 20; i++) {
+            ikcp_send(kcp1, buffer, (i & 1)? 100 : (int)kcp1->mss);
+        }
+        check_run(kcp1, kcp2, 100);
+        for (i = 0; i < 20; i++) {
+            CHECK(ikcp_recv(kcp2, buffer, 1400) > 0);
+        }
+        CHECK(kcp1->snd_una == kcp1->snd_nxt);
+        CHECK(kcp1->npool >= 20 && kcp2->npool >= 20);
+    }
+    CHECK(kcp1->pool_miss == misses1 && kcp2->pool_miss == misses2);
+    CHECK(kcp1->pool_hit >= 20 && kcp2->pool_hit >= 20);
+    CHECK(kcp1->npool <= 64 && kcp2->npool <= 64);
+
+    ikcp_setpool(kcp1, 4);
+    CHECK(kcp1->npool == 4);
+    ikcp_setpool(kcp1, 0);
+    CHECK(kcp1->npool == 0);
+    check_end(kcp1, kcp2);
+}
+
+static int check_allocs = 0;
+
+static void* check_alloc(size_t size, void *ctx)
+{
+    (*(int*)ctx)++;
+    return malloc(size);
+}
+
+static void check_dealloc(void *ptr, void *ctx)
+{
+    if (ptr) (*(int*)ctx)--;
+    free(ptr);
+}
+
+// allocator hooks see every block of a connection, the arena caches
+// at most IKCP_ARENA_CACHE bytes per size class
+static void check_allocator()
+{
+    struct IKCPALLOCATOR half = { check_alloc, NULL, &check_allocs };
+    struct IKCPALLOCATOR both = { check_alloc, check_dealloc, &check_allocs };
+    ikcpcb *kcp;
+    char buffer[3000] = { 0 };
+    void *blocks[8];
+    int i;
+
+    CHECK(ikcp_create_ex(1, NULL, &half) == NULL);
+    CHECK(check_allocs == 0);
+
+    kcp = ikcp_create_ex(1, NULL, &both);
+    CHECK(kcp != NULL);
+    ikcp_setpool(kcp, 4);
+    ikcp_send(kcp, buffer, sizeof(buffer));
+    ikcp_update(kcp, check_clock);
+    CHECK(check_allocs > 0);
+    ikcp_release(kcp);
+    CHECK(check_allocs == 0);
+
+    ikcp_arena_trim();
+    for (i = 0; i < 8; i++) blocks[i] = ikcp_arena_malloc(2000, NULL);
+    for (i = 0; i < 8; i++) ikcp_arena_free(blocks[i], NULL);
+    for (i = 0; i < 8; i++) blocks[i] = ikcp_arena_malloc(300000, NULL);
+    for (i = 0; i < 8; i++) ikcp_arena_free(blocks[i], NULL);
+    for (i = 0; i < IKCP_ARENA_CLASSES; i++) {
+        IUINT32 size = 1u << (IKCP_ARENA_MIN + i);
+        CHECK(ikcp_arena_tls.count[i] * size <= IKCP_ARENA_CACHE);
+    }
+    CHECK(ikcp_arena_tls.count[11 - IKCP_ARENA_MIN] == 8);
+    ikcp_arena_trim();
+}
+
+// rto heap: ordered on resendts, seg->timer is the position
+static int check_heap(const ikcpcb *kcp)
+{
+    IUINT32 i;
+    for (i = 0; i < kcp->nrto_heap; i++) {
+        const IKCPSEG *seg = kcp->rto_heap[i];
+        if (seg->timer != i) return 0;
+        if (i > 0 && ikcp_timer_before(seg, kcp->rto_heap[(i - 1) / 2]))
+            return 0;
+    }
+    return 1;
+}
+
+static int check_drop_heap(int peer, int cmd, IUINT32 sn)
+{
+    return peer == 0 && cmd == (int)IKCP_CMD_PUSH && sn != 0 && sn != 4;
+}
+
+// a fast resend within rtomin of the first send moves a segment up
+static void check_rto_heap()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[8] = { 0 };
+    IUINT32 i, first;
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_nodelay(kcp1, 0, 10, 1, 1);
+    ikcp_nodelay(kcp2, 0, 10, 0, 0);
+    check_drop = check_drop_heap;
+
+    ikcp_send(kcp1, buffer, 8);
+    ikcp_send(kcp1, buffer, 8);
+    ikcp_update(kcp1, check_clock);
+    ikcp_update(kcp2, check_clock);
+    check_clock += 20;
+    for (i = 0; i < 4; i++) ikcp_send(kcp1, buffer, 8);
+    ikcp_update(kcp1, check_clock);
+    check_deliver(kcp1, kcp2);
+    ikcp_update(kcp2, check_clock);
+    check_deliver(kcp1, kcp2);
+    check_drop = NULL;
+
+    // acks of s0 and s4 arrived: s1..s3 are fast resent
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    CHECK(check_sent[3] == 2);
+    CHECK(check_heap(kcp1));
+    first = kcp1->rto_heap[0]->resendts;
+    for (i = 0; i < kcp1->nrto_heap; i++) {
+        CHECK(_itimediff(kcp1->rto_heap[i]->resendts, first) >= 0);
+    }
+    CHECK(_itimediff(ikcp_check(kcp1, check_clock), first) <= 0);
+    check_end(kcp1, kcp2);
+}
+
+// snd_buf ring: the window grows while it is full and segments wait in
+// the rto heap, live segments move to their new slots and acks clear
+// every one of them
+static int check_snd_slots(const ikcpcb *kcp)
+{
+    const struct IQUEUEHEAD *p;
+    IUINT32 i, used = 0;
+    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+        const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+        if (kcp->snd_ring[seg->sn & kcp->snd_mask] != seg) return 0;
+    }
+    for (i = 0; i <= kcp->snd_mask; i++) {
+        if (kcp->snd_ring[i] != NULL) used++;
+    }
+    return used == kcp->nsnd_buf;
+}
+
+static void check_snd_ring()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[100];
+    IUINT32 value, next = 0;
+    int i, grown = 0, ordered = 1;
+
+    check_begin(&kcp1, &kcp2, 2);
+    ikcp_wndsize(kcp1, 8, 128);
+    ikcp_wndsize(kcp2, 128, 128);
+    CHECK(kcp1->snd_wnd == 8 && kcp1->snd_mask == 31);
+    check_drop = check_drop_tenth;
+    for (value = 0; value < 400; value++) {
+        memcpy(buffer, &value, 4);
+        ikcp_send(kcp1, buffer, 100);
+    }
+    for (i = 0; i < 5000 && next < 400; i++) {
+        check_run(kcp1, kcp2, 1);
+        if (!grown && kcp1->snd_nxt >= 40 && kcp1->nsnd_buf == 8 &&
+            kcp1->nrto_heap > 0) {
+            CHECK(ikcp_wndsize(kcp1, 100, 0) == 0);
+            CHECK(kcp1->snd_mask == 127 && kcp1->nsnd_buf == 8);
+            CHECK(check_snd_slots(kcp1) && check_heap(kcp1));
+            grown = 1;
+        }
+        if (!check_snd_slots(kcp1)) ordered = 0;
+        while (ikcp_recv(kcp2, buffer, 100) == 100) {
+            memcpy(&value, buffer, 4);
+            if (value != next) ordered = 0;
+            next++;
+        }
+    }
+    check_run(kcp1, kcp2, 100);
+    CHECK(grown && next == 400 && ordered);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt && kcp1->nrto_heap == 0);
+    CHECK(kcp1->nsnd_buf == 0 && check_snd_slots(kcp1));
+    check_end(kcp1, kcp2);
+}
+
+static IUINT32 check_base = 0;
+
+// first transmission of sn base+5..base+8 and base+12 is lost
+static int check_drop_sack(int peer, int cmd, IUINT32 sn)
+{
+    IUINT32 offset = sn - check_base;
+    if (peer != 0 || cmd != (int)IKCP_CMD_PUSH) return 0;
+    if (check_sent[sn & 1023] > 1) return 0;
+    return (offset >= 5 && offset <= 8) || offset == 12;
+}
+
+// the first sack answer (and what follows it in the datagram) is lost
+static int check_drop_answer(int peer, int cmd, IUINT32 sn)
+{
+    (void)sn;
+    if (peer != 1 || cmd != (int)IKCP_CMD_SACK) return 0;
+    return check_sacks[1][IKCP_SACK_ANSWER] == 1;
+}
+
+// sack: negotiated by offer (frg 1) and answer (frg 2), ranges of what
+// rcv_buf holds, only the missing segments are resent
+static void check_sack()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[64];
+    char ranges[64];
+    IUINT32 start, end, i;
+    int count;
+
+    // remote without sack: it never answers, acks stay plain
+    check_begin(&kcp1, &kcp2, 2);
+    ikcp_sack(kcp1, 1);
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 200);
+    CHECK(check_sacks[0][IKCP_SACK_OFFER] > 0);
+    CHECK(check_cmds[1][IKCP_CMD_SACK - IKCP_CMD_PUSH] == 0);
+    CHECK(kcp1->sack_peer == 0);
+    CHECK(ikcp_recv(kcp2, buffer, 64) == 8);
+    check_end(kcp1, kcp2);
+
+    // a lost answer: the next offer is answered again
+    check_begin(&kcp1, &kcp2, 2);
+    ikcp_sack(kcp1, 1);
+    ikcp_sack(kcp2, 1);
+    check_drop = check_drop_answer;
+    for (i = 0; i < 5; i++) {
+        ikcp_send(kcp1, buffer, 8);
+        check_run(kcp1, kcp2, 20);
+    }
+    check_run(kcp1, kcp2, 300);
+    CHECK(check_sacks[1][IKCP_SACK_ANSWER] >= 2);
+    CHECK(kcp1->sack_peer == 1 && kcp1->snd_una == kcp1->snd_nxt);
+    CHECK(kcp2->nrcv_que == 5);
+    check_end(kcp1, kcp2);
+
+    check_begin(&kcp1, &kcp2, 2);
+    ikcp_sack(kcp1, 1);
+    ikcp_sack(kcp2, 1);
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 50);
+    CHECK(check_sacks[0][IKCP_SACK_OFFER] > 0);
+    CHECK(check_sacks[1][IKCP_SACK_ANSWER] > 0);
+    CHECK(kcp1->sack_peer == 1 && kcp2->sack_peer == 1);
+    CHECK(ikcp_recv(kcp2, buffer, 64) == 8);
+
+    // 20 segments in one flush, two holes
+    check_base = kcp1->snd_nxt;
+    check_drop = check_drop_sack;
+    for (i = 0; i < 20; i++) {
+        memcpy(buffer, &i, 4);
+        ikcp_send(kcp1, buffer, 8);
+    }
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    check_deliver(kcp1, kcp2);
+    CHECK(kcp2->rcv_nxt == check_base + 5);
+    count = ikcp_sack_ranges(kcp2, ranges, 8);
+    CHECK(count == 2);
+    ikcp_decode32u(ranges + 0, &start);
+    ikcp_decode32u(ranges + 4, &end);
+    CHECK(start == check_base + 9 && end == check_base + 12);
+    ikcp_decode32u(ranges + 8, &start);
+    ikcp_decode32u(ranges + 12, &end);
+    CHECK(start == check_base + 13 && end == check_base + 20);
+
+    check_run(kcp1, kcp2, 300);
+    CHECK(check_cmds[1][IKCP_CMD_SACK - IKCP_CMD_PUSH] > 0);
+    for (i = 0; i < 20; i++) {
+        IUINT32 sn = check_base + i;
+        int lost = (i >= 5 && i <= 8) || i == 12;
+        IUINT32 value = 0xffffffff;
+        CHECK(check_sent[sn & 1023] == (lost? 2 : 1));
+        CHECK(ikcp_recv(kcp2, buffer, 64) == 8);
+        memcpy(&value, buffer, 4);
+        CHECK(value == i);
+    }
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    check_end(kcp1, kcp2);
+}
+
+// first transmission of sn base is lost
+static int check_drop_base(int peer, int cmd, IUINT32 sn)
+{
+    if (peer != 0 || cmd != (int)IKCP_CMD_PUSH) return 0;
+    return sn == check_base && check_sent[sn & 1023] == 1;
+}
+
+// delayed ack: in order segments are acked once, after the delay or
+// every n of them, out of order ones right away
+static void check_delack()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[64];
+    int acks, i;
+
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_delack(kcp2, 30, 100);
+    acks = check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH];
+
+    // two in order segments 10ms apart, nothing acked before the delay
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 15);
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 10);
+    CHECK(kcp2->nrcv_que == 2);
+    CHECK(kcp2->ackpend == 2);
+    CHECK(check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH] == acks);
+
+    // then one ack covers both
+    check_run(kcp1, kcp2, 40);
+    CHECK(kcp2->ackpend == 0);
+    CHECK(check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH] == acks + 1);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    acks = check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH];
+
+    // a hole: the segment after it is acked on the next flush, within
+    // two intervals, before the delay
+    check_base = kcp1->snd_nxt;
+    check_drop = check_drop_base;
+    ikcp_send(kcp1, buffer, 8);
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 20);
+    CHECK(kcp2->nrcv_buf == 1);
+    CHECK(check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH] > acks);
+    check_run(kcp1, kcp2, 300);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    check_drop = NULL;
+
+    // every 2 in order segments, long before the delay
+    ikcp_delack(kcp2, 1000, 2);
+    acks = check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH];
+    ikcp_send(kcp1, buffer, 8);
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 25);
+    CHECK(kcp2->ackpend == 0);
+    CHECK(check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH] == acks + 1);
+
+    for (i = 0; i < 6; i++) {
+        CHECK(ikcp_recv(kcp2, buffer, 64) == 8);
+    }
+    check_end(kcp1, kcp2);
+}
+
+// first transmission of sn base+2 is lost
+static int check_drop_third(int peer, int cmd, IUINT32 sn)
+{
+    if (peer != 0 || cmd != (int)IKCP_CMD_PUSH) return 0;
+    return sn == check_base + 2 && check_sent[sn & 1023] == 1;
+}
+
+// zero copy recv: iov points at the fragments in rcv_queue until the
+// message is released
+static void check_recv_view()
+{
+    ikcpcb *kcp1, *kcp2;
+    ikcp_iovec iov[4];
+    char buffer[3000];
+    int i, n, size, same;
+
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_recv_view(kcp2, iov, 4) == -1);
+
+    // three fragments, the last one late
+    for (i = 0; i < 3000; i++) buffer[i] = (char)(i & 255);
+    check_base = kcp1->snd_nxt;
+    check_drop = check_drop_third;
+    ikcp_send(kcp1, buffer, 3000);
+    ikcp_send(kcp1, buffer, 100);
+    check_run(kcp1, kcp2, 20);
+    CHECK(kcp2->nrcv_que == 2);
+    CHECK(ikcp_recv_view(kcp2, iov, 4) == -2);
+
+    check_run(kcp1, kcp2, 300);
+    CHECK(ikcp_recv_view(kcp2, iov, 2) == -3);
+    n = ikcp_recv_view(kcp2, iov, 4);
+    CHECK(n == 3);
+    for (i = 0, size = 0, same = 1; i < n; i++) {
+        if (memcmp(iov[i].iov_base, buffer + size, iov[i].iov_len) != 0)
+            same = 0;
+        size += (int)iov[i].iov_len;
+    }
+    CHECK(size == 3000 && same);
+    CHECK((int)iov[0].iov_len == (int)kcp2->mss);
+
+    // a second view sees the same message until it is released
+    CHECK(ikcp_recv_view(kcp2, iov, 4) == 3);
+    CHECK(ikcp_recv_release(kcp2) == 3000);
+    CHECK(ikcp_recv_view(kcp2, iov, 4) == 1);
+    CHECK(iov[0].iov_len == 100);
+    CHECK(memcmp(iov[0].iov_base, buffer, 100) == 0);
+    CHECK(ikcp_recv_release(kcp2) == 100);
+    CHECK(ikcp_recv_view(kcp2, iov, 4) == -1);
+    CHECK(kcp2->nrcv_que == 0);
+    check_end(kcp1, kcp2);
+}
+
+// scatter/gather send: fragments cut across iovec boundaries, stream
+// mode appends to the tail segment
+static void check_sendv()
+{
+    ikcpcb *kcp1, *kcp2;
+    ikcp_iovec iov[4];
+    char source[3600];
+    char buffer[4000];
+    int i, size, hr;
+
+    for (i = 0; i < 3600; i++) source[i] = (char)((i * 7) & 255);
+    iov[0].iov_base = source;
+    iov[0].iov_len = 10;
+    iov[1].iov_base = source + 10;
+    iov[1].iov_len = 0;
+    iov[2].iov_base = source + 10;
+    iov[2].iov_len = 2000;
+    iov[3].iov_base = source + 2010;
+    iov[3].iov_len = 1500;
+
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_sendv(kcp1, iov, -1) == -1);
+    CHECK(ikcp_sendv(kcp1, NULL, 1) == -1);
+    CHECK(ikcp_sendv(kcp1, iov, 4) == 0);
+    CHECK(kcp1->nsnd_que == 3);
+    CHECK(ikcp_sendv(kcp1, iov, 1) == 0);
+    check_run(kcp1, kcp2, 50);
+    CHECK(ikcp_recv(kcp2, buffer, 4000) == 3510);
+    CHECK(memcmp(buffer, source, 3510) == 0);
+    CHECK(ikcp_recv(kcp2, buffer, 4000) == 10);
+    CHECK(memcmp(buffer, source, 10) == 0);
+    check_end(kcp1, kcp2);
+
+    check_begin(&kcp1, &kcp2, 0);
+    kcp1->stream = 1;
+    kcp2->stream = 1;
+    CHECK(ikcp_sendv(kcp1, iov, 1) == 0);
+    CHECK(ikcp_sendv(kcp1, iov + 2, 1) == 0);
+    CHECK(kcp1->nsnd_que == 2);
+    iov[0].iov_base = source + 2010;
+    iov[0].iov_len = 1500;
+    iov[1].iov_base = source + 3510;
+    iov[1].iov_len = 90;
+    CHECK(ikcp_sendv(kcp1, iov, 2) == 0);
+    CHECK(kcp1->nsnd_que == 3);
+    check_run(kcp1, kcp2, 50);
+    for (size = 0; (hr = ikcp_recv(kcp2, buffer + size, 4000 - size)) > 0; )
+        size += hr;
+    CHECK(size == 3600);
+    CHECK(memcmp(buffer, source, 3600) == 0);
+    check_end(kcp1, kcp2);
+}
+
+static void check_unref(const char *buffer, void *arg)
+{
+    (void)buffer;
+    (*(int*)arg)++;
+}
+
+// zero-copy send: release fires once, when the last segment is acked,
+// on error, or when kcp is released with the buffer still referenced
+static void check_send_ref()
+{
+    ikcpcb *kcp1, *kcp2;
+    char source[3000];
+    char buffer[3000];
+    int released = 0, failed = 0, dropped = 0;
+    int i;
+
+    for (i = 0; i < 3000; i++) source[i] = (char)((i * 13) & 255);
+
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_send_ref(kcp1, NULL, 10, check_unref, &failed) == -1);
+    CHECK(failed == 1);
+
+    // three segments, the last one resent from the same buffer
+    check_base = kcp1->snd_nxt;
+    check_drop = check_drop_third;
+    CHECK(ikcp_send_ref(kcp1, source, 3000, check_unref, &released) == 0);
+    check_run(kcp1, kcp2, 20);
+    CHECK(released == 0);
+    check_run(kcp1, kcp2, 300);
+    CHECK(check_sent[(check_base + 2) & 1023] == 2);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    CHECK(released == 1);
+    CHECK(ikcp_recv(kcp2, buffer, 3000) == 3000);
+    CHECK(memcmp(buffer, source, 3000) == 0);
+
+    // never acked
+    check_drop = NULL;
+    CHECK(ikcp_send_ref(kcp1, source, 100, check_unref, &dropped) == 0);
+    check_end(kcp1, kcp2);
+    CHECK(released == 1 && failed == 1 && dropped == 1);
+}
+
+// calls of output_batch, datagrams in them and the largest batch
+static int check_batches[3];
+
+static int check_output_batch(const ikcp_iovec *iov, int count,
+    ikcpcb *kcp, void *user)
+{
+    int i;
+    check_batches[0]++;
+    check_batches[1] += count;
+    if (count > check_batches[2]) check_batches[2] = count;
+    for (i = 0; i < count; i++) {
+        check_output((const char*)iov[i].iov_base, (int)iov[i].iov_len,
+            kcp, user);
+    }
+    return 0;
+}
+
+// batched output: datagrams of one flush handed over maxbatch at once
+static void check_batch()
 {
+    ikcpcb *kcp1, *kcp2;
+    char buffer[1400];
+    int i, hr;
+
+    check_begin(&kcp1, &kcp2, 0);
+    memset(check_batches, 0, sizeof(check_batches));
+    CHECK(ikcp_setoutput_batch(kcp1, check_output_batch, 0) == -1);
+    CHECK(ikcp_setoutput_batch(kcp1, check_output_batch, 4) == 0);
+    kcp1->output = NULL;
+
+    // ten full datagrams in one flush: 4 + 4 + 2
+    for (i = 0; i < 10; i++) {
+        memset(buffer, i, kcp1->mss);
+        ikcp_send(kcp1, buffer, (int)kcp1->mss);
+    }
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    CHECK(check_batches[0] == 3);
+    CHECK(check_batches[1] == 10 && check_batches[2] == 4);
+    CHECK(check_dgrams[0] == 10);
+
+    check_run(kcp1, kcp2, 100);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    for (i = 0; i < 10; i++) {
+        hr = ikcp_recv(kcp2, buffer, 1400);
+        CHECK(hr == (int)kcp1->mss && buffer[0] == i && buffer[hr - 1] == i);
+    }
+
+    // turned off, back to output
+    CHECK(ikcp_setoutput_batch(kcp1, NULL, 0) == 0);
+    kcp1->output = check_output;
+    i = check_batches[0];
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 50);
+    CHECK(check_batches[0] == i);
+    CHECK(ikcp_recv(kcp2, buffer, 1400) == 8);
+    check_end(kcp1, kcp2);
+
+    // mtu shrunk with a full send window: the retransmissions and the
+    // queued segments keep the old mss, each must fit its slot
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_setoutput_batch(kcp1, check_output_batch, 8) == 0);
+    kcp1->output = NULL;
+    for (i = 0; i < (int)kcp1->snd_wnd + 8; i++) {
+        memset(buffer, i, kcp1->mss);
+        ikcp_send(kcp1, buffer, (int)kcp1->mss);
+    }
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    CHECK(kcp1->nsnd_buf == kcp1->snd_wnd && kcp1->nsnd_que == 8);
+    while (vnet->recv(1, buffer, 1400) > 0) {
+        // all lost
+    }
+    CHECK(ikcp_setmtu(kcp1, 200) == 0);
+    CHECK(kcp1->mss == 176 && kcp1->slot == 1400);
+    check_run(kcp1, kcp2, 2000);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    for (i = 0; i < (int)kcp1->snd_wnd + 8; i++) {
+        int k;
+        hr = ikcp_recv(kcp2, buffer, 1400);
+        CHECK(hr == 1376);
+        for (k = 0; k < hr && buffer[k] == (char)i; k++) {
+        }
+        CHECK(k == 1376);
+    }
+    check_end(kcp1, kcp2);
+}
+
+#ifdef KCP_TEST_UDP
+// each transport answers for the one kcp object given as 'user'
+static ikcpcb* check_lookup(ikcp_udp *udp, IUINT32 conv, const char *data,
+    int size, const struct sockaddr *addr, socklen_t addrlen, void *user)
+{
+    ikcpcb *kcp = (ikcpcb*)user;
+    (void)udp;
+    (void)data;
+    (void)size;
+    (void)addr;
+    (void)addrlen;
+    return (kcp->conv == conv)? kcp : NULL;
+}
+
+// a transport bound to an ephemeral loopback port, its address in 'addr'
+static ikcp_udp* check_udp_create(ikcpcb *kcp, struct sockaddr_in *addr)
+{
+    socklen_t addrlen = sizeof(*addr);
+    ikcp_udp *udp;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    udp = ikcp_udp_create((struct sockaddr*)addr, sizeof(*addr), 8,
+        check_lookup, kcp);
+    if (udp == NULL) return NULL;
+    getsockname(ikcp_udp_fd(udp), (struct sockaddr*)addr, &addrlen);
+    return udp;
+}
+
+// run both sides over the transports until kcp2 got 'count' messages
+// of 'size' bytes (message i filled with i) and kcp1 got the acks
+static int check_udp_run(ikcpcb *kcp1, ikcpcb *kcp2, ikcp_udp *udp1,
+    ikcp_udp *udp2, int count, int size)
+{
+    char buffer[2000];
+    int got = 0, i, hr;
+    for (i = 0; i < 300; i++) {
+        if (got == count && kcp1->snd_una == kcp1->snd_nxt) break;
+        check_clock += 10;
+        ikcp_update(kcp1, check_clock);
+        ikcp_update(kcp2, check_clock);
+        ikcp_udp_flush(udp1);
+        ikcp_udp_flush(udp2);
+        ikcp_udp_recv(udp2, 0);
+        ikcp_udp_recv(udp1, 0);
+        while ((hr = ikcp_recv(kcp2, buffer, sizeof(buffer))) > 0) {
+            if (hr != size || buffer[0] != (char)got ||
+                buffer[size - 1] != (char)got) return -1;
+            got++;
+        }
+    }
+    return got;
+}
+
+// udp transport: a loopback round trip, datagrams of another conv are
+// dropped by the lookup
+static void check_udp()
+{
+    struct sockaddr_in addr1, addr2;
+    ikcp_udp *udp1, *udp2;
+    ikcpcb *kcp1, *kcp2;
+    char buffer[1400];
+    int i;
+    int one = 1;
+
+    check_begin(&kcp1, &kcp2, 0);
+    udp1 = check_udp_create(kcp1, &addr1);
+    udp2 = check_udp_create(kcp2, &addr2);
+    CHECK(udp1 != NULL && udp2 != NULL);
+    if (udp1 == NULL || udp2 == NULL) {
+        ikcp_udp_release(udp1);
+        ikcp_udp_release(udp2);
+        check_end(kcp1, kcp2);
+        return;
+    }
+    CHECK(ikcp_udp_attach(udp1, kcp1, (struct sockaddr*)&addr2,
+        sizeof(addr2)) == 0);
+    CHECK(ikcp_udp_attach(udp2, kcp2, (struct sockaddr*)&addr1,
+        sizeof(addr1)) == 0);
+    CHECK(((ikcp_udp_peer*)kcp1->user)->data == (void*)0);
+
+    for (i = 0; i < 20; i++) {
+        memset(buffer, i, 1000);
+        ikcp_send(kcp1, buffer, 1000);
+    }
+    CHECK(check_udp_run(kcp1, kcp2, udp1, udp2, 20, 1000) == 20);
+
+    // offload: full datagrams leave as gso messages of 8 (the batch)
+    // and may come back coalesced by gro
+    if (ikcp_udp_offload(udp1, 1, 1) == 0 &&
+        ikcp_udp_offload(udp2, 1, 1) == 0) {
+        for (i = 0; i < 40; i++) {
+            memset(buffer, i, kcp1->mss);
+            ikcp_send(kcp1, buffer, (int)kcp1->mss);
+        }
+        CHECK(check_udp_run(kcp1, kcp2, udp1, udp2, 40,
+            (int)kcp1->mss) == 40);
+        CHECK(udp1->gso == 1);
+
+        // checksums off: the kernel refuses to segment, plain sendmmsg
+        // takes over without losing the queue
+        setsockopt(ikcp_udp_fd(udp1), SOL_SOCKET, SO_NO_CHECK, &one,
+            sizeof(one));
+        for (i = 0; i < 40; i++) {
+            memset(buffer, i, kcp1->mss);
+            ikcp_send(kcp1, buffer, (int)kcp1->mss);
+        }
+        CHECK(check_udp_run(kcp1, kcp2, udp1, udp2, 40,
+            (int)kcp1->mss) == 40);
+        CHECK(udp1->gso == 0);
+    }
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+
+    // a stranger
+    memset(buffer, 0, IKCP_OVERHEAD);
+    CHECK(sendto(ikcp_udp_fd(udp1), buffer, IKCP_OVERHEAD, 0,
+        (struct sockaddr*)&addr2, sizeof(addr2)) == IKCP_OVERHEAD);
+    CHECK(ikcp_udp_recv(udp2, 0) == 0);
+
+    ikcp_udp_detach(kcp1);
+    ikcp_udp_detach(kcp2);
+    CHECK(kcp1->user == (void*)0 && kcp2->user == (void*)1);
+    ikcp_udp_release(udp1);
+    ikcp_udp_release(udp2);
+    check_end(kcp1, kcp2);
+}
+#endif
+
+#ifdef KCP_TEST_URING
+// io_uring may be missing (ENOSYS) or forbidden (EPERM, eg. seccomp)
+static int check_uring_available()
+{
+    struct io_uring_params params;
+    int ring;
+    memset(&params, 0, sizeof(params));
+    ring = ikcp_uring_setup(1, &params);
+    if (ring >= 0) {
+        close(ring);
+        return 1;
+    }
+    return errno != ENOSYS && errno != EPERM;
+}
+
+static ikcpcb* check_uring_lookup(ikcp_uring *uring, IUINT32 conv,
+    const char *data, int size, const struct sockaddr *addr,
+    socklen_t addrlen, void *user)
+{
+    ikcpcb *kcp = (ikcpcb*)user;
+    (void)uring;
+    (void)data;
+    (void)size;
+    (void)addr;
+    (void)addrlen;
+    return (kcp->conv == conv)? kcp : NULL;
+}
+
+// a transport of 'depth' on an ephemeral loopback port, address in 'addr'
+static ikcp_uring* check_uring_create(ikcpcb *kcp, struct sockaddr_in *addr,
+    int depth)
+{
+    socklen_t addrlen = sizeof(*addr);
+    ikcp_uring *uring;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    uring = ikcp_uring_create((struct sockaddr*)addr, sizeof(*addr), depth,
+        check_uring_lookup, kcp);
+    if (uring == NULL) return NULL;
+    getsockname(uring->fd, (struct sockaddr*)addr, &addrlen);
+    return uring;
+}
+
+// send slots not in flight
+static int check_uring_free(const ikcp_uring *uring)
+{
+    int count = 0, i;
+    for (i = uring->free_slot; i >= 0; i = uring->slots[i].next) count++;
+    return count;
+}
+
+// how many messages of mss bytes (message i filled with i) 'kcp' got
+static int check_uring_recv(ikcpcb *kcp, int got)
+{
+    char buffer[1400];
+    int hr;
+    while ((hr = ikcp_recv(kcp, buffer, sizeof(buffer))) > 0) {
+        if (hr != (int)kcp->mss || buffer[0] != (char)got ||
+            buffer[hr - 1] != (char)got) return -1;
+        got++;
+    }
+    return got;
+}
+
+// io_uring transport: 24 messages each way between a transport of 32
+// and one of 8. the burst to the small one runs out of its provided
+// buffers (the multishot recvmsg stops and is armed again) and its own
+// burst out of send slots (the rest dropped, sent again by kcp)
+static void check_uring()
+{
+    struct sockaddr_in addr1, addr2;
+    ikcp_uring *uring1, *uring2;
+    ikcpcb *kcp1, *kcp2;
+    char buffer[1400];
+    int got1 = 0, got2 = 0, first, i;
+
+    if (!check_uring_available()) {
+        printf("io_uring not available, check_uring skipped\n");
+        return;
+    }
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_wndsize(kcp1, 128, 128);
+    ikcp_wndsize(kcp2, 128, 128);
+    uring1 = check_uring_create(kcp1, &addr1, 32);
+    uring2 = check_uring_create(kcp2, &addr2, 8);
+    CHECK(uring1 != NULL && uring2 != NULL);
+    if (uring1 == NULL || uring2 == NULL) {
+        ikcp_uring_release(uring1);
+        ikcp_uring_release(uring2);
+        check_end(kcp1, kcp2);
+        return;
+    }
+    CHECK(ikcp_uring_attach(uring1, kcp1, (struct sockaddr*)&addr2,
+        sizeof(addr2)) == 0);
+    CHECK(ikcp_uring_attach(uring2, kcp2, (struct sockaddr*)&addr1,
+        sizeof(addr1)) == 0);
+
+    for (i = 0; i < 24; i++) {
+        memset(buffer, i, kcp1->mss);
+        ikcp_send(kcp1, buffer, (int)kcp1->mss);
+        ikcp_send(kcp2, buffer, (int)kcp2->mss);
+    }
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    ikcp_update(kcp2, check_clock);
+    CHECK(check_uring_free(uring1) == 32 - 24);
+    CHECK(check_uring_free(uring2) == 0);
+    CHECK(ikcp_uring_flush(uring1) == 0 && ikcp_uring_flush(uring2) == 0);
+
+    // at most one datagram per provided buffer in a run
+    first = ikcp_uring_run(uring2, 10);
+    CHECK(first > 0 && first <= 8);
+
+    for (i = 0; i < 300; i++) {
+        if (got1 == 24 && got2 == 24 && kcp1->snd_una == kcp1->snd_nxt &&
+            kcp2->snd_una == kcp2->snd_nxt) break;
+        check_clock += 10;
+        ikcp_update(kcp1, check_clock);
+        ikcp_update(kcp2, check_clock);
+        ikcp_uring_flush(uring1);
+        ikcp_uring_flush(uring2);
+        ikcp_uring_run(uring2, 1);
+        ikcp_uring_run(uring1, 1);
+        got1 = check_uring_recv(kcp1, got1);
+        got2 = check_uring_recv(kcp2, got2);
+    }
+    CHECK(got1 == 24 && got2 == 24);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt && kcp2->snd_una == kcp2->snd_nxt);
+
+    // every send completed, its slot back on the free list
+    ikcp_uring_run(uring1, 1);
+    ikcp_uring_run(uring2, 1);
+    CHECK(check_uring_free(uring1) == 32 && check_uring_free(uring2) == 8);
+    CHECK(uring2->rx_armed == 1);
+
+    ikcp_uring_detach(kcp1);
+    ikcp_uring_detach(kcp2);
+    CHECK(kcp1->user == (void*)0 && kcp2->user == (void*)1);
+    ikcp_uring_release(uring1);
+    ikcp_uring_release(uring2);
+    check_end(kcp1, kcp2);
+}
+#endif
+
+#ifdef KCP_TEST_SHARD
+#ifndef SO_DETACH_REUSEPORT_BPF
+#define SO_DETACH_REUSEPORT_BPF 68
+#endif
+
+// worker (index + 1) which accepted conv 100 + i, messages received
+static int check_accepted[4];
+static int check_received[4];
+static int check_client = -1;
+static struct sockaddr_storage check_server;
+static socklen_t check_serverlen;
+
+static ikcpcb* check_accept(ikcp_worker *worker, IUINT32 conv,
+    const struct sockaddr *addr, socklen_t addrlen, void *user)
+{
+    (void)addr;
+    (void)addrlen;
+    (void)user;
+    if (conv - 100 >= 4) return NULL;
+    CHECK(check_accepted[conv - 100] == 0);
+    check_accepted[conv - 100] = ikcp_worker_index(worker) + 1;
+    return ikcp_create(conv, NULL);
+}
+
+static void check_receive(ikcp_worker *worker, ikcpcb *kcp, void *user)
+{
+    char buffer[64];
+    (void)worker;
+    (void)user;
+    while (ikcp_recv(kcp, buffer, sizeof(buffer)) > 0) {
+        check_received[kcp->conv - 100]++;
+    }
+}
+
+static int check_client_output(const char *buf, int len, ikcpcb *kcp,
+    void *user)
+{
+    (void)kcp;
+    (void)user;
+    return (int)sendto(check_client, buf, len, 0,
+        (struct sockaddr*)&check_server, check_serverlen);
+}
+
+// one pass over the workers on this thread: read their sockets, then
+// input what they handed over and let the user receive. returns how
+// many datagrams were handed over
+static int check_shard_pass(ikcp_shard *shard)
+{
+    int forwarded = 0, i;
+    for (i = 0; i < shard->count; i++) {
+        ikcp_udp_recv(shard->workers[i].udp, 0);
+    }
+    for (i = 0; i < shard->count; i++) {
+        ikcp_worker *worker = &shard->workers[i];
+        forwarded += worker->ninbox;
+        ikcp_worker_drain(worker);
+        ikcp_worker_settle(worker);
+    }
+    return forwarded;
+}
+
+// conv 100..103 from one client socket to 2 workers. steered, each
+// datagram is read by the worker owning its conv. not steered, the
+// reuseport hash puts all of them on one worker, which hands the two
+// of the other worker over: accepted there, input there after that
+static void check_shard_run(int steer)
+{
+    struct sockaddr_in addr;
+    ikcp_shard_ops ops;
+    ikcp_shard *shard;
+    ikcpcb *kcp[4];
+    int none = 0, i, round;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.accept = check_accept;
+    ops.receive = check_receive;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    shard = ikcp_shard_create((struct sockaddr*)&addr, sizeof(addr), 2,
+        &ops, NULL);
+    CHECK(shard != NULL);
+    if (shard == NULL) return;
+    if (!steer && setsockopt(ikcp_udp_fd(shard->workers[0].udp),
+        SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &none, sizeof(none)) == 0) {
+        shard->steered = 0;
+    }
+    // no reuseport bpf here, either way
+    if (shard->steered != steer) {
+        ikcp_shard_release(shard);
+        return;
+    }
+
+    check_serverlen = sizeof(check_server);
+    ikcp_shard_address(shard, (struct sockaddr*)&check_server,
+        &check_serverlen);
+    check_client = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(check_accepted, 0, sizeof(check_accepted));
+    memset(check_received, 0, sizeof(check_received));
+    for (i = 0; i < 4; i++) {
+        kcp[i] = ikcp_create(100 + i, NULL);
+        kcp[i]->output = check_client_output;
+        ikcp_nodelay(kcp[i], 1, 10, 0, 1);
+    }
+
+    for (round = 0; round < 2; round++) {
+        check_clock += 10;
+        for (i = 0; i < 4; i++) {
+            ikcp_send(kcp[i], "message", 8);
+            ikcp_update(kcp[i], check_clock);
+        }
+        CHECK(check_shard_pass(shard) == (steer? 0 : 2));
+    }
+    for (i = 0; i < 4; i++) {
+        CHECK(check_accepted[i] == ikcp_shard_of(shard, 100 + i) + 1);
+        CHECK(check_received[i] == 2);
+        ikcp_release(kcp[i]);
+    }
+
+    close(check_client);
+    ikcp_shard_release(shard);
+}
+
+static void check_shard()
+{
+    check_shard_run(1);
+    check_shard_run(0);
+}
+#endif
+
+// buffers acquired and committed, the size last asked for and commits
+// longer than that
+static char check_slot[2000];
+static int check_acquired = 0;
+static int check_committed = 0;
+static int check_asked = 0;
+static int check_overrun = 0;
+
+static char *check_acquire(int size, ikcpcb *kcp, void *user)
+{
+    (void)kcp;
+    (void)user;
+    check_acquired++;
+    check_asked = size;
+    return (size <= (int)sizeof(check_slot))? check_slot : NULL;
+}
+
+static int check_commit(char *buf, int len, ikcpcb *kcp, void *user)
+{
+    check_committed++;
+    if (len > check_asked) check_overrun++;
+    return check_output(buf, len, kcp, user);
+}
+
+// output buffer provider: idle flushes don't acquire, every acquired
+// buffer is committed once
+static void check_provider()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[4000];
+    int i;
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_setoutput_buffer(kcp1, check_acquire, check_commit);
+    check_run(kcp1, kcp2, 100);
+    CHECK(check_acquired == 0);
+
+    for (i = 0; i < (int)sizeof(buffer); i++) buffer[i] = (char)i;
+    ikcp_send(kcp1, buffer, sizeof(buffer));
+    check_run(kcp1, kcp2, 100);
+    CHECK(check_acquired > 0);
+    CHECK(check_acquired == check_committed);
+    memset(buffer, 0, sizeof(buffer));
+    CHECK(ikcp_recv(kcp2, buffer, sizeof(buffer)) == (int)sizeof(buffer));
+    for (i = 0; i < (int)sizeof(buffer); i++) {
+        if (buffer[i] != (char)i) break;
+    }
+    CHECK(i == (int)sizeof(buffer));
+
+    // acked: nothing left to send
+    i = check_acquired;
+    check_run(kcp1, kcp2, 100);
+    CHECK(check_acquired == i);
+
+    // mtu lowered with segments of the old mss queued: asked for room
+    // for one of them, not the new mtu
+    for (i = 0; i < (int)sizeof(buffer); i++) buffer[i] = (char)i;
+    ikcp_send(kcp1, buffer, sizeof(buffer));
+    CHECK(ikcp_setmtu(kcp1, 200) == 0);
+    check_run(kcp1, kcp2, 100);
+    CHECK(check_asked == 1400 && check_overrun == 0);
+    CHECK(check_acquired == check_committed);
+    memset(buffer, 0, sizeof(buffer));
+    CHECK(ikcp_recv(kcp2, buffer, sizeof(buffer)) == (int)sizeof(buffer));
+    for (i = 0; i < (int)sizeof(buffer); i++) {
+        if (buffer[i] != (char)i) break;
+    }
+    CHECK(i == (int)sizeof(buffer));
+    check_end(kcp1, kcp2);
+}
+
+// batched input: each datagram gets what ikcp_input would return, the
+// good ones are accepted whatever their order in the batch, the acks
+// of bad ones don't count towards fast retransmit
+static void check_input_batch()
+{
+    ikcpcb *kcp1, *kcp2;
+    static char dgrams[6][1400];
+    char shortened[10];
+    char stranger[1400];
+    char buffer[1400];
+    ikcp_iovec iov[9];
+    int status[9];
+    int sizes[6];
+    int i, order[9] = { 0, -1, 5, -2, -3, 1, 3, 2, 4 };
+
+    check_begin(&kcp1, &kcp2, 0);
+    for (i = 0; i < 6; i++) {
+        memset(buffer, i, kcp1->mss);
+        ikcp_send(kcp1, buffer, (int)kcp1->mss);
+    }
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    for (i = 0; i < 6; i++) {
+        sizes[i] = vnet->recv(1, dgrams[i], 1400);
+        CHECK(sizes[i] > 0);
+    }
+
+    // too short, another conv, and a payload cut off
+    memcpy(shortened, dgrams[0], 10);
+    memcpy(stranger, dgrams[1], sizes[1]);
+    stranger[0] ^= 1;
+    for (i = 0; i < 9; i++) {
+        int k = order[i];
+        iov[i].iov_base = (k >= 0)? dgrams[k] :
+            (k == -1)? shortened : (k == -2)? stranger : dgrams[2];
+        iov[i].iov_len = (k >= 0)? sizes[k] : (k == -1)? 10 :
+            (k == -2)? sizes[1] : sizes[2] - 1;
+    }
+    CHECK(ikcp_input_batch(kcp2, iov, 9, status) == 6);
+    CHECK(status[0] == 0 && status[1] == -1 && status[2] == 0);
+    CHECK(status[3] == -1 && status[4] == -2);
+    CHECK(status[5] == 0 && status[6] == 0 && status[7] == 0);
+    CHECK(status[8] == 0);
+    CHECK(kcp2->rcv_nxt == kcp1->snd_nxt && kcp2->nrcv_que == 6);
+
+    check_run(kcp1, kcp2, 50);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    for (i = 0; i < 6; i++) {
+        CHECK(check_sent[(kcp1->snd_una - 6 + i) & 1023] == 1);
+        CHECK(ikcp_recv(kcp2, buffer, 1400) == (int)kcp1->mss);
+        CHECK(buffer[0] == i);
+    }
+    CHECK(ikcp_input_batch(kcp2, iov, 0, NULL) == 0);
+    check_end(kcp1, kcp2);
+
+    // acks of sn base+1..base+3 followed by an unknown command
+    check_begin(&kcp1, &kcp2, 1);
+    check_base = kcp1->snd_nxt;
+    check_drop = check_drop_base;
+    for (i = 0; i < 4; i++) ikcp_send(kcp1, buffer, 8);
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    check_deliver(kcp1, kcp2);
+    check_clock += 10;
+    ikcp_update(kcp2, check_clock);
+    sizes[0] = vnet->recv(0, dgrams[0], 1400);
+    CHECK(sizes[0] == (int)IKCP_OVERHEAD * 3);
+    memcpy(dgrams[1], dgrams[0], sizes[0]);
+    memcpy(dgrams[1] + sizes[0], dgrams[0], IKCP_OVERHEAD);
+    dgrams[1][sizes[0] + 4] = 99;
+    iov[0].iov_base = dgrams[1];
+    iov[0].iov_len = sizes[0] + IKCP_OVERHEAD;
+    CHECK(ikcp_input_batch(kcp1, iov, 1, status) == 0 && status[0] == -3);
+    CHECK(kcp1->nsnd_buf == 1);
+    CHECK(iqueue_entry(kcp1->snd_buf.next, IKCPSEG, node)->fastack == 0);
+    // the good one does
+    iov[0].iov_base = dgrams[0];
+    iov[0].iov_len = sizes[0];
+    CHECK(ikcp_input_batch(kcp1, iov, 1, status) == 1 && status[0] == 0);
+    CHECK(iqueue_entry(kcp1->snd_buf.next, IKCPSEG, node)->fastack == 1);
+    check_run(kcp1, kcp2, 50);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt && kcp2->nrcv_que == 4);
+    check_end(kcp1, kcp2);
+}
+
+// session table: every conv stays reachable while the old slots are
+// migrated, erased slots don't hide the ones probed past them
+static void check_table()
+{
+    static char objs[600];
+    ikcp_table *table = ikcp_table_create(8);
+    char packet[IKCP_OVERHEAD];
+    IUINT32 i, grown = 0, erased = 0;
+    int found = 1;
+
+    CHECK(table != NULL && ikcp_table_size(table) == 0);
+    for (i = 0; i < 600; i++) {
+        CHECK(ikcp_table_insert(table, i * 7 + 1, (ikcpcb*)&objs[i]) == 0);
+        if (table->old != NULL) {
+            IUINT32 k;
+            grown++;
+            for (k = 0; k <= i; k++) {
+                if (ikcp_table_find(table, k * 7 + 1) != (ikcpcb*)&objs[k])
+                    found = 0;
+            }
+        }
+    }
+    CHECK(grown > 0 && found);
+    CHECK(ikcp_table_size(table) == 600);
+    CHECK(ikcp_table_insert(table, 1, NULL) < 0);
+
+    // replacing keeps the count
+    CHECK(ikcp_table_insert(table, 8, (ikcpcb*)&objs[0]) == 0);
+    CHECK(ikcp_table_find(table, 8) == (ikcpcb*)&objs[0]);
+    CHECK(ikcp_table_insert(table, 8, (ikcpcb*)&objs[1]) == 0);
+    CHECK(ikcp_table_size(table) == 600);
+
+    // grow once more, then erase while the old slots are still there
+    for (i = 600; table->old == NULL; i++) {
+        CHECK(ikcp_table_insert(table, i * 7 + 1, (ikcpcb*)&objs[0]) == 0);
+    }
+    for (i = 0; i < 600; i += 2) {
+        if (table->old != NULL) erased++;
+        if (ikcp_table_erase(table, i * 7 + 1) != (ikcpcb*)&objs[i])
+            found = 0;
+    }
+    CHECK(erased > 0 && found);
+    for (i = 0; i < 600; i++) {
+        ikcpcb *kcp = ikcp_table_find(table, i * 7 + 1);
+        if (kcp != ((i & 1)? (ikcpcb*)&objs[i] : NULL)) found = 0;
+    }
+    CHECK(found);
+    CHECK(ikcp_table_erase(table, 1) == NULL);
+
+    ikcp_encode32u(packet, 3 * 7 + 1);
+    CHECK(ikcp_table_find_packet(table, packet, IKCP_OVERHEAD) ==
+        (ikcpcb*)&objs[3]);
+    CHECK(ikcp_table_find_packet(table, packet, 3) == NULL);
+    ikcp_table_release(table);
+}
+
+static int check_discard(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+    (void)buf;
+    (void)len;
+    (void)kcp;
+    (void)user;
+    return 0;
+}
+
+// timer wheel: each connection is updated exactly when ikcp_check says,
+// including deadlines held by the higher levels and across a stall of
+// an hour, and idle ones are parked until touched
+static void check_sched()
+{
+    static const IUINT32 intervals[3] = { 10, 300, 5000 };
+    ikcpcb *kcps[4];
+    ikcp_sched_entry entries[4];
+    IUINT32 last[4], updates[4] = { 0, 0, 0, 0 };
+    IUINT32 t0 = check_clock, t, now = t0;
+    ikcp_sched *sched = ikcp_sched_create(t0);
+    int i, ordered = 1, stalled = 0;
+
+    CHECK(sched != NULL);
+    for (i = 0; i < 4; i++) {
+        kcps[i] = ikcp_create(0x33, NULL);
+        kcps[i]->output = check_discard;
+        // a zero remote window keeps them probing: never idle
+        if (i < 3) {
+            ikcp_interval(kcps[i], (int)intervals[i]);
+            kcps[i]->rmt_wnd = 0;
+        }
+        ikcp_sched_add(sched, &entries[i], kcps[i]);
+        last[i] = t0 - 1;
+    }
+    CHECK(sched->count == 4 && ikcp_sched_next(sched) == t0);
+
+    for (t = t0; t < t0 + 18000; t++) {
+        int count, n = 0;
+        now = (t < t0 + 12000)? t : t + 3600000;
+        count = ikcp_sched_run(sched, now);
+        if (t == t0 + 12000) stalled = count;
+        for (i = 0; i < 4; i++) {
+            if (kcps[i]->current != now || last[i] == now) continue;
+            // due at the deadline ikcp_check gave after the last update
+            if (i < 3 && updates[i] > 0 && t != t0 + 12000 &&
+                now - last[i] != intervals[i])
+                ordered = 0;
+            last[i] = now;
+            updates[i]++;
+            n++;
+        }
+        if (n != count) ordered = 0;
+        if (t == t0 + 100) {
+            // the idle one is parked, sending wakes it up
+            CHECK(updates[3] == 1);
+            ikcp_send(kcps[3], "x", 1);
+            ikcp_sched_touch(sched, &entries[3], now);
+            CHECK(ikcp_sched_next(sched) == t + 1);
+        }
+    }
+    CHECK(ordered && stalled == 4);
+    CHECK(updates[0] == 1800 && updates[1] == 60 && updates[2] == 5);
+    CHECK(updates[3] > 2);
+
+    for (i = 0; i < 4; i++) {
+        ikcp_sched_remove(sched, &entries[i]);
+        ikcp_release(kcps[i]);
+    }
+    CHECK(sched->count == 0);
+    CHECK(ikcp_sched_run(sched, now + 10000) == 0);
+    ikcp_sched_release(sched);
+}
+
+#ifdef KCP_TEST_MAILBOX
+#define CHECK_PRODUCERS 3
+#define CHECK_MESSAGES 20000
+
+// set when the reader got everything, or to give up
+static int check_finished = 0;
+static int check_stop = 0;
+
+struct CHECKBOX
+{
+    ikcp_mailbox *mailbox;
+    int id;
+    int count;
+    int bad;
+};
+
+// producer 'id' posts message i as { id, i, id * 7 + i + k... }
+static void *check_producer(void *arg)
+{
+    struct CHECKBOX *box = (struct CHECKBOX*)arg;
+    IUINT32 msg[64];
+    int i, k, len;
+    for (i = 0; i < CHECK_MESSAGES; ) {
+        if (__atomic_load_n(&check_stop, __ATOMIC_ACQUIRE)) break;
+        len = 8 + (i % 50) * 4;
+        msg[0] = (IUINT32)box->id;
+        msg[1] = (IUINT32)i;
+        for (k = 2; k < len / 4; k++) msg[k] = box->id * 7 + i + k;
+        if (ikcp_mailbox_send(box->mailbox, (char*)msg, len) == 0) i++;
+        else sched_yield();
+    }
+    return NULL;
+}
+
+// the reader checks order and content per producer
+static void *check_consumer(void *arg)
+{
+    struct CHECKBOX *box = (struct CHECKBOX*)arg;
+    int last[CHECK_PRODUCERS];
+    IUINT32 msg[64];
+    IUINT64 value;
+    struct pollfd pfd;
+    int hr, k;
+    for (k = 0; k < CHECK_PRODUCERS; k++) last[k] = -1;
+    pfd.fd = ikcp_mailbox_recv_fd(box->mailbox);
+    pfd.events = POLLIN;
+    while (box->count < CHECK_PRODUCERS * CHECK_MESSAGES) {
+        if (__atomic_load_n(&check_stop, __ATOMIC_ACQUIRE)) break;
+        poll(&pfd, 1, 10);
+        if (read(pfd.fd, &value, sizeof(value)) < 0) {
+            // nothing signalled, recv anyway
+        }
+        while ((hr = ikcp_mailbox_recv(box->mailbox, (char*)msg,
+            sizeof(msg))) >= 0) {
+            int p = (int)msg[0], i = (int)msg[1];
+            if (p < 0 || p >= CHECK_PRODUCERS) {
+                box->bad++;
+                continue;
+            }
+            if (i != last[p] + 1 || hr != 8 + (i % 50) * 4) box->bad++;
+            for (k = 2; k < hr / 4; k++) {
+                if (msg[k] != (IUINT32)(p * 7 + i + k)) box->bad++;
+            }
+            last[p] = i;
+            box->count++;
+        }
+    }
+    __atomic_store_n(&check_finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// mailbox: capacity, sizes, then producers posting to kcp1 from their
+// own threads and a reader taking from kcp2 in another one
+static void check_mailbox()
+{
+    ikcpcb *kcp1, *kcp2;
+    ikcp_mailbox *mailbox1, *mailbox2;
+    struct CHECKBOX boxes[CHECK_PRODUCERS + 1];
+    pthread_t threads[CHECK_PRODUCERS + 1];
+    struct pollfd pfds[2];
+    char buffer[64];
+    IUINT64 value;
+    IUINT32 start;
+    int i;
+
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_mailbox_create(kcp1, 0) == NULL);
+    mailbox1 = ikcp_mailbox_create(kcp1, 3);
+    mailbox2 = ikcp_mailbox_create(kcp2, 2);
+    CHECK(mailbox1 != NULL && mailbox2 != NULL);
+    for (i = 0; i < 4; i++) {
+        memset(buffer, i, 64);
+        CHECK(ikcp_mailbox_send(mailbox1, buffer, 10 + i) == 0);
+    }
+    CHECK(ikcp_mailbox_send(mailbox1, buffer, 10) == -2);
+    CHECK(ikcp_mailbox_send(mailbox1, NULL, 10) == -1);
+    CHECK(ikcp_mailbox_recv(mailbox2, buffer, 64) == -1);
+    check_run(kcp1, kcp2, 50);
+
+    // two fit in the ring, the rest waits in kcp2
+    CHECK(kcp2->nrcv_que == 2);
+    CHECK(ikcp_mailbox_peeksize(mailbox2) == 10);
+    CHECK(ikcp_mailbox_recv(mailbox2, buffer, 9) == -2);
+    for (i = 0; i < 4; i++) {
+        if (i == 2) check_run(kcp1, kcp2, 1);
+        CHECK(ikcp_mailbox_recv(mailbox2, buffer, 64) == 10 + i);
+        CHECK(buffer[0] == i && buffer[9 + i] == i);
+    }
+    CHECK(ikcp_mailbox_peeksize(mailbox2) == -1);
+    ikcp_mailbox_release(mailbox1);
+    ikcp_mailbox_release(mailbox2);
+    check_end(kcp1, kcp2);
+
+    // immediate mode pumps: posted messages leave with the next send
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_immediate(kcp1, 1);
+    check_run(kcp1, kcp2, 1);
+    mailbox1 = ikcp_mailbox_create(kcp1, 4);
+    CHECK(ikcp_mailbox_send(mailbox1, buffer, 10) == 0);
+    CHECK(ikcp_mailbox_send(mailbox1, buffer, 11) == 0);
+    i = check_dgrams[0];
+    CHECK(ikcp_send(kcp1, buffer, 5) == 0);
+    CHECK(check_dgrams[0] == i + 1 && check_cmds[0][0] == 3);
+    check_deliver(kcp1, kcp2);
+    CHECK(ikcp_recv(kcp2, buffer, 64) == 5);
+    CHECK(ikcp_recv(kcp2, buffer, 64) == 10);
+    CHECK(ikcp_recv(kcp2, buffer, 64) == 11);
+    // pumped directly, each ikcp_send flushes on its own
+    CHECK(ikcp_mailbox_send(mailbox1, buffer, 12) == 0);
+    CHECK(ikcp_mailbox_send(mailbox1, buffer, 13) == 0);
+    i = check_dgrams[0];
+    CHECK(ikcp_mailbox_pump(mailbox1) == 2);
+    CHECK(check_dgrams[0] == i + 2 && check_cmds[0][0] == 5);
+    ikcp_mailbox_release(mailbox1);
+    check_end(kcp1, kcp2);
+
+    check_begin(&kcp1, &kcp2, 2);
+    ikcp_wndsize(kcp1, 128, 128);
+    ikcp_wndsize(kcp2, 128, 128);
+    mailbox1 = ikcp_mailbox_create(kcp1, 64);
+    mailbox2 = ikcp_mailbox_create(kcp2, 16);
+    check_finished = 0;
+    check_stop = 0;
+    for (i = 0; i <= CHECK_PRODUCERS; i++) {
+        boxes[i].mailbox = (i < CHECK_PRODUCERS)? mailbox1 : mailbox2;
+        boxes[i].id = i;
+        boxes[i].count = 0;
+        boxes[i].bad = 0;
+        pthread_create(&threads[i], NULL, (i < CHECK_PRODUCERS)?
+            check_producer : check_consumer, &boxes[i]);
+    }
+
+    // this thread owns both kcp objects
+    pfds[0].fd = ikcp_mailbox_send_fd(mailbox1);
+    pfds[1].fd = ikcp_mailbox_send_fd(mailbox2);
+    pfds[0].events = pfds[1].events = POLLIN;
+    start = iclock();
+    while (!__atomic_load_n(&check_finished, __ATOMIC_ACQUIRE) &&
+        iclock() - start < 60000) {
+        poll(pfds, 2, 1);
+        for (i = 0; i < 2; i++) {
+            if (read(pfds[i].fd, &value, sizeof(value)) < 0) {
+                // not signalled
+            }
+        }
+        check_run(kcp1, kcp2, 1);
+    }
+    __atomic_store_n(&check_stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i <= CHECK_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK(boxes[CHECK_PRODUCERS].count == CHECK_PRODUCERS * CHECK_MESSAGES);
+    CHECK(boxes[CHECK_PRODUCERS].bad == 0);
+    ikcp_mailbox_release(mailbox1);
+    ikcp_mailbox_release(mailbox2);
+    check_end(kcp1, kcp2);
+}
+#endif
+
+// a congestion controller counting what it is told
+static struct {
+    int init, release, ack, acked, fast, loss, send, freed;
+} check_cc_n;
+
+static int check_cc_init(ikcpcb *kcp)
+{
+    check_cc_n.init++;
+    kcp->cc_state = &check_cc_n;
+    return 0;
+}
+
+static void check_cc_release(ikcpcb *kcp)
+{
+    if (kcp->cc_state == &check_cc_n) check_cc_n.release++;
+}
+
+static void check_cc_acked(ikcpcb *kcp, const IKCPSEG *seg)
+{
+    (void)kcp;
+    (void)seg;
+    check_cc_n.freed++;
+}
+
+static void check_cc_ack(ikcpcb *kcp, const IKCPACKSAMPLE *sample)
+{
+    (void)kcp;
+    check_cc_n.ack++;
+    check_cc_n.acked += (int)sample->acked;
+}
+
+static void check_cc_fast(ikcpcb *kcp, IUINT32 count)
+{
+    (void)kcp;
+    check_cc_n.fast += (int)count;
+}
+
+static void check_cc_loss(ikcpcb *kcp, IUINT32 cwnd)
+{
+    (void)kcp;
+    (void)cwnd;
+    check_cc_n.loss++;
+}
+
+static void check_cc_send(ikcpcb *kcp, IKCPSEG *seg)
+{
+    (void)kcp;
+    (void)seg;
+    check_cc_n.send++;
+}
+
+static int check_cc_refuse(ikcpcb *kcp)
+{
+    (void)kcp;
+    return -1;
+}
+
+static const IKCPCC check_cc = { "check", check_cc_init, check_cc_release,
+    check_cc_acked, check_cc_ack, check_cc_fast, check_cc_loss,
+    check_cc_send };
+static const IKCPCC check_cc_broken = { "broken", check_cc_refuse, NULL,
+    NULL, NULL, NULL, NULL, NULL };
+
+// congestion controller swap: hooks see every send, ack and fast
+// retransmit once installed, the state is released on swap and release
+static void check_cc_swap()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[64];
+    int i;
+
+    memset(&check_cc_n, 0, sizeof(check_cc_n));
+    check_begin(&kcp1, &kcp2, 1);
+    CHECK(kcp1->cc == &ikcp_cc_reno);
+    CHECK(ikcp_setcc(kcp1, &check_cc) == 0);
+    CHECK(ikcp_setcc(kcp1, &check_cc) == 0);
+    CHECK(kcp1->cc == &check_cc && kcp1->cc_state == &check_cc_n);
+    CHECK(check_cc_n.init == 1 && check_cc_n.release == 0);
+
+    // a controller failing to set up leaves the current one in place
+    CHECK(ikcp_setcc(kcp1, &check_cc_broken) < 0);
+    CHECK(kcp1->cc == &check_cc && kcp1->cc_state == &check_cc_n);
+
+    check_drop = check_drop_tenth;
+    for (i = 0; i < 20; i++) ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 300);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    CHECK(check_cc_n.send == check_cmds[0][0]);
+    CHECK(check_cc_n.acked == 20 && check_cc_n.ack > 0);
+    CHECK(check_cc_n.freed == 20);
+    CHECK(check_cc_n.fast > 0);
+
+    // back to reno, which the counters don't see any more
+    CHECK(ikcp_setcc(kcp1, NULL) == 0);
+    CHECK(kcp1->cc == &ikcp_cc_reno && check_cc_n.release == 1);
+    i = check_cc_n.send;
+    ikcp_send(kcp1, buffer, 8);
+    check_run(kcp1, kcp2, 50);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt && check_cc_n.send == i);
+
+    CHECK(ikcp_setcc(kcp1, &check_cc) == 0 && check_cc_n.init == 2);
+    check_end(kcp1, kcp2);
+    CHECK(check_cc_n.release == 2);
+}
+
+// reno with several datagrams acked in one input: slow start stops at
+// ssthresh and congestion avoidance takes the rest, within a segment of
+// as many single steps, and cwnd never passes rmt_wnd
+static void check_reno_grow(ikcpcb *kcp, IUINT32 cwnd, IUINT32 ssthresh,
+    IUINT32 rmt_wnd, IUINT32 advance, IUINT32 steps)
+{
+    IKCPACKSAMPLE sample;
+    IUINT32 i;
+    kcp->cwnd = cwnd;
+    kcp->ssthresh = ssthresh;
+    kcp->rmt_wnd = rmt_wnd;
+    kcp->incr = cwnd * kcp->mss;
+    sample.advance = advance;
+    sample.acked = advance;
+    for (i = 0; i < steps; i++) ikcp_cc_reno.on_ack(kcp, &sample);
+}
+
+static void check_reno_ack()
+{
+    ikcpcb *kcp1, *kcp2;
+    IUINT32 cwnd, incr;
+
+    check_begin(&kcp1, &kcp2, 0);
+    check_reno_grow(kcp1, 2, 5, 128, 2, 1);
+    CHECK(kcp1->cwnd == 4 && kcp1->incr == 4 * kcp1->mss);
+    check_reno_grow(kcp1, 2, 5, 128, 1, 10);
+    cwnd = kcp1->cwnd;
+    incr = kcp1->incr;
+    check_reno_grow(kcp1, 2, 5, 128, 10, 1);
+    CHECK(kcp1->cwnd >= 5 && kcp1->cwnd <= cwnd + 1);
+    CHECK(kcp1->incr >= incr && kcp1->incr < incr + kcp1->mss);
+    check_reno_grow(kcp1, 2, 100, 6, 10, 1);
+    CHECK(kcp1->cwnd == 6 && kcp1->incr == 6 * kcp1->mss);
+    check_reno_grow(kcp1, 6, 2, 6, 10, 1);
+    CHECK(kcp1->cwnd == 6 && kcp1->incr == 6 * kcp1->mss);
+    check_end(kcp1, kcp2);
+}
+
+// drive the congestion controller of 'kcp' by hand: 'seg' is sent, or
+// acked by an ack batch of its own, at 'current'
+static void check_cc_sent(ikcpcb *kcp, IKCPSEG *seg, IUINT32 current)
+{
+    kcp->current = current;
+    seg->ts = current;
+    seg->xmit++;
+    kcp->cc->on_send(kcp, seg);
+}
+
+static void check_cc_acked_at(ikcpcb *kcp, IKCPSEG *seg, IUINT32 current)
+{
+    IKCPACKSAMPLE sample;
+    memset(&sample, 0, sizeof(sample));
+    kcp->current = current;
+    kcp->cc->on_acked(kcp, seg);
+    kcp->cc->on_ack(kcp, &sample);
+}
+
+// bbr: segment 2 is delayed, 3 and 4 acked, then 2 fast retransmitted.
+// the ack of its first copy comes 1ms later: 1 segment in 2ms would be
+// 10 times the bandwidth, a sample shorter than min_rtt is discarded
+static void check_bbr_spurious()
+{
+    ikcpcb *kcp1, *kcp2;
+    struct IKCPBBR *bbr;
+    IKCPSEG seg[5];
+    IUINT32 btlbw;
+    int i;
+
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_setcc(kcp1, &ikcp_cc_bbr) == 0);
+    bbr = (struct IKCPBBR*)kcp1->cc_state;
+    memset(seg, 0, sizeof(seg));
+    for (i = 0; i < 5; i++) seg[i].sn = i;
+
+    // one segment per 20ms round trip
+    for (i = 0; i < 2; i++) {
+        kcp1->snd_nxt = i + 1;
+        check_cc_sent(kcp1, &seg[i], 1000 + i * 20);
+        check_cc_acked_at(kcp1, &seg[i], 1020 + i * 20);
+        kcp1->snd_una = i + 1;
+    }
+    CHECK(bbr->min_rtt == 20 && bbr->btlbw == 50 * IKCP_BBR_UNIT);
+
+    kcp1->snd_nxt = 5;
+    for (i = 2; i < 5; i++) check_cc_sent(kcp1, &seg[i], 1038 + i);
+    check_cc_acked_at(kcp1, &seg[3], 1061);
+    check_cc_acked_at(kcp1, &seg[4], 1062);
+    btlbw = bbr->btlbw;
+    check_cc_sent(kcp1, &seg[2], 1063);
+    check_cc_acked_at(kcp1, &seg[2], 1064);
+    kcp1->snd_una = 5;
+    CHECK(bbr->btlbw == btlbw);
+    check_end(kcp1, kcp2);
+}
+
+// pacing: with a rate set, a burst leaves data queued for pace_next
+// instead of sending the whole window in one flush
+static void check_pacing()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[1400];
+    int i, sent;
+
+    memset(buffer, 0, sizeof(buffer));
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_wndsize(kcp1, 128, 128);
+    ikcp_wndsize(kcp2, 128, 128);
+
+    // unpaced: the whole burst in one flush
+    for (i = 0; i < 20; i++) ikcp_send(kcp1, buffer, (int)kcp1->mss);
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    CHECK(kcp1->nsnd_que == 0 && kcp1->nsnd_buf == 20);
+    CHECK(kcp1->pace_wait == 0);
+    check_run(kcp1, kcp2, 100);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+
+    // 100 bytes per millisec, two datagrams of burst
+    ikcp_pacing(kcp1, 1);
+    kcp1->pacing_rate = 100000;
+    sent = check_cmds[0][0];     // pushes
+    for (i = 0; i < 20; i++) ikcp_send(kcp1, buffer, (int)kcp1->mss);
+    check_clock += 10;
+    ikcp_update(kcp1, check_clock);
+    CHECK(check_cmds[0][0] - sent <= 2);
+    CHECK(kcp1->nsnd_que >= 18);
+    CHECK(kcp1->pace_wait == 1);
+    CHECK(_itimediff(kcp1->pace_next, check_clock) > 0);
+    CHECK(ikcp_check(kcp1, check_clock) == kcp1->pace_next);
+
+    // about 10000 bytes more in 100ms
+    check_run(kcp1, kcp2, 100);
+    CHECK(check_cmds[0][0] - sent >= 7 && check_cmds[0][0] - sent <= 10);
+    CHECK(kcp1->nsnd_que > 0 && kcp1->pace_wait == 1);
+    check_run(kcp1, kcp2, 300);
+    CHECK(kcp1->nsnd_que == 0 && kcp1->snd_una == kcp1->snd_nxt);
+    CHECK(kcp1->pace_wait == 0);
+    for (i = 0; i < 40; i++) {
+        CHECK(ikcp_recv(kcp2, buffer, 1400) == (int)kcp1->mss);
+    }
+    check_end(kcp1, kcp2);
+}
+
+// microsec mode: a sub-millisec round trip is measured rather than
+// rounded up to whole millisec, and the millisec calls still work
+static void check_usec()
+{
+    ikcpcb *kcp1, *kcp2;
+    char buffer[64];
+    IUINT64 now = (IUINT64)check_clock * 1000;
+    int i;
+
+    check_begin(&kcp1, &kcp2, 0);
+    CHECK(ikcp_usec(kcp1, 1) == 0 && ikcp_usec(kcp2, 1) == 0);
+    CHECK(kcp1->clock == 1000 && kcp1->interval == 10000);
+    ikcp_interval_us(kcp1, 200);
+    ikcp_interval_us(kcp2, 200);
+    kcp1->rx_minrto = 1000;
+
+    // 100us steps for 5ms
+    for (i = 0; i < 10; i++) ikcp_send(kcp1, buffer, 8);
+    for (i = 0; i < 50; i++) {
+        now += 100;
+        ikcp_update_us(kcp1, now);
+        ikcp_update_us(kcp2, now);
+        check_deliver(kcp1, kcp2);
+    }
+    CHECK(kcp1->snd_una == kcp1->snd_nxt && kcp2->nrcv_que == 10);
+    CHECK(kcp1->rx_srtt > 0 && kcp1->rx_srtt < 1000);
+    CHECK(kcp1->rx_rto >= 1000 && kcp1->rx_rto < 5000);
+    CHECK(ikcp_check_us(kcp1, now) <= now + 200);
+    CHECK(ikcp_usec(kcp1, 0) < 0);
+
+    check_clock = (IUINT32)(now / 1000) + 1;
+    ikcp_update(kcp1, check_clock);
+    CHECK(kcp1->current == check_clock * 1000);
+    check_end(kcp1, kcp2);
+}
+
+// immediate mode: sends and inputs go out without waiting for an
+// update, one flush per call
+static void check_immediate()
+{
+    ikcpcb *kcp1, *kcp2;
+    static char dgrams[3][1400];
+    char buffer[4200];
+    ikcp_iovec iov[3];
+    int i, dgrams1, acks;
+
+    check_begin(&kcp1, &kcp2, 0);
+    ikcp_immediate(kcp1, 1);
+    ikcp_immediate(kcp2, 1);
+    check_run(kcp1, kcp2, 1);
+    memset(buffer, 7, sizeof(buffer));
+
+    // three fragments, sent by ikcp_send itself
+    CHECK(ikcp_send(kcp1, buffer, (int)kcp1->mss * 3) == 0);
+    CHECK(check_cmds[0][0] == 3 && kcp1->nsnd_buf == 3);
+    for (i = 0; i < 3; i++) {
+        int hr = vnet->recv(1, dgrams[i], 1400);
+        CHECK(hr > 0);
+        iov[i].iov_base = dgrams[i];
+        iov[i].iov_len = (hr > 0)? hr : 0;
+    }
+
+    // acked by the input batch, all in one datagram
+    dgrams1 = check_dgrams[1];
+    acks = check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH];
+    CHECK(ikcp_input_batch(kcp2, iov, 3, NULL) == 3);
+    CHECK(check_dgrams[1] == dgrams1 + 1);
+    CHECK(check_cmds[1][IKCP_CMD_ACK - IKCP_CMD_PUSH] == acks + 3);
+    check_deliver(kcp1, kcp2);
+    CHECK(kcp1->snd_una == kcp1->snd_nxt);
+    CHECK(ikcp_recv(kcp2, buffer, sizeof(buffer)) == (int)kcp1->mss * 3);
+
+    // switched off, the next message waits for ikcp_update
+    ikcp_immediate(kcp1, 0);
+    ikcp_send(kcp1, buffer, 8);
+    CHECK(check_cmds[0][0] == 3);
+    check_run(kcp1, kcp2, 10);
+    CHECK(check_cmds[0][0] == 4);
+    check_end(kcp1, kcp2);
+}
+
+static int check()
+{
+    check_rcv_ring();
+    check_pool();
+    check_allocator();
+    check_rto_heap();
+    check_snd_ring();
+    check_sack();
+    check_delack();
+    check_recv_view();
+    check_sendv();
+    check_send_ref();
+    check_batch();
+#ifdef KCP_TEST_UDP
+    check_udp();
+#endif
+#ifdef KCP_TEST_URING
+    check_uring();
+#endif
+#ifdef KCP_TEST_SHARD
+    check_shard();
+#endif
+    check_provider();
+    check_input_batch();
+    check_table();
+    check_sched();
+#ifdef KCP_TEST_MAILBOX
+    check_mailbox();
+#endif
+    check_cc_swap();
+    check_reno_ack();
+    check_bbr_spurious();
+    check_pacing();
+    check_usec();
+    check_immediate();
+    printf("%s\n", check_failed? "checks failed" : "checks passed");
+    return check_failed? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "check") == 0) {
+        return check();
+    }
     test(0);    // 默认模式，类似 TCP：正常模式，无快速重传，常规流控
     test(1);    // 普通模式，关闭流控等
     test(2);    // 快速模式，所有开关都打开，且关闭流控
+    test(3);    // bbr mode: model based congestion control
+    test(4);    // usec mode: fast mode on a microsec clock
+    test(5);    // immediate mode: fast mode flushing from send and input
     return 0;
 }
 